@@ -8,7 +8,12 @@
 
 #include "Engine/Canvas.hpp"
 #include "Engine/Layer.hpp"
+#include "Engine/TileTree.hpp"
+#include "Engine/Util/Blend.hpp"
+#include "Engine/Util/Morton.hpp"
 #include "Engine/Util/StructMeta.hpp"
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseSet.h>
 #include <llvm/ADT/Optional.h>
 #include <llvm/ADT/SmallString.h>
 #include <llvm/ADT/StringRef.h>
@@ -21,11 +26,18 @@
 #include <llvm/Support/YAMLParser.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/system_error.h>
+#include <tbb/blocked_range.h>
 #include <tbb/blocked_range2d.h>
 #include <tbb/parallel_for.h>
 #include <atomic>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
 #include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <tuple>
 #include <vector>
 
 //fixme mac-specific
@@ -37,24 +49,21 @@ namespace Mega {
     using namespace llvm;
     
     constexpr size_t DEFAULT_LOG_SIZE = 7;
+    constexpr size_t MAX_DIRTY_LOG = 1024;
+    constexpr size_t DEFAULT_HISTORY_BUDGET = 256 << 20;
     
     size_t swizzle(size_t x, size_t y)
     {
-        assert(x <= 0xFFFF && y <= 0xFFFF);
-        static const unsigned int B[] = {0x55555555, 0x33333333, 0x0F0F0F0F, 0x00FF00FF};
-        static const unsigned int S[] = {1, 2, 4, 8};
-        
-        x = (x | (x << S[3])) & B[3];
-        x = (x | (x << S[2])) & B[2];
-        x = (x | (x << S[1])) & B[1];
-        x = (x | (x << S[0])) & B[0];
-        
-        y = (y | (y << S[3])) & B[3];
-        y = (y | (y << S[2])) & B[2];
-        y = (y | (y << S[1])) & B[1];
-        y = (y | (y << S[0])) & B[0];
-        
-        return x | (y << 1);
+        assert(x <= UINT32_MAX && y <= UINT32_MAX);
+        return size_t(mortonEncode(uint32_t(x), uint32_t(y)));
+    }
+    
+    void unswizzle(size_t i, size_t *outX, size_t *outY)
+    {
+        uint32_t x, y;
+        mortonDecode(i, &x, &y);
+        *outX = x;
+        *outY = y;
     }
 
     //
@@ -62,23 +71,56 @@ namespace Mega {
     //
     
     struct History;
+    struct SpliceOp;
+    struct DeltaOp;
+    struct BlitJob;
+    struct BlitParams;
 
     template<>
     struct Priv<Canvas> {
         const size_t tileLogSize, tileLogByteSize;
         vector<Priv<Layer>> layers;
         string tilesPath;
-        size_t tileCount;
+        atomic<size_t> tileCount;
+        // bumped by every change to a layer's tiles; see Layer::epoch()
+        atomic<size_t> epoch;
         bool isUniquePath;
         vector<MappedFile> tileCache;
         vector<History> undo, redo;
+        // History entries past historyMemoryBudget bytes, counting back from
+        // the most recent, are moved to historyJournal (opened on demand).
+        size_t historyMemoryBudget, maxHistoryDepth;
+        FILE *historyJournal;
+        // While undoGroupDepth is nonzero, entries go into the GroupOp on top
+        // of the undo stack. Otherwise an entry pushed under the same name
+        // within undoCoalesceWindow of lastEdit (if set) joins the one
+        // before it.
+        size_t undoGroupDepth;
+        chrono::milliseconds undoCoalesceWindow;
+        chrono::steady_clock::time_point lastEdit;
+        
+        // blitAsync jobs that have not been published to `layers` yet, in
+        // submission order. tileMutex guards tileCache, pendingTiles, the
+        // tiles reserved by a running job that are not yet on disk, and
+        // opaqueTiles, the tiles saved this session with no transparent
+        // pixels. (Tiles loaded from disk are assumed not to be opaque.)
+        deque<shared_ptr<BlitJob>> blitJobs;
+        mutex tileMutex;
+        condition_variable tileSaved;
+        DenseSet<size_t> pendingTiles;
+        BitVector opaqueTiles;
+        
+        // tiles of a single color saved by fillRect, so that fills share them
+        map<Canvas::pixel_t, size_t> solidTiles;
         
         Priv(string *outError,
              size_t logSize = DEFAULT_LOG_SIZE,
              StringRef tilesPath = "")
         : tileLogSize(logSize), tileLogByteSize((logSize << 1) + 2),
-        tilesPath(tilesPath), tileCount(0),
-        isUniquePath(false)
+        tilesPath(tilesPath), tileCount(0), epoch(0),
+        isUniquePath(false),
+        historyMemoryBudget(DEFAULT_HISTORY_BUDGET), maxHistoryDepth(0), historyJournal(nullptr),
+        undoGroupDepth(0), undoCoalesceWindow(0)
         {
             if (tilesPath.empty()) {
                 //fixme proper system-aware temp path
@@ -100,12 +142,17 @@ namespace Mega {
              StringRef tilesPath, size_t tileCount)
         :
         tileLogSize(logSize), tileLogByteSize((logSize << 1) + 2), layers(layers),
-        tilesPath(tilesPath), tileCount(tileCount), isUniquePath(false)
+        tilesPath(tilesPath), tileCount(tileCount), epoch(0), isUniquePath(false),
+        historyMemoryBudget(DEFAULT_HISTORY_BUDGET), maxHistoryDepth(0), historyJournal(nullptr),
+        undoGroupDepth(0), undoCoalesceWindow(0)
         {
             $.tileCache.resize(tileCount);
         }
         
         ~Priv() {
+            $.waitForBlits();
+            if ($.historyJournal)
+                fclose($.historyJournal);
             if ($.isUniquePath) {
                 uint32_t removed;
                 sys::fs::remove_all($.tilesPath, removed);
@@ -125,6 +172,8 @@ namespace Mega {
         ArrayRef<uint8_t> tile(size_t i, string *outError)
         {
             assert(i >= 1 && i <= $.tileCount);
+            unique_lock<mutex> lock($.tileMutex);
+            $.waitForTile(i, lock);
             MappedFile &file = $.tileCache[i-1];
             if (!file) {
                 string error;
@@ -148,8 +197,55 @@ namespace Mega {
         }
         
         bool saveTile(size_t i, uint8_t const *image, string *outError);
+        bool tileIsOpaque(size_t i)
+        {
+            lock_guard<mutex> lock($.tileMutex);
+            return i < $.opaqueTiles.size() && $.opaqueTiles[i];
+        }
+        size_t reserveTiles(size_t count);
+        size_t solidTile(Canvas::pixel_t color);
+        void fillTiles(Priv<Layer> &layer, ptrdiff_t x, ptrdiff_t y, ptrdiff_t w, ptrdiff_t h,
+                       Canvas::pixel_t color, size_t fullTile);
+        void copyTiles(Priv<Layer> &source, ptrdiff_t sourceX, ptrdiff_t sourceY,
+                       Priv<Layer> &dest, ptrdiff_t destX, ptrdiff_t destY,
+                       ptrdiff_t w, ptrdiff_t h);
+        void mergeTiles(Priv<Layer> &dest, MutableArrayRef<Priv<Layer>> sources);
+        void tileWasSaved(size_t i);
+        void waitForTile(size_t i, unique_lock<mutex> &lock)
+        {
+            while ($.pendingTiles.count(i))
+                $.tileSaved.wait(lock);
+        }
         
-        void applyHistory(vector<History> &from, vector<History> &to);
+        bool runBlit(BlitJob &job, BlitParams const &params);
+        void publishBlits();
+        void waitForBlits();
+        void finishBlits() { $.waitForBlits(); $.publishBlits(); }
+        
+        template<typename Op>
+        void pushUndo(StringRef name, Op &&op)
+        {
+            // the entry being pushed is for an edit that hasn't happened
+            // yet, so this is when the previous edit's entry can be
+            // compacted and weighed
+            $.redo.clear();
+            $.compactUndo();
+            $.trimHistory();
+            $.pushHistory(History(name, std::forward<Op>(op)));
+        }
+        void pushHistory(History &&item);
+        void closeUndoGroup();
+        void compactUndo();
+        bool compactReplace(History &item);
+        bool mergeDeltas(History &earlier, History &later);
+        void applyDelta(DeltaOp &op);
+        void trimHistory();
+        bool spillHistory(History &item);
+        bool unspillHistory(History &item, string *outError);
+        bool applyHistory(vector<History> &from, vector<History> &to, string *outError);
+        void applyHistoryItem(History &&item, vector<History> &to);
+        void spliceLayers(SpliceOp &op);
+        void layersMoved(size_t begin, size_t end);
     };
     MEGA_PRIV_DTOR(Canvas)
 
@@ -157,29 +253,53 @@ namespace Mega {
     struct Priv<Layer> {
         Vec parallax;
         Vec origin;
-        vector<Layer::tile_t> tiles;
+        // copies share tiles' nodes, so snapshotting a layer for undo is cheap
+        TileTree tiles;
         size_t quadtreeDepth;
+        
+        // The canvas epoch of the layer's last change, and a log of the tiles
+        // changed since rescanEpoch. Anyone who last looked at the layer
+        // before rescanEpoch has to rescan it.
+        struct DirtyTile { size_t epoch; ptrdiff_t x, y; };
+        size_t epoch, rescanEpoch;
+        vector<DirtyTile> dirtyTiles;
 
         Priv()
-        : parallax{1.0, 1.0}, origin{0.0, 0.0}, quadtreeDepth(0)
+        : parallax{1.0, 1.0}, origin{0.0, 0.0}, quadtreeDepth(0), epoch(0), rescanEpoch(0)
         {}
 
         Priv(Vec parallax, Vec origin, size_t quadtreeDepth, vector<Layer::tile_t> &&tiles)
-        : parallax(parallax), origin(origin), quadtreeDepth(quadtreeDepth), tiles(tiles)
+        : parallax(parallax), origin(origin), tiles(quadtreeDepth, tiles), quadtreeDepth(quadtreeDepth),
+        epoch(0), rescanEpoch(0)
         {}
         
-        Layer::tile_t *segmentCorner(ptrdiff_t quadrantSize,
-                                     ptrdiff_t x, ptrdiff_t y);
+        size_t segmentIndex(ptrdiff_t quadrantSize,
+                            ptrdiff_t x, ptrdiff_t y);
         
-        void reserve(ptrdiff_t x, ptrdiff_t y, ptrdiff_t w, ptrdiff_t h,
+        // Grows the layer to cover the given pixel rectangle, returning
+        // whether it had to. Each doubling wraps the tile tree's root in a new
+        // one, so growth never copies the tiles already there.
+        bool reserve(ptrdiff_t x, ptrdiff_t y, ptrdiff_t w, ptrdiff_t h,
                      ptrdiff_t tileSize);
-        void setTile(ptrdiff_t x, ptrdiff_t y, size_t tile);
+        void setTile(ptrdiff_t x, ptrdiff_t y, size_t tile, bool opaque);
+        
+        void markDirty(ptrdiff_t x, ptrdiff_t y, size_t epoch);
+        void markAllDirty(size_t epoch);
+        void markChangedFrom(Priv<Layer> const &other, size_t epoch);
+        
+        size_t memorySize() const
+        {
+            return tiles.ownedMemorySize() + dirtyTiles.capacity()*sizeof(DirtyTile);
+        }
     };
     MEGA_PRIV_DTOR(Layer)
 
     struct ReplaceOp {
         size_t index;
         Priv<Layer> layer;
+        // set once compactReplace() has tried turning this into a DeltaOp,
+        // so a snapshot that didn't shrink isn't diffed again
+        bool compacted;
     };
     struct InsertOp {
         size_t index;
@@ -196,10 +316,39 @@ namespace Mega {
         size_t index;
         Vec parallax;
     };
+    // replaces `count` layers starting at `index` with `layers`
+    struct SpliceOp {
+        size_t index;
+        size_t count;
+        vector<Priv<Layer>> layers;
+    };
+    // Changes to some of a layer's tiles, each with its current (`from`) and
+    // restored (`to`) id. Restoring them can also grow the layer to, or
+    // shrink it to, toOrigin and toDepth; tile indices are in the larger of
+    // the two layouts. Applying the op turns it into its own inverse.
+    struct DeltaOp {
+        struct Change {
+            size_t index;
+            Layer::tile_t from, to;
+        };
+        size_t index;
+        Vec fromOrigin, toOrigin;
+        size_t fromDepth, toDepth;
+        vector<Change> changes;
+    };
+    // several entries undone and redone as one, oldest first
+    struct GroupOp {
+        vector<History> items;
+    };
+    // stands in for an entry saved to the history journal
+    struct SpilledOp {
+        long offset;
+        size_t size;
+    };
 
     struct History {
         string name;
-        enum class Tag { Replace, Insert, Erase, Move, SetParallax } tag;
+        enum class Tag { Replace, Insert, Erase, Move, SetParallax, Splice, Delta, Group, Spilled } tag;
         
         union {
             ReplaceOp replace;
@@ -207,6 +356,10 @@ namespace Mega {
             EraseOp erase;
             MoveOp move;
             SetParallaxOp setParallax;
+            SpliceOp splice;
+            DeltaOp delta;
+            GroupOp group;
+            SpilledOp spilled;
         };
         
         History(StringRef name, ReplaceOp &&replace)
@@ -224,6 +377,18 @@ namespace Mega {
         History(StringRef name, SetParallaxOp &&set)
         : name(name), tag(Tag::SetParallax), setParallax(set)
         {}
+        History(StringRef name, SpliceOp &&splice)
+        : name(name), tag(Tag::Splice), splice(std::move(splice))
+        {}
+        History(StringRef name, DeltaOp &&delta)
+        : name(name), tag(Tag::Delta), delta(std::move(delta))
+        {}
+        History(StringRef name, GroupOp &&group)
+        : name(name), tag(Tag::Group), group(std::move(group))
+        {}
+        History(StringRef name, SpilledOp &&spilled)
+        : name(name), tag(Tag::Spilled), spilled(spilled)
+        {}
 
         History(History &&h)
         : name(std::move(h.name)), tag(h.tag)
@@ -244,8 +409,26 @@ namespace Mega {
                 case Tag::SetParallax:
                     new (&setParallax) SetParallaxOp(std::move(h.setParallax));
                     break;
+                case Tag::Splice:
+                    new (&splice) SpliceOp(std::move(h.splice));
+                    break;
+                case Tag::Delta:
+                    new (&delta) DeltaOp(std::move(h.delta));
+                    break;
+                case Tag::Group:
+                    new (&group) GroupOp(std::move(h.group));
+                    break;
+                case Tag::Spilled:
+                    new (&spilled) SpilledOp(std::move(h.spilled));
+                    break;
             }
         }
+        History &operator=(History &&h)
+        {
+            this->~History();
+            new (this) History(std::move(h));
+            return *this;
+        }
         ~History() {
             switch (tag) {
                 case Tag::Replace:
@@ -263,10 +446,68 @@ namespace Mega {
                 case Tag::SetParallax:
                     setParallax.~SetParallaxOp();
                     break;
+                case Tag::Splice:
+                    splice.~SpliceOp();
+                    break;
+                case Tag::Delta:
+                    delta.~DeltaOp();
+                    break;
+                case Tag::Group:
+                    group.~GroupOp();
+                    break;
+                case Tag::Spilled:
+                    spilled.~SpilledOp();
+                    break;
+            }
+        }
+        
+        // the memory only this entry holds onto
+        size_t memorySize() const
+        {
+            switch (tag) {
+                case Tag::Replace:
+                    return replace.layer.memorySize();
+                case Tag::Insert:
+                    return insert.layer.memorySize();
+                case Tag::Splice: {
+                    size_t size = 0;
+                    for (auto &layer : splice.layers)
+                        size += layer.memorySize();
+                    return size;
+                }
+                case Tag::Delta:
+                    return delta.changes.capacity()*sizeof(DeltaOp::Change);
+                case Tag::Group: {
+                    size_t size = 0;
+                    for (auto &item : group.items)
+                        size += item.memorySize();
+                    return size;
+                }
+                default:
+                    return 0;
             }
         }
     };
 
+    struct BlitParams {
+        void const *source;
+        size_t sourcePitch, sourceW, sourceH;
+        ptrdiff_t destX, destY;
+        Canvas::pixel_t (*blendFunc)(Canvas::pixel_t src, Canvas::pixel_t dest);
+    };
+    
+    // A blit in flight. `layer` starts as a copy of the destination layer (or
+    // is copied from `base`, an earlier job into the same layer, once that
+    // job finishes) and holds the blit's result when `done` is ready.
+    struct BlitJob {
+        string name;
+        size_t destLayer;
+        Priv<Layer> layer;
+        shared_ptr<BlitJob> base;
+        shared_future<Canvas::BlitResult> done;
+        string error;
+    };
+
     //
     // Canvas implementation
     //
@@ -459,8 +700,17 @@ error:
     }
 
     MEGA_PRIV_GETTER(Canvas, tileLogSize, size_t)
-    MEGA_PRIV_GETTER(Canvas, layers, PrivArrayRef<Layer>)
     MEGA_PRIV_GETTER(Canvas, tileCount, size_t)
+    
+    PrivArrayRef<Layer> Canvas::layers()
+    {
+        return $.layers;
+    }
+    
+    void Canvas::publish()
+    {
+        $.publishBlits();
+    }
 
     size_t Canvas::tileSize()
     {
@@ -479,6 +729,7 @@ error:
     
     bool Canvas::verifyTiles(string *outError)
     {
+        $.finishBlits();
         using namespace llvm;
         using namespace sys;
         raw_string_ostream errors(*outError);
@@ -606,6 +857,10 @@ error:
     {
         assert(index >= 1 && index <= $.tileCount);
         assert(outBuffer.size() >= $$.tileByteSize());
+        {
+            unique_lock<mutex> lock($.tileMutex);
+            $.waitForTile(index, lock);
+        }
         SmallString<260> path;
         $.makeTilePath(index, &path);
         
@@ -639,38 +894,121 @@ error:
     
     void Canvas::wasMoved(StringRef newPath)
     {
+        $.finishBlits();
         $.tilesPath = newPath;
         $.isUniquePath = false;
     }
     
+    //
+    // TileWriter saves freshly rendered tiles for a layer. write() may be called
+    // concurrently from tbb workers; the layer's tile map is only updated by
+    // commit(), once all the workers are done. A writer either allocates tile
+    // indices past the canvas's tile count, which commit() then publishes, or
+    // fills a range the caller reserved up front with reserveTiles().
+    //
+    struct TileWriter {
+        Priv<Canvas> &canvas;
+        Priv<Layer> &layer;
+        std::atomic<size_t> nextTile;
+        size_t endTile;
+        std::mutex writtenMutex;
+        vector<tuple<ptrdiff_t, ptrdiff_t, size_t>> written;
+
+        TileWriter(Priv<Canvas> &canvas, Priv<Layer> &layer)
+        : canvas(canvas), layer(layer), nextTile(canvas.tileCount+1), endTile(0)
+        {}
+
+        TileWriter(Priv<Canvas> &canvas, Priv<Layer> &layer, size_t firstTile, size_t count)
+        : canvas(canvas), layer(layer), nextTile(firstTile), endTile(firstTile + count)
+        {}
+
+        bool write(ptrdiff_t x, ptrdiff_t y, uint8_t const *pixels, string *outError)
+        {
+            return write(make_pair(x, y), pixels, outError);
+        }
+        
+        // saves one tile to be shared by several positions
+        bool write(ArrayRef<pair<ptrdiff_t, ptrdiff_t>> positions, uint8_t const *pixels,
+                   string *outError)
+        {
+            size_t newTile = nextTile.fetch_add(1);
+            assert(endTile == 0 || newTile < endTile);
+            bool ok = canvas.saveTile(newTile, pixels, outError);
+            if (endTile != 0)
+                canvas.tileWasSaved(newTile);
+            if (!ok)
+                return false;
+            lock_guard<mutex> lock(writtenMutex);
+            for (auto &position : positions)
+                written.emplace_back(position.first, position.second, newTile);
+            return true;
+        }
+
+        void commit()
+        {
+            size_t epoch = ++canvas.epoch;
+            for (auto &tile : written) {
+                layer.setTile(get<0>(tile), get<1>(tile), get<2>(tile),
+                              canvas.tileIsOpaque(get<2>(tile)));
+                layer.markDirty(get<0>(tile), get<1>(tile), epoch);
+            }
+            written.clear();
+            if (endTile == 0) {
+                lock_guard<mutex> lock(canvas.tileMutex);
+                canvas.tileCount = nextTile.load() - 1;
+                canvas.tileCache.resize(canvas.tileCount);
+            }
+        }
+    };
+    
+    size_t Priv<Canvas>::reserveTiles(size_t count)
+    {
+        lock_guard<mutex> lock($.tileMutex);
+        size_t first = $.tileCount + 1;
+        $.tileCount += count;
+        $.tileCache.resize($.tileCount);
+        for (size_t i = first; i < first + count; ++i)
+            $.pendingTiles.insert(i);
+        return first;
+    }
+    
+    void Priv<Canvas>::tileWasSaved(size_t i)
+    {
+        lock_guard<mutex> lock($.tileMutex);
+        $.pendingTiles.erase(i);
+        $.tileSaved.notify_all();
+    }
+
     // fixme leave empty tiles as 0
     // fixme don't copy unaffected tiles
-    void Canvas::blit(StringRef name,
-                      const void *source,
-                      size_t sourcePitch, size_t sourceW, size_t sourceH,
-                      size_t destLayer, ptrdiff_t destX, ptrdiff_t destY,
-                      pixel_t (*blendFunc)(pixel_t, pixel_t))
+    bool Priv<Canvas>::runBlit(BlitJob &job, BlitParams const &p)
     {
         using namespace std;
         using namespace tbb;
-        Priv<Layer> &layer = $.layers[destLayer];
-        $.undo.emplace_back(name, ReplaceOp{destLayer, layer});
-        layer.reserve(destX, destY, sourceW, sourceH, $$.tileSize());
-        Array2DRef<pixel_t> sourcePixels(reinterpret_cast<pixel_t const*>(source),
-                                         sourcePitch,
-                                         sourceH);
+        typedef Canvas::pixel_t pixel_t;
+        Priv<Layer> layer = job.layer;
+        if (layer.reserve(p.destX, p.destY, p.sourceW, p.sourceH, $$.tileSize()))
+            layer.markAllDirty(++$.epoch);
+        Array2DRef<pixel_t> sourcePixels(reinterpret_cast<pixel_t const*>(p.source),
+                                         p.sourcePitch,
+                                         p.sourceH);
         Vec origin = layer.origin;
         ptrdiff_t tileLogSize = $.tileLogSize;
         ptrdiff_t tileSize = $$.tileSize();
-        ptrdiff_t destXO = destX - ptrdiff_t(origin.x);
-        ptrdiff_t destYO = destY - ptrdiff_t(origin.y);
+        ptrdiff_t sourceW = p.sourceW, sourceH = p.sourceH;
+        ptrdiff_t destXO = p.destX - ptrdiff_t(origin.x);
+        ptrdiff_t destYO = p.destY - ptrdiff_t(origin.y);
         ptrdiff_t loTileX = destXO >> tileLogSize;
         ptrdiff_t loTileY = destYO >> tileLogSize;
-        ptrdiff_t hiTileX = (destXO + ptrdiff_t(sourceW) + tileSize - 1) >> tileLogSize;
-        ptrdiff_t hiTileY = (destYO + ptrdiff_t(sourceH) + tileSize - 1) >> tileLogSize;
+        ptrdiff_t hiTileX = (destXO + sourceW + tileSize - 1) >> tileLogSize;
+        ptrdiff_t hiTileY = (destYO + sourceH + tileSize - 1) >> tileLogSize;
+        auto blendFunc = p.blendFunc;
         
         blocked_range2d<ptrdiff_t> range(loTileY, hiTileY, loTileX, hiTileX);
-        std::atomic<size_t> nextTile($.tileCount+1);
+        size_t count = (hiTileY - loTileY)*(hiTileX - loTileX);
+        TileWriter writer($, layer, $.reserveTiles(count), count);
+        atomic<bool> ok(true);
+        mutex errorMutex;
         
         parallel_for(range, [&](blocked_range2d<ptrdiff_t> const &subrange) {
             unique_ptr<pixel_t[]> outPixelBuf(new pixel_t[$$.tileArea()]);
@@ -697,176 +1035,1865 @@ error:
                         for (ptrdiff_t ypix = 0; ypix < tileSize; ++ypix)
                             for (ptrdiff_t xpix = 0; xpix < tileSize; ++xpix)
                                 if (xsrc+xpix >= 0 && xsrc+xpix < sourceW && ysrc+ypix >= 0 && ysrc+ypix < sourceH)
-                                    outPixels[ypix][xpix] = blendFunc(sourcePixels[xsrc+xpix][ysrc+ypix],
-                                                                      destPixels[xpix][ypix]);
+                                    outPixels[ypix][xpix] = blendFunc(sourcePixels[ysrc+ypix][xsrc+xpix],
+                                                                      destPixels[ypix][xpix]);
                                 else
-                                    outPixels[ypix][xpix] = blendFunc({0,0,0,0}, destPixels[xpix][ypix]);
+                                    outPixels[ypix][xpix] = blendFunc({0,0,0,0}, destPixels[ypix][xpix]);
                     } else {
                         for (ptrdiff_t ypix = 0; ypix < tileSize; ++ypix)
                             for (ptrdiff_t xpix = 0; xpix < tileSize; ++xpix)
                                 if (xsrc+xpix >= 0 && xsrc+xpix < sourceW && ysrc+ypix >= 0 && ysrc+ypix < sourceH)
-                                    outPixels[ypix][xpix] = blendFunc(sourcePixels[xsrc+xpix][ysrc+ypix],
+                                    outPixels[ypix][xpix] = blendFunc(sourcePixels[ysrc+ypix][xsrc+xpix],
                                                                       {0,0,0,0});
                                 else
                                     outPixels[ypix][xpix] = blendFunc({0,0,0,0}, {0,0,0,0});
                     }
                     
-                    size_t newTile = nextTile.fetch_add(1);
-                    bool ok = $.saveTile(newTile,
-                                         reinterpret_cast<uint8_t const*>(outPixelBuf.get()),
-                                         &error);
-                    assert(ok);
-                    layer.setTile(xtile, ytile, newTile);
+                    if (!writer.write(xtile, ytile,
+                                      reinterpret_cast<uint8_t const*>(outPixelBuf.get()),
+                                      &error)) {
+                        lock_guard<mutex> lock(errorMutex);
+                        job.error = error;
+                        ok = false;
+                    }
                 }
         });
         
-        $.tileCount = nextTile.load() - 1;
-        $.tileCache.resize($.tileCount);
-    }
-    
-    void Canvas::insertLayer(llvm::StringRef undoName, size_t index)
-    {
-        assert(index <= $.layers.size());
-        $.layers.emplace($.layers.begin()+index);
-        $.undo.emplace_back(undoName, EraseOp{index});
-    }
-    
-    void Canvas::deleteLayer(llvm::StringRef undoName, size_t index)
-    {
-        assert(index < $.layers.size());
-        auto it = $.layers.begin()+index;
-        $.undo.emplace_back(undoName, InsertOp{index, move(*it)});
-        $.layers.erase(it);
-    }
-    
-    bool Priv<Canvas>::saveTile(size_t index, const uint8_t *image, string *outError)
-    {
-        assert(index != 0 && index > $.tileCount);
-        
-        SmallString<260> path;
-        $.makeTilePath(index, &path);
-
-        FILE *out;
-        do {
-            out = fopen(path.c_str(), "wb");
-        } while (!out && errno == EINTR);
-        if (!out) {
-            *outError = strerror(errno);
-            return false;
-        }
-        
-        size_t written;
-        do {
-            written = fwrite(image, $$.tileByteSize(), 1, out);
-        } while (written == 0 && errno == EINTR);
-        if (written == 0) {
-            *outError = strerror(errno);
+        if (!ok)
             return false;
-        }
-        
+        writer.commit();
+        job.layer = move(layer);
         return true;
     }
     
-    void Canvas::moveLayer(llvm::StringRef undoName, size_t oldIndex, size_t newIndex)
-    {
-        $.undo.emplace_back(undoName, MoveOp{oldIndex, newIndex});
-        swap($.layers[oldIndex], $.layers[newIndex]);
-    }
-    
-    void Canvas::setLayerParallax(llvm::StringRef undoName, size_t index, Mega::Vec parallax)
-    {
-        $.undo.emplace_back(undoName, SetParallaxOp{index, $.layers[index].parallax});
-        $.layers[index].parallax = parallax;
-    }
-    
-    StringRef
-    Canvas::undoName()
-    {
-        if ($.undo.empty())
-            return {};
-        else
-            return $.undo.back().name;
-    }
-
-    StringRef
-    Canvas::redoName()
+    void Priv<Canvas>::publishBlits()
     {
-        if ($.redo.empty())
-            return {};
-        else
-            return $.redo.back().name;
+        while (!$.blitJobs.empty()
+               && $.blitJobs.front()->done.wait_for(chrono::seconds(0)) == future_status::ready) {
+            shared_ptr<BlitJob> job = move($.blitJobs.front());
+            $.blitJobs.pop_front();
+            if (job->done.get().ok) {
+                size_t index = job->destLayer;
+                // the layer is copied in, since pushUndo first compacts the
+                // entry before this one against the layer as it stands
+                $.pushUndo(job->name, ReplaceOp{index, $.layers[index]});
+                // copy rather than move: a later job may be based on this one
+                $.layers[index] = job->layer;
+            }
+            // a failed job's error went back through its future
+        }
     }
     
-    void
-    Canvas::undo()
+    void Priv<Canvas>::waitForBlits()
     {
-        $.applyHistory($.undo, $.redo);
+        for (auto &job : $.blitJobs)
+            job->done.wait();
     }
     
-    void
-    Canvas::redo()
+    void Canvas::blit(StringRef name,
+                      const void *source,
+                      size_t sourcePitch, size_t sourceW, size_t sourceH,
+                      size_t destLayer, ptrdiff_t destX, ptrdiff_t destY,
+                      pixel_t (*blendFunc)(pixel_t, pixel_t))
     {
-        $.applyHistory($.redo, $.undo);
+        $.finishBlits();
+        BlitJob job{name.str(), destLayer, $.layers[destLayer]};
+        bool ok = $.runBlit(job, BlitParams{source, sourcePitch, sourceW, sourceH,
+                                            destX, destY, blendFunc});
+        assert(ok);
+        $.pushUndo(name, ReplaceOp{destLayer, $.layers[destLayer]});
+        $.layers[destLayer] = move(job.layer);
     }
     
-    void
-    Priv<Canvas>::applyHistory(vector<History> &from, vector<History> &to)
+    shared_future<Canvas::BlitResult> Canvas::blitAsync(StringRef name,
+                                                        const void *source,
+                                                        size_t sourcePitch, size_t sourceW, size_t sourceH,
+                                                        size_t destLayer, ptrdiff_t destX, ptrdiff_t destY,
+                                                        pixel_t (*blendFunc)(pixel_t, pixel_t))
     {
-        assert(!from.empty());
-        History item = move(from.back());
-        from.pop_back();
-        switch (item.tag) {
-            case History::Tag::Replace:
-                swap(item.replace.layer, $.layers[item.replace.index]);
-                to.emplace_back(move(item));
-                break;
-            case History::Tag::Erase: {
-                auto it = $.layers.begin() + item.erase.index;
-                to.emplace_back(move(item.name), InsertOp{item.erase.index, move(*it)});
-                $.layers.erase(it);
+        $.publishBlits();
+        auto job = make_shared<BlitJob>();
+        job->name = name.str();
+        job->destLayer = destLayer;
+        // build on the last unpublished blit into the same layer, if any
+        for (auto i = $.blitJobs.rbegin(), end = $.blitJobs.rend(); i != end; ++i)
+            if ((*i)->destLayer == destLayer) {
+                job->base = *i;
                 break;
             }
-            case History::Tag::Insert: {
-                $.layers.emplace($.layers.begin() + item.insert.index, move(item.insert.layer));
-                to.emplace_back(move(item.name), EraseOp{item.insert.index});
-                break;
+        if (!job->base)
+            job->layer = $.layers[destLayer];
+        
+        // jobs run one at a time in submission order, each after the last
+        shared_future<BlitResult> previous;
+        if (!$.blitJobs.empty())
+            previous = $.blitJobs.back()->done;
+        BlitParams params{source, sourcePitch, sourceW, sourceH, destX, destY, blendFunc};
+        Priv<Canvas> &canvas = $;
+        job->done = async(launch::async, [&canvas, job, previous, params]() -> BlitResult {
+            if (previous.valid())
+                previous.wait();
+            if (job->base) {
+                job->layer = job->base->layer;
+                job->base.reset();
             }
-            case History::Tag::Move:
-                swap($.layers[item.move.oldIndex], $.layers[item.move.newIndex]);
-                to.emplace_back(move(item));
-                break;
-            case History::Tag::SetParallax:
-                swap($.layers[item.setParallax.index].parallax, item.setParallax.parallax);
-                to.emplace_back(move(item));
-                break;
-        }
+            if (!canvas.runBlit(*job, params))
+                return BlitResult{false, job->error};
+            return BlitResult{true, string()};
+        }).share();
+        $.blitJobs.push_back(job);
+        return job->done;
     }
-
+    
     //
-    // Layer implementation
+    // Resampler reads a straight-alpha source image at arbitrary points, with
+    // pixel centers at half-integer coordinates. Filtering happens in
+    // premultiplied space, and samples beyond the image's edges are
+    // transparent, so edges fade out instead of smearing.
     //
-    MEGA_PRIV_GETTER(Layer, parallax, Vec)
-    MEGA_PRIV_GETTER(Layer, origin, Vec)
-    
-    static bool isPowerOfTwo(size_t x)
-    {
-        return (x & (x - 1)) == 0 && x != 0;
-    }
+    struct Resampler {
+        uint8_t const *source;
+        ptrdiff_t pitch, w, h;
+        Canvas::Filter filter;
+        // filter support in source pixels along each axis; wider than the
+        // filter's own when minifying, so that Lanczos also antialiases
+        Vec scale, radius;
+        
+        static constexpr double LANCZOS_A = 3.0;
+        
+        Resampler(void const *source, size_t pitch, size_t w, size_t h,
+                  Canvas::Filter filter, Affine inverse)
+        : source(reinterpret_cast<uint8_t const*>(source)),
+          pitch(pitch), w(w), h(h), filter(filter)
+        {
+            scale = Vec{
+                max(1.0, hypot(inverse.xx, inverse.xy)),
+                max(1.0, hypot(inverse.yx, inverse.yy))
+            };
+            switch (filter) {
+                case Canvas::Filter::Nearest:
+                    radius = Vec{0.5, 0.5};
+                    break;
+                case Canvas::Filter::Bilinear:
+                    radius = Vec{1.0, 1.0};
+                    break;
+                case Canvas::Filter::Lanczos:
+                    radius = LANCZOS_A*scale;
+                    break;
+            }
+        }
+        
+        // whether the filter can reach the image from anywhere in [lo, hi]
+        bool reaches(Vec lo, Vec hi) const
+        {
+            return hi.x > -radius.x && hi.y > -radius.y
+                && lo.x < double(w) + radius.x && lo.y < double(h) + radius.y;
+        }
+        
+        __m128 texel(ptrdiff_t x, ptrdiff_t y) const
+        {
+            return premultiply(loadPixel(source + 4*(y*pitch + x)));
+        }
+        
+        static double lanczos(double t)
+        {
+            if (t == 0.0)
+                return 1.0;
+            if (t <= -LANCZOS_A || t >= LANCZOS_A)
+                return 0.0;
+            double pt = M_PI*t;
+            return LANCZOS_A*sin(pt)*sin(pt/LANCZOS_A)/(pt*pt);
+        }
+        
+        // Fills `weights` with the normalized weights of taps first..first+n-1
+        // around u (in pixel-center coordinates) and returns n.
+        size_t lanczosTaps(double u, double scale, double radius,
+                           ptrdiff_t *first, SmallVectorImpl<float> &weights) const
+        {
+            ptrdiff_t lo = ptrdiff_t(ceil(u - radius)), hi = ptrdiff_t(floor(u + radius));
+            weights.clear();
+            double total = 0.0;
+            for (ptrdiff_t i = lo; i <= hi; ++i) {
+                double weight = lanczos((double(i) - u)/scale);
+                weights.push_back(float(weight));
+                total += weight;
+            }
+            if (total != 0.0)
+                for (float &weight : weights)
+                    weight = float(weight/total);
+            *first = lo;
+            return weights.size();
+        }
+        
+        Canvas::pixel_t sample(Vec s, SmallVectorImpl<float> &wx, SmallVectorImpl<float> &wy) const
+        {
+            Canvas::pixel_t result{{0,0,0,0}};
+            switch (filter) {
+                case Canvas::Filter::Nearest: {
+                    ptrdiff_t x = ptrdiff_t(floor(s.x)), y = ptrdiff_t(floor(s.y));
+                    if (x >= 0 && x < w && y >= 0 && y < h)
+                        memcpy(result.data(), source + 4*(y*pitch + x), 4);
+                    return result;
+                }
+                case Canvas::Filter::Bilinear: {
+                    double u = s.x - 0.5, v = s.y - 0.5;
+                    ptrdiff_t x0 = ptrdiff_t(floor(u)), y0 = ptrdiff_t(floor(v));
+                    float fx = float(u - double(x0)), fy = float(v - double(y0));
+                    float weights[2][2] = {{(1-fx)*(1-fy), fx*(1-fy)}, {(1-fx)*fy, fx*fy}};
+                    __m128 acc = _mm_setzero_ps();
+                    for (ptrdiff_t j = 0; j < 2; ++j)
+                        for (ptrdiff_t i = 0; i < 2; ++i) {
+                            ptrdiff_t x = x0 + i, y = y0 + j;
+                            if (x >= 0 && x < w && y >= 0 && y < h)
+                                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[j][i]), texel(x, y)));
+                        }
+                    storePixel(result.data(), unpremultiply(acc));
+                    return result;
+                }
+                case Canvas::Filter::Lanczos: {
+                    ptrdiff_t x0, y0;
+                    size_t nx = lanczosTaps(s.x - 0.5, scale.x, radius.x, &x0, wx);
+                    size_t ny = lanczosTaps(s.y - 0.5, scale.y, radius.y, &y0, wy);
+                    // taps off the image contribute nothing
+                    size_t ilo = size_t(max(-x0, ptrdiff_t(0))), ihi = size_t(max(min(w - x0, ptrdiff_t(nx)), ptrdiff_t(0)));
+                    size_t jlo = size_t(max(-y0, ptrdiff_t(0))), jhi = size_t(max(min(h - y0, ptrdiff_t(ny)), ptrdiff_t(0)));
+                    __m128 acc = _mm_setzero_ps();
+                    for (size_t j = jlo; j < jhi; ++j) {
+                        __m128 row = _mm_setzero_ps();
+                        for (size_t i = ilo; i < ihi; ++i)
+                            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(wx[i]), texel(x0 + i, y0 + j)));
+                        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(wy[j]), row));
+                    }
+                    storePixel(result.data(), unpremultiply(acc));
+                    return result;
+                }
+            }
+            return result;
+        }
+    };
     
-    Layer::SegmentRef
-    Layer::segment(size_t segmentSize, ptrdiff_t x, ptrdiff_t y)
+    void Canvas::blitTransformed(StringRef name,
+                                 const void *source,
+                                 size_t sourcePitch, size_t sourceW, size_t sourceH,
+                                 size_t destLayer, Affine transform, Filter filter,
+                                 pixel_t (*blendFunc)(pixel_t, pixel_t))
     {
-        assert(isPowerOfTwo(segmentSize) && segmentSize*segmentSize <= PTRDIFF_MAX);
         using namespace std;
-        using namespace llvm;
-        size_t quadtreeDepth = $.quadtreeDepth;
-        if (quadtreeDepth == 0) {
-            return {ArrayRef<tile_t>(), 0};
+        using namespace tbb;
+        assert(transform.determinant() != 0.0);
+        $.finishBlits();
+        Affine inverse = transform.inverse();
+        Resampler resampler(source, sourcePitch, sourceW, sourceH, filter, inverse);
+        
+        // the destination footprint, grown by the filter's reach
+        Vec corners[4] = {
+            transform(Vec{0.0, 0.0}), transform(Vec{double(sourceW), 0.0}),
+            transform(Vec{0.0, double(sourceH)}), transform(Vec{double(sourceW), double(sourceH)})
+        };
+        Vec lo = corners[0], hi = corners[0];
+        for (Vec corner : corners) {
+            lo = Vec{min(lo.x, corner.x), min(lo.y, corner.y)};
+            hi = Vec{max(hi.x, corner.x), max(hi.y, corner.y)};
         }
-        size_t radius = 1 << (quadtreeDepth - 1);
-        size_t nodeSize = 1 << ((quadtreeDepth - 1) << 1);
-        tile_t *tiles = $.tiles.data();
-        if (radius < segmentSize) {
+        Vec reach = transform.linear(resampler.radius);
+        Vec reach2 = transform.linear(Vec{resampler.radius.x, -resampler.radius.y});
+        double grow = max(max(fabs(reach.x), fabs(reach.y)), max(fabs(reach2.x), fabs(reach2.y)));
+        lo = (lo - grow).floor();
+        hi = (hi + grow).ceil();
+        
+        Priv<Layer> &layer = $.layers[destLayer];
+        $.pushUndo(name, ReplaceOp{destLayer, layer});
+        if (layer.reserve(ptrdiff_t(lo.x), ptrdiff_t(lo.y),
+                          ptrdiff_t(hi.x - lo.x), ptrdiff_t(hi.y - lo.y),
+                          $$.tileSize()))
+            layer.markAllDirty(++$.epoch);
+        
+        Vec origin = layer.origin;
+        ptrdiff_t tileLogSize = $.tileLogSize;
+        ptrdiff_t tileSize = $$.tileSize();
+        ptrdiff_t loTileX = ptrdiff_t(lo.x - origin.x) >> tileLogSize;
+        ptrdiff_t loTileY = ptrdiff_t(lo.y - origin.y) >> tileLogSize;
+        ptrdiff_t hiTileX = (ptrdiff_t(hi.x - origin.x) + tileSize - 1) >> tileLogSize;
+        ptrdiff_t hiTileY = (ptrdiff_t(hi.y - origin.y) + tileSize - 1) >> tileLogSize;
+        
+        blocked_range2d<ptrdiff_t> range(loTileY, hiTileY, loTileX, hiTileX);
+        TileWriter writer($, layer);
+        
+        parallel_for(range, [&](blocked_range2d<ptrdiff_t> const &subrange) {
+            size_t tileArea = $$.tileArea();
+            unique_ptr<pixel_t[]> outPixels(new pixel_t[tileArea]);
+            SmallVector<float, 16> wx, wy;
+            string error;
+            
+            for (ptrdiff_t ytile = subrange.rows().begin(); ytile < subrange.rows().end(); ++ytile)
+                for (ptrdiff_t xtile = subrange.cols().begin(); xtile < subrange.cols().end(); ++xtile) {
+                    Vec corner = origin + Vec{double(xtile*tileSize), double(ytile*tileSize)};
+                    
+                    // skip tiles whose footprint in the source misses the image
+                    Vec tileCorners[4] = {
+                        inverse(corner), inverse(corner + Vec{double(tileSize), 0.0}),
+                        inverse(corner + Vec{0.0, double(tileSize)}), inverse(corner + double(tileSize))
+                    };
+                    Vec slo = tileCorners[0], shi = tileCorners[0];
+                    for (Vec c : tileCorners) {
+                        slo = Vec{min(slo.x, c.x), min(slo.y, c.y)};
+                        shi = Vec{max(shi.x, c.x), max(shi.y, c.y)};
+                    }
+                    if (!resampler.reaches(slo, shi))
+                        continue;
+                    
+                    Layer::tile_t tileIndex = Layer(layer).tile(xtile, ytile);
+                    pixel_t const *destPixels = nullptr;
+                    if (tileIndex != 0) {
+                        ArrayRef<uint8_t> origTile = $.tile(tileIndex, &error);
+                        assert(!origTile.empty());
+                        destPixels = reinterpret_cast<pixel_t const*>(origTile.data());
+                    }
+                    
+                    // step the source point incrementally across each row
+                    Vec dx = inverse.linear(Vec{1.0, 0.0});
+                    for (ptrdiff_t ypix = 0; ypix < tileSize; ++ypix) {
+                        Vec s = inverse(corner + Vec{0.5, double(ypix) + 0.5});
+                        for (ptrdiff_t xpix = 0; xpix < tileSize; ++xpix, s += dx) {
+                            size_t p = ypix*tileSize + xpix;
+                            pixel_t dest = destPixels ? destPixels[p] : pixel_t{{0,0,0,0}};
+                            outPixels[p] = blendFunc(resampler.sample(s, wx, wy), dest);
+                        }
+                    }
+                    
+                    bool ok = writer.write(xtile, ytile,
+                                           reinterpret_cast<uint8_t const*>(outPixels.get()),
+                                           &error);
+                    assert(ok);
+                }
+        });
+        
+        writer.commit();
+    }
+    
+    // Accumulates one dab's coverage into a tile's coverage mask. center is
+    // relative to the tile's corner. Coverage combines as alpha does under
+    // source-over, so a mask of overlapping dabs can be composited in one pass.
+    static bool stampDab(float *mask, ptrdiff_t tileSize, Vec center,
+                         double radius, double falloff, float alpha)
+    {
+        ptrdiff_t x0 = max(ptrdiff_t(0), ptrdiff_t(floor(center.x - radius)));
+        ptrdiff_t y0 = max(ptrdiff_t(0), ptrdiff_t(floor(center.y - radius)));
+        ptrdiff_t x1 = min(tileSize, ptrdiff_t(ceil(center.x + radius)));
+        ptrdiff_t y1 = min(tileSize, ptrdiff_t(ceil(center.y + radius)));
+        if (x0 >= x1 || y0 >= y1)
+            return false;
+        // tileSize is a multiple of 4, so rounding out to whole vectors
+        // stays inside the tile
+        x0 &= ~ptrdiff_t(3);
+        x1 = (x1 + 3) & ~ptrdiff_t(3);
+        
+        __m128 cx = _mm_set1_ps(float(center.x));
+        __m128 r = _mm_set1_ps(float(radius));
+        __m128 invFalloff = _mm_set1_ps(float(1.0/falloff));
+        __m128 a = _mm_set1_ps(alpha);
+        __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), three = _mm_set1_ps(3.0f);
+        __m128 lanes = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+        int touched = 0;
+        
+        for (ptrdiff_t y = y0; y < y1; ++y) {
+            float dy = float(y) + 0.5f - float(center.y);
+            __m128 dy2 = _mm_set1_ps(dy*dy);
+            float *row = mask + y*tileSize;
+            for (ptrdiff_t x = x0; x < x1; x += 4) {
+                __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(float(x)), lanes), cx);
+                __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy2));
+                __m128 c = _mm_mul_ps(_mm_sub_ps(r, d), invFalloff);
+                c = _mm_min_ps(_mm_max_ps(c, zero), one);
+                // smoothstep
+                c = _mm_mul_ps(_mm_mul_ps(c, c), _mm_sub_ps(three, _mm_add_ps(c, c)));
+                c = _mm_mul_ps(c, a);
+                touched |= _mm_movemask_ps(_mm_cmpgt_ps(c, zero));
+                __m128 m = _mm_loadu_ps(row + x);
+                m = _mm_sub_ps(_mm_add_ps(m, c), _mm_mul_ps(m, c));
+                _mm_storeu_ps(row + x, m);
+            }
+        }
+        return touched != 0;
+    }
+    
+    double Canvas::stroke(StringRef name,
+                          size_t destLayer, ArrayRef<Vec> path,
+                          Brush const &brush, double spacingOffset)
+    {
+        $.finishBlits();
+        using namespace std;
+        using namespace tbb;
+        assert(!path.empty());
+        assert(brush.size > 0.0);
+        double radius = 0.5*brush.size;
+        double step = max(1.0, brush.spacing*brush.size);
+        double falloff = max(1.0, radius*(1.0 - brush.hardness));
+        
+        // place dabs along the path every `step` pixels, starting
+        // `spacingOffset` pixels in
+        SmallVector<Vec, 32> dabs;
+        double next = spacingOffset, start = 0.0;
+        for (size_t i = 0; i + 1 < path.size(); ++i) {
+            Vec d = path[i+1] - path[i];
+            double length = sqrt(d.x*d.x + d.y*d.y);
+            for (; next < start + length; next += step)
+                dabs.push_back(path[i] + d*((next - start)/length));
+            start += length;
+        }
+        if (next <= start) {
+            dabs.push_back(path.back());
+            next += step;
+        }
+        if (dabs.empty())
+            return next - start;
+        
+        Vec lo = dabs[0], hi = dabs[0];
+        for (Vec dab : dabs) {
+            lo = Vec{min(lo.x, dab.x), min(lo.y, dab.y)};
+            hi = Vec{max(hi.x, dab.x), max(hi.y, dab.y)};
+        }
+        lo = (lo - radius).floor();
+        hi = (hi + radius).ceil();
+        
+        ptrdiff_t tileLogSize = $.tileLogSize;
+        ptrdiff_t tileSize = $$.tileSize();
+        assert(tileSize % 4 == 0);
+        Priv<Layer> &layer = $.layers[destLayer];
+        $.pushUndo(name, ReplaceOp{destLayer, layer});
+        if (layer.reserve(ptrdiff_t(lo.x), ptrdiff_t(lo.y),
+                          ptrdiff_t(hi.x - lo.x), ptrdiff_t(hi.y - lo.y),
+                          tileSize))
+            layer.markAllDirty(++$.epoch);
+        Vec origin = layer.origin;
+        
+        // bucket dabs by the tiles they touch so each tile is read, blended,
+        // and written once no matter how many dabs overlap it
+        map<pair<ptrdiff_t, ptrdiff_t>, SmallVector<unsigned, 8>> tileDabs;
+        for (unsigned i = 0; i < dabs.size(); ++i) {
+            Vec c = dabs[i] - origin;
+            ptrdiff_t loTileX = ptrdiff_t(floor(c.x - radius)) >> tileLogSize;
+            ptrdiff_t loTileY = ptrdiff_t(floor(c.y - radius)) >> tileLogSize;
+            ptrdiff_t hiTileX = ptrdiff_t(ceil(c.x + radius)) >> tileLogSize;
+            ptrdiff_t hiTileY = ptrdiff_t(ceil(c.y + radius)) >> tileLogSize;
+            for (ptrdiff_t y = loTileY; y <= hiTileY; ++y)
+                for (ptrdiff_t x = loTileX; x <= hiTileX; ++x)
+                    tileDabs[make_pair(x, y)].push_back(i);
+        }
+        
+        // an opaque brush paints the tiles a dab's solid core covers
+        // entirely with one shared solid tile, as fillRect does, so they
+        // cost the same however big the brush is
+        vector<pair<pair<ptrdiff_t, ptrdiff_t>, SmallVector<unsigned, 8>>> tiles;
+        SmallVector<pair<ptrdiff_t, ptrdiff_t>, 8> solid;
+        double core = radius - falloff - 1.0;
+        for (auto &tile : tileDabs) {
+            Vec corner = Vec{double(tile.first.first*tileSize), double(tile.first.second*tileSize)};
+            bool covered = false;
+            if (brush.color[3] == 255 && core > 0.0)
+                for (unsigned dab : tile.second) {
+                    Vec lo = dabs[dab] - origin - corner, hi = lo - double(tileSize);
+                    Vec reach = Vec{max(fabs(lo.x), fabs(hi.x)), max(fabs(lo.y), fabs(hi.y))};
+                    if (reach.x*reach.x + reach.y*reach.y <= core*core) {
+                        covered = true;
+                        break;
+                    }
+                }
+            if (covered)
+                solid.push_back(tile.first);
+            else
+                tiles.push_back(tile);
+        }
+        if (!solid.empty()) {
+            size_t solidTile = $.solidTile(brush.color);
+            size_t epoch = ++$.epoch;
+            for (auto &tile : solid) {
+                layer.setTile(tile.first, tile.second, solidTile, true);
+                layer.markDirty(tile.first, tile.second, epoch);
+            }
+        }
+        
+        // the mask accumulates each dab's alpha, so the color itself
+        // composites with full alpha
+        uint8_t opaqueColor[4] = {brush.color[0], brush.color[1], brush.color[2], 255};
+        __m128 color = loadPixel(opaqueColor);
+        uint32_t colorWord;
+        memcpy(&colorWord, opaqueColor, 4);
+        float alpha = brush.color[3]/255.0f;
+        TileWriter writer($, layer);
+        
+        parallel_for(blocked_range<size_t>(0, tiles.size()), [&](blocked_range<size_t> const &subrange) {
+            size_t tileArea = $$.tileArea();
+            unique_ptr<float[]> mask(new float[tileArea]);
+            unique_ptr<pixel_t[]> outPixelBuf(new pixel_t[tileArea]);
+            uint8_t *outPixels = reinterpret_cast<uint8_t*>(outPixelBuf.get());
+            string error;
+            
+            for (size_t i = subrange.begin(); i != subrange.end(); ++i) {
+                ptrdiff_t xtile = tiles[i].first.first, ytile = tiles[i].first.second;
+                Vec corner = Vec{double(xtile*tileSize), double(ytile*tileSize)};
+                
+                // only the part of the tile the dabs reach is masked and
+                // blended, rounded out to whole vectors as stampDab does
+                ptrdiff_t x0 = tileSize, y0 = tileSize, x1 = 0, y1 = 0;
+                for (unsigned dab : tiles[i].second) {
+                    Vec c = dabs[dab] - origin - corner;
+                    x0 = min(x0, ptrdiff_t(floor(c.x - radius)));
+                    y0 = min(y0, ptrdiff_t(floor(c.y - radius)));
+                    x1 = max(x1, ptrdiff_t(ceil(c.x + radius)));
+                    y1 = max(y1, ptrdiff_t(ceil(c.y + radius)));
+                }
+                x0 = max(x0, ptrdiff_t(0)) & ~ptrdiff_t(3);
+                y0 = max(y0, ptrdiff_t(0));
+                x1 = (min(x1, tileSize) + 3) & ~ptrdiff_t(3);
+                y1 = min(y1, tileSize);
+                if (x0 >= x1 || y0 >= y1)
+                    continue;
+                    
+                for (ptrdiff_t y = y0; y < y1; ++y)
+                    fill(&mask[y*tileSize + x0], &mask[y*tileSize + x1], 0.0f);
+                bool touched = false;
+                for (unsigned dab : tiles[i].second)
+                    touched |= stampDab(mask.get(), tileSize, dabs[dab] - origin - corner,
+                                        radius, falloff, alpha);
+                if (!touched)
+                    continue;
+                
+                Layer::tile_t tileIndex = Layer(layer).tile(xtile, ytile);
+                uint8_t const *destPixels = nullptr;
+                if (tileIndex != 0) {
+                    ArrayRef<uint8_t> origTile = $.tile(tileIndex, &error);
+                    assert(!origTile.empty());
+                    destPixels = origTile.data();
+                }
+                
+                // the rest of the tile is copied as it was
+                auto copy = [&](ptrdiff_t from, ptrdiff_t to) {
+                    if (destPixels)
+                        memcpy(outPixels + 4*from, destPixels + 4*from, 4*(to - from));
+                    else
+                        memset(outPixels + 4*from, 0, 4*(to - from));
+                };
+                copy(0, y0*tileSize);
+                for (ptrdiff_t y = y0; y < y1; ++y) {
+                    ptrdiff_t row = y*tileSize;
+                    copy(row, row + x0);
+                    for (ptrdiff_t p = row + x0; p < row + x1; ++p) {
+                        // fully covered pixels take the color as it is
+                        if (mask[p] >= 1.0f)
+                            memcpy(outPixels + 4*p, &colorWord, 4);
+                        else if (mask[p] > 0.0f) {
+                            __m128 dest = destPixels ? loadPixel(destPixels + 4*p) : _mm_setzero_ps();
+                            storePixel(outPixels + 4*p, sourceOver(color, dest, _mm_set1_ps(mask[p])));
+                        } else
+                            copy(p, p + 1);
+                    }
+                    copy(row + x1, row + tileSize);
+                }
+                copy(y1*tileSize, tileSize*tileSize);
+                
+                bool ok = writer.write(xtile, ytile, outPixels, &error);
+                assert(ok);
+            }
+        });
+        
+        writer.commit();
+        return next - start;
+    }
+    
+    size_t Priv<Canvas>::solidTile(Canvas::pixel_t color)
+    {
+        auto found = $.solidTiles.find(color);
+        if (found != $.solidTiles.end())
+            return found->second;
+        
+        unique_ptr<Canvas::pixel_t[]> pixels(new Canvas::pixel_t[$$.tileArea()]);
+        fill(&pixels[0], &pixels[$$.tileArea()], color);
+        size_t tile = $.reserveTiles(1);
+        string error;
+        bool ok = $.saveTile(tile, reinterpret_cast<uint8_t const*>(pixels.get()), &error);
+        $.tileWasSaved(tile);
+        assert(ok);
+        $.solidTiles[color] = tile;
+        return tile;
+    }
+    
+    // Sets the pixels of the rectangle x,y,w,h (relative to the layer's
+    // origin, and within its bounds) to color. Tiles the rectangle covers
+    // entirely become fullTile; only the tiles along its edges are rendered.
+    void Priv<Canvas>::fillTiles(Priv<Layer> &layer, ptrdiff_t x, ptrdiff_t y, ptrdiff_t w, ptrdiff_t h,
+                                 Canvas::pixel_t color, size_t fullTile)
+    {
+        using namespace std;
+        using namespace tbb;
+        ptrdiff_t tileLogSize = $.tileLogSize;
+        ptrdiff_t tileSize = $$.tileSize();
+        ptrdiff_t loTileX = x >> tileLogSize, loTileY = y >> tileLogSize;
+        ptrdiff_t hiTileX = (x + w + tileSize - 1) >> tileLogSize;
+        ptrdiff_t hiTileY = (y + h + tileSize - 1) >> tileLogSize;
+        
+        // edge tiles that start out the same and are covered the same way end
+        // up the same, so each distinct (tile, x0, x1, y0, y1) is rendered
+        // once; along the edges of a fill over empty space that is one tile
+        typedef tuple<Layer::tile_t, ptrdiff_t, ptrdiff_t, ptrdiff_t, ptrdiff_t> EdgeKey;
+        map<EdgeKey, vector<pair<ptrdiff_t, ptrdiff_t>>> edgeGroups;
+        size_t fullCount = 0;
+        ptrdiff_t radius = ptrdiff_t(1) << (layer.quadtreeDepth - 1);
+        vector<uint64_t> rowIndices(size_t(hiTileX - loTileX));
+        bool fullOpaque = $.tileIsOpaque(fullTile);
+        for (ptrdiff_t ytile = loTileY; ytile < hiTileY; ++ytile) {
+            bool fullY = ytile*tileSize >= y && (ytile+1)*tileSize <= y + h;
+            if (fullY)
+                mortonEncodeRow(uint32_t(loTileX + radius), uint32_t(ytile + radius),
+                                rowIndices.size(), rowIndices.data());
+            for (ptrdiff_t xtile = loTileX; xtile < hiTileX; ++xtile) {
+                bool fullX = xtile*tileSize >= x && (xtile+1)*tileSize <= x + w;
+                if (!fullX || !fullY) {
+                    Layer::tile_t tileIndex = Layer(layer).tile(xtile, ytile);
+                    if (tileIndex == 0 && fullTile == 0)
+                        continue;
+                    EdgeKey key{
+                        tileIndex,
+                        max(x - xtile*tileSize, ptrdiff_t(0)),
+                        min(x + w - xtile*tileSize, tileSize),
+                        max(y - ytile*tileSize, ptrdiff_t(0)),
+                        min(y + h - ytile*tileSize, tileSize)
+                    };
+                    edgeGroups[key].push_back(make_pair(xtile, ytile));
+                } else {
+                    size_t index = size_t(rowIndices[size_t(xtile - loTileX)]);
+                    if (layer.tiles[index] != fullTile) {
+                        layer.tiles.set(index, Layer::tile_t(fullTile), fullOpaque);
+                        ++fullCount;
+                    }
+                }
+            }
+        }
+        if (fullCount > 0) {
+            size_t epoch = ++$.epoch;
+            if (fullCount > MAX_DIRTY_LOG)
+                layer.markAllDirty(epoch);
+            else
+                for (ptrdiff_t ytile = loTileY; ytile < hiTileY; ++ytile)
+                    for (ptrdiff_t xtile = loTileX; xtile < hiTileX; ++xtile)
+                        if (xtile*tileSize >= x && (xtile+1)*tileSize <= x + w
+                            && ytile*tileSize >= y && (ytile+1)*tileSize <= y + h)
+                            layer.markDirty(xtile, ytile, epoch);
+        }
+        
+        vector<pair<EdgeKey, vector<pair<ptrdiff_t, ptrdiff_t>>>>
+            edgeTiles(edgeGroups.begin(), edgeGroups.end());
+        uint32_t colorWord;
+        memcpy(&colorWord, color.data(), 4);
+        __m128i color4 = _mm_set1_epi32(int32_t(colorWord));
+        TileWriter writer($, layer);
+        
+        parallel_for(blocked_range<size_t>(0, edgeTiles.size()), [&](blocked_range<size_t> const &subrange) {
+            size_t tileByteSize = $$.tileByteSize();
+            unique_ptr<uint8_t[]> outPixels(new uint8_t[tileByteSize]);
+            string error;
+            
+            for (size_t i = subrange.begin(); i != subrange.end(); ++i) {
+                Layer::tile_t tileIndex;
+                ptrdiff_t x0, x1, y0, y1;
+                tie(tileIndex, x0, x1, y0, y1) = edgeTiles[i].first;
+                if (tileIndex != 0) {
+                    ArrayRef<uint8_t> origTile = $.tile(tileIndex, &error);
+                    assert(!origTile.empty());
+                    memcpy(outPixels.get(), origTile.data(), tileByteSize);
+                } else
+                    memset(outPixels.get(), 0, tileByteSize);
+                
+                for (ptrdiff_t ypix = y0; ypix < y1; ++ypix) {
+                    uint8_t *row = outPixels.get() + 4*(ypix*tileSize);
+                    ptrdiff_t xpix = x0;
+                    for (; xpix + 4 <= x1; xpix += 4)
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + 4*xpix), color4);
+                    for (; xpix < x1; ++xpix)
+                        memcpy(row + 4*xpix, &colorWord, 4);
+                }
+                
+                bool ok = writer.write(edgeTiles[i].second, outPixels.get(), &error);
+                assert(ok);
+            }
+        });
+        
+        writer.commit();
+    }
+    
+    void Canvas::fillRect(StringRef name, size_t destLayer,
+                          ptrdiff_t x, ptrdiff_t y, size_t w, size_t h,
+                          pixel_t color)
+    {
+        if (color[3] == 0) {
+            $$.clearRect(name, destLayer, x, y, w, h);
+            return;
+        }
+        if (w == 0 || h == 0)
+            return;
+        $.finishBlits();
+        Priv<Layer> &layer = $.layers[destLayer];
+        $.pushUndo(name, ReplaceOp{destLayer, layer});
+        if (layer.reserve(x, y, w, h, $$.tileSize()))
+            layer.markAllDirty(++$.epoch);
+        $.fillTiles(layer,
+                    x - ptrdiff_t(layer.origin.x), y - ptrdiff_t(layer.origin.y), w, h,
+                    color, $.solidTile(color));
+    }
+    
+    void Canvas::clearRect(StringRef name, size_t destLayer,
+                           ptrdiff_t x, ptrdiff_t y, size_t w, size_t h)
+    {
+        $.finishBlits();
+        Priv<Layer> &layer = $.layers[destLayer];
+        if (layer.quadtreeDepth == 0)
+            return;
+        
+        // nothing outside the layer's bounds to clear
+        ptrdiff_t radius = $$.tileSize() << (layer.quadtreeDepth - 1);
+        ptrdiff_t x0 = max(x - ptrdiff_t(layer.origin.x), -radius);
+        ptrdiff_t y0 = max(y - ptrdiff_t(layer.origin.y), -radius);
+        ptrdiff_t x1 = min(x + ptrdiff_t(w) - ptrdiff_t(layer.origin.x), radius);
+        ptrdiff_t y1 = min(y + ptrdiff_t(h) - ptrdiff_t(layer.origin.y), radius);
+        if (x0 >= x1 || y0 >= y1)
+            return;
+        $.pushUndo(name, ReplaceOp{destLayer, layer});
+        $.fillTiles(layer, x0, y0, x1 - x0, y1 - y0, pixel_t{{0,0,0,0}}, 0);
+    }
+    
+    // Copies the rectangle w,h at sourceX,sourceY in source to destX,destY in
+    // dest (each relative to its layer's origin; dest must already cover the
+    // rectangle). When the offset between them is a whole number of tiles,
+    // dest tiles the rectangle covers entirely take the source tile's id, and
+    // only the tiles along its edges are copied pixel by pixel.
+    void Priv<Canvas>::copyTiles(Priv<Layer> &source, ptrdiff_t sourceX, ptrdiff_t sourceY,
+                                 Priv<Layer> &dest, ptrdiff_t destX, ptrdiff_t destY,
+                                 ptrdiff_t w, ptrdiff_t h)
+    {
+        using namespace std;
+        using namespace tbb;
+        ptrdiff_t tileLogSize = $.tileLogSize;
+        ptrdiff_t tileSize = $$.tileSize();
+        // source position = dest position + offset
+        ptrdiff_t offsetX = sourceX - destX, offsetY = sourceY - destY;
+        bool aligned = ((offsetX | offsetY) & (tileSize - 1)) == 0;
+        ptrdiff_t loTileX = destX >> tileLogSize, loTileY = destY >> tileLogSize;
+        ptrdiff_t hiTileX = (destX + w + tileSize - 1) >> tileLogSize;
+        ptrdiff_t hiTileY = (destY + h + tileSize - 1) >> tileLogSize;
+        
+        vector<pair<ptrdiff_t, ptrdiff_t>> sharedTiles, edgeTiles;
+        for (ptrdiff_t ytile = loTileY; ytile < hiTileY; ++ytile) {
+            bool fullY = ytile*tileSize >= destY && (ytile+1)*tileSize <= destY + h;
+            for (ptrdiff_t xtile = loTileX; xtile < hiTileX; ++xtile) {
+                bool fullX = xtile*tileSize >= destX && (xtile+1)*tileSize <= destX + w;
+                if (aligned && fullX && fullY) {
+                    Layer::tile_t tileIndex = Layer(source).tile(xtile + (offsetX >> tileLogSize),
+                                                                 ytile + (offsetY >> tileLogSize));
+                    if (Layer(dest).tile(xtile, ytile) != tileIndex) {
+                        dest.setTile(xtile, ytile, tileIndex, $.tileIsOpaque(tileIndex));
+                        sharedTiles.push_back(make_pair(xtile, ytile));
+                    }
+                } else
+                    edgeTiles.push_back(make_pair(xtile, ytile));
+            }
+        }
+        if (!sharedTiles.empty()) {
+            size_t epoch = ++$.epoch;
+            if (sharedTiles.size() > MAX_DIRTY_LOG)
+                dest.markAllDirty(epoch);
+            else
+                for (auto &tile : sharedTiles)
+                    dest.markDirty(tile.first, tile.second, epoch);
+        }
+        
+        TileWriter writer($, dest);
+        
+        parallel_for(blocked_range<size_t>(0, edgeTiles.size()), [&](blocked_range<size_t> const &subrange) {
+            size_t tileByteSize = $$.tileByteSize();
+            unique_ptr<uint8_t[]> outPixels(new uint8_t[tileByteSize]);
+            string error;
+            
+            for (size_t i = subrange.begin(); i != subrange.end(); ++i) {
+                ptrdiff_t xtile = edgeTiles[i].first, ytile = edgeTiles[i].second;
+                ptrdiff_t xbase = xtile*tileSize, ybase = ytile*tileSize;
+                Layer::tile_t tileIndex = Layer(dest).tile(xtile, ytile);
+                bool touched = tileIndex != 0;
+                if (tileIndex != 0) {
+                    ArrayRef<uint8_t> origTile = $.tile(tileIndex, &error);
+                    assert(!origTile.empty());
+                    memcpy(outPixels.get(), origTile.data(), tileByteSize);
+                } else
+                    memset(outPixels.get(), 0, tileByteSize);
+                
+                // the copied part of this tile, in dest layer coordinates,
+                // spans up to four source tiles
+                ptrdiff_t x0 = max(destX, xbase), x1 = min(destX + w, xbase + tileSize);
+                ptrdiff_t y0 = max(destY, ybase), y1 = min(destY + h, ybase + tileSize);
+                for (ptrdiff_t sy = (y0 + offsetY) >> tileLogSize; sy <= (y1 - 1 + offsetY) >> tileLogSize; ++sy)
+                    for (ptrdiff_t sx = (x0 + offsetX) >> tileLogSize; sx <= (x1 - 1 + offsetX) >> tileLogSize; ++sx) {
+                        ptrdiff_t sx0 = max(x0, sx*tileSize - offsetX), sx1 = min(x1, (sx+1)*tileSize - offsetX);
+                        ptrdiff_t sy0 = max(y0, sy*tileSize - offsetY), sy1 = min(y1, (sy+1)*tileSize - offsetY);
+                        Layer::tile_t sourceIndex = Layer(source).tile(sx, sy);
+                        uint8_t const *sourcePixels = nullptr;
+                        if (sourceIndex != 0) {
+                            ArrayRef<uint8_t> sourceTile = $.tile(sourceIndex, &error);
+                            assert(!sourceTile.empty());
+                            sourcePixels = sourceTile.data();
+                            touched = true;
+                        }
+                        for (ptrdiff_t ypix = sy0; ypix < sy1; ++ypix) {
+                            uint8_t *out = outPixels.get() + 4*((ypix - ybase)*tileSize + (sx0 - xbase));
+                            size_t rowBytes = 4*(sx1 - sx0);
+                            if (sourcePixels)
+                                memcpy(out,
+                                       sourcePixels + 4*((ypix + offsetY - sy*tileSize)*tileSize
+                                                         + (sx0 + offsetX - sx*tileSize)),
+                                       rowBytes);
+                            else
+                                memset(out, 0, rowBytes);
+                        }
+                    }
+                
+                // nothing copied onto nothing
+                if (!touched)
+                    continue;
+                bool ok = writer.write(xtile, ytile, outPixels.get(), &error);
+                assert(ok);
+            }
+        });
+        
+        writer.commit();
+    }
+    
+    void Canvas::copyRegion(StringRef name, size_t sourceLayer,
+                            ptrdiff_t x, ptrdiff_t y, size_t w, size_t h,
+                            size_t destLayer, ptrdiff_t destX, ptrdiff_t destY)
+    {
+        if (w == 0 || h == 0)
+            return;
+        $.finishBlits();
+        Priv<Layer> &layer = $.layers[destLayer];
+        // a copy within one layer reads the layer as it was before; the
+        // snapshot shares all its tiles, so it costs next to nothing
+        Priv<Layer> before = layer;
+        Priv<Layer> &source = sourceLayer == destLayer ? before : $.layers[sourceLayer];
+        $.pushUndo(name, ReplaceOp{destLayer, layer});
+        if (layer.reserve(destX, destY, w, h, $$.tileSize()))
+            layer.markAllDirty(++$.epoch);
+        $.copyTiles(source, x - ptrdiff_t(source.origin.x), y - ptrdiff_t(source.origin.y),
+                    layer, destX - ptrdiff_t(layer.origin.x), destY - ptrdiff_t(layer.origin.y),
+                    w, h);
+    }
+    
+    // Composites sources, bottom to top, over dest, which must already cover
+    // them. Each dest tile any source touches is rendered once, with every
+    // source drawn over it in turn. A source tile that lines up with an empty
+    // dest tile and is the only thing drawn there is shared rather than
+    // copied.
+    void Priv<Canvas>::mergeTiles(Priv<Layer> &dest, MutableArrayRef<Priv<Layer>> sources)
+    {
+        using namespace std;
+        using namespace tbb;
+        ptrdiff_t tileLogSize = $.tileLogSize;
+        ptrdiff_t tileSize = $$.tileSize();
+        
+        // every dest tile under a nonempty source tile
+        DenseSet<pair<ptrdiff_t, ptrdiff_t>> touched;
+        for (Priv<Layer> &source : sources) {
+            if (source.quadtreeDepth == 0)
+                continue;
+            ptrdiff_t radius = 1 << (source.quadtreeDepth - 1);
+            // source tile (0,0)'s corner relative to dest's origin
+            ptrdiff_t offsetX = ptrdiff_t(source.origin.x - dest.origin.x);
+            ptrdiff_t offsetY = ptrdiff_t(source.origin.y - dest.origin.y);
+            source.tiles.forEachTile([&](size_t i, Layer::tile_t) {
+                size_t ux, uy;
+                unswizzle(i, &ux, &uy);
+                ptrdiff_t x = (ptrdiff_t(ux) - radius)*tileSize + offsetX;
+                ptrdiff_t y = (ptrdiff_t(uy) - radius)*tileSize + offsetY;
+                for (ptrdiff_t ytile = y >> tileLogSize; ytile <= (y + tileSize - 1) >> tileLogSize; ++ytile)
+                    for (ptrdiff_t xtile = x >> tileLogSize; xtile <= (x + tileSize - 1) >> tileLogSize; ++xtile)
+                        touched.insert(make_pair(xtile, ytile));
+            });
+        }
+        vector<pair<ptrdiff_t, ptrdiff_t>> destTiles(touched.begin(), touched.end());
+        vector<Layer::tile_t> sharedTiles(destTiles.size(), 0);
+        TileWriter writer($, dest);
+        
+        parallel_for(blocked_range<size_t>(0, destTiles.size()), [&](blocked_range<size_t> const &subrange) {
+            size_t tileByteSize = $$.tileByteSize();
+            unique_ptr<uint8_t[]> outPixels(new uint8_t[tileByteSize]);
+            string error;
+            
+            for (size_t i = subrange.begin(); i != subrange.end(); ++i) {
+                ptrdiff_t xtile = destTiles[i].first, ytile = destTiles[i].second;
+                ptrdiff_t xbase = xtile*tileSize, ybase = ytile*tileSize;
+                Layer::tile_t tileIndex = Layer(dest).tile(xtile, ytile);
+                bool isEmpty = tileIndex == 0;
+                if (tileIndex != 0) {
+                    ArrayRef<uint8_t> origTile = $.tile(tileIndex, &error);
+                    assert(!origTile.empty());
+                    memcpy(outPixels.get(), origTile.data(), tileByteSize);
+                } else
+                    memset(outPixels.get(), 0, tileByteSize);
+                
+                Layer::tile_t onlyTile = 0;
+                size_t drawn = 0;
+                bool changed = false;
+                for (Priv<Layer> &source : sources) {
+                    if (source.quadtreeDepth == 0)
+                        continue;
+                    // this tile in source layer coordinates spans up to four
+                    // source tiles
+                    ptrdiff_t offsetX = ptrdiff_t(dest.origin.x - source.origin.x);
+                    ptrdiff_t offsetY = ptrdiff_t(dest.origin.y - source.origin.y);
+                    ptrdiff_t x0 = xbase + offsetX, y0 = ybase + offsetY;
+                    bool aligned = ((x0 | y0) & (tileSize - 1)) == 0;
+                    for (ptrdiff_t sy = y0 >> tileLogSize; sy <= (y0 + tileSize - 1) >> tileLogSize; ++sy)
+                        for (ptrdiff_t sx = x0 >> tileLogSize; sx <= (x0 + tileSize - 1) >> tileLogSize; ++sx) {
+                            Layer::tile_t sourceIndex = Layer(source).tile(sx, sy);
+                            if (sourceIndex == 0)
+                                continue;
+                            onlyTile = aligned ? sourceIndex : 0;
+                            ++drawn;
+                            
+                            ArrayRef<uint8_t> sourceTile = $.tile(sourceIndex, &error);
+                            assert(!sourceTile.empty());
+                            ptrdiff_t sx0 = max(x0, sx*tileSize), sx1 = min(x0 + tileSize, (sx+1)*tileSize);
+                            ptrdiff_t sy0 = max(y0, sy*tileSize), sy1 = min(y0 + tileSize, (sy+1)*tileSize);
+                            for (ptrdiff_t ypix = sy0; ypix < sy1; ++ypix) {
+                                uint8_t const *in = sourceTile.data()
+                                    + 4*((ypix - sy*tileSize)*tileSize + (sx0 - sx*tileSize));
+                                uint8_t *out = outPixels.get()
+                                    + 4*((ypix - y0)*tileSize + (sx0 - x0));
+                                for (ptrdiff_t xpix = sx0; xpix < sx1; ++xpix, in += 4, out += 4) {
+                                    if (in[3] == 0)
+                                        continue;
+                                    changed = true;
+                                    if (in[3] == 255) {
+                                        memcpy(out, in, 4);
+                                        continue;
+                                    }
+                                    storePixel(out, sourceOver(loadPixel(in), loadPixel(out)));
+                                }
+                            }
+                        }
+                }
+                
+                // source tiles' transparent margins often overlap dest
+                // tiles they don't draw anything on
+                if (!changed)
+                    continue;
+                if (isEmpty && drawn == 1 && onlyTile != 0) {
+                    sharedTiles[i] = onlyTile;
+                    continue;
+                }
+                bool ok = writer.write(xtile, ytile, outPixels.get(), &error);
+                assert(ok);
+            }
+        });
+        
+        size_t epoch = ++$.epoch;
+        for (size_t i = 0; i < destTiles.size(); ++i)
+            if (sharedTiles[i] != 0) {
+                dest.setTile(destTiles[i].first, destTiles[i].second, sharedTiles[i],
+                             $.tileIsOpaque(sharedTiles[i]));
+                dest.markDirty(destTiles[i].first, destTiles[i].second, epoch);
+            }
+        writer.commit();
+    }
+    
+    void Canvas::mergeLayers(StringRef name, size_t begin, size_t end)
+    {
+        assert(begin < end && end <= $.layers.size());
+        $.finishBlits();
+        Priv<Layer> merged = $.layers[begin];
+        for (size_t i = begin + 1; i < end; ++i) {
+            Priv<Layer> &layer = $.layers[i];
+            assert(layer.parallax == merged.parallax);
+            if (layer.quadtreeDepth == 0)
+                continue;
+            ptrdiff_t radius = $$.tileSize() << (layer.quadtreeDepth - 1);
+            merged.reserve(ptrdiff_t(layer.origin.x) - radius, ptrdiff_t(layer.origin.y) - radius,
+                           2*radius, 2*radius, $$.tileSize());
+        }
+        $.mergeTiles(merged, makeMutableArrayRef(&$.layers[begin + 1], end - begin - 1));
+        
+        SpliceOp op{begin, end - begin, {}};
+        op.layers.push_back(move(merged));
+        $.spliceLayers(op);
+        $.pushUndo(name, move(op));
+    }
+    
+    void Canvas::insertLayer(llvm::StringRef undoName, size_t index)
+    {
+        $.finishBlits();
+        assert(index <= $.layers.size());
+        $.layers.emplace($.layers.begin()+index);
+        $.layersMoved(index, $.layers.size());
+        $.pushUndo(undoName, EraseOp{index});
+    }
+    
+    void Canvas::deleteLayer(llvm::StringRef undoName, size_t index)
+    {
+        $.finishBlits();
+        assert(index < $.layers.size());
+        auto it = $.layers.begin()+index;
+        $.pushUndo(undoName, InsertOp{index, move(*it)});
+        $.layers.erase(it);
+        $.layersMoved(index, $.layers.size());
+    }
+    
+    bool Priv<Canvas>::saveTile(size_t index, const uint8_t *image, string *outError)
+    {
+        assert(index != 0);
+        
+        SmallString<260> path;
+        $.makeTilePath(index, &path);
+
+        FILE *out;
+        do {
+            out = fopen(path.c_str(), "wb");
+        } while (!out && errno == EINTR);
+        if (!out) {
+            *outError = strerror(errno);
+            return false;
+        }
+        
+        MEGA_FINALLY({ fclose(out); });
+        
+        size_t written;
+        do {
+            written = fwrite(image, $$.tileByteSize(), 1, out);
+        } while (written == 0 && errno == EINTR);
+        if (written == 0) {
+            *outError = strerror(errno);
+            return false;
+        }
+        
+        bool opaque = true;
+        for (size_t i = 3; opaque && i < $$.tileByteSize(); i += 4)
+            opaque = image[i] == 0xFF;
+        if (opaque) {
+            lock_guard<mutex> lock($.tileMutex);
+            if (index >= $.opaqueTiles.size())
+                $.opaqueTiles.resize(max(index + 1, size_t($.opaqueTiles.size())*2));
+            $.opaqueTiles.set(index);
+        }
+        return true;
+    }
+    
+    void Canvas::moveLayer(llvm::StringRef undoName, size_t oldIndex, size_t newIndex)
+    {
+        $.finishBlits();
+        $.pushUndo(undoName, MoveOp{oldIndex, newIndex});
+        swap($.layers[oldIndex], $.layers[newIndex]);
+        $.layersMoved(oldIndex, oldIndex+1);
+        $.layersMoved(newIndex, newIndex+1);
+    }
+    
+    void Canvas::setLayerParallax(llvm::StringRef undoName, size_t index, Mega::Vec parallax)
+    {
+        $.finishBlits();
+        $.pushUndo(undoName, SetParallaxOp{index, $.layers[index].parallax});
+        $.layers[index].parallax = parallax;
+    }
+    
+    MEGA_PRIV_GETTER(Canvas, historyMemoryBudget, size_t)
+    MEGA_PRIV_GETTER(Canvas, maxHistoryDepth, size_t)
+    
+    void
+    Canvas::historyMemoryBudget(size_t bytes)
+    {
+        $.historyMemoryBudget = bytes;
+        $.trimHistory();
+    }
+    
+    void
+    Canvas::maxHistoryDepth(size_t depth)
+    {
+        $.maxHistoryDepth = depth;
+        $.trimHistory();
+    }
+    
+    void
+    Canvas::beginUndoGroup(StringRef undoName)
+    {
+        $.finishBlits();
+        if ($.undoGroupDepth++ == 0) {
+            $.trimHistory();
+            $.undo.emplace_back(undoName, GroupOp{});
+        }
+    }
+    
+    void
+    Canvas::endUndoGroup()
+    {
+        assert($.undoGroupDepth > 0);
+        // blits started in the group belong to it
+        $.finishBlits();
+        if ($.undoGroupDepth == 1)
+            $.closeUndoGroup();
+        else
+            --$.undoGroupDepth;
+    }
+    
+    MEGA_PRIV_GETTER(Canvas, undoCoalesceWindow, chrono::milliseconds)
+    
+    void
+    Canvas::undoCoalesceWindow(chrono::milliseconds window)
+    {
+        $.undoCoalesceWindow = window;
+    }
+    
+    size_t
+    Canvas::historyMemorySize()
+    {
+        size_t size = 0;
+        for (auto &item : $.undo)
+            size += item.memorySize();
+        for (auto &item : $.redo)
+            size += item.memorySize();
+        return size;
+    }
+    
+    StringRef
+    Canvas::undoName()
+    {
+        if ($.undo.empty())
+            return {};
+        else
+            return $.undo.back().name;
+    }
+
+    StringRef
+    Canvas::redoName()
+    {
+        if ($.redo.empty())
+            return {};
+        else
+            return $.redo.back().name;
+    }
+    
+    bool
+    Canvas::undo(string *outError)
+    {
+        $.finishBlits();
+        $.closeUndoGroup();
+        // no later edit will compact the last one now
+        $.compactUndo();
+        return $.applyHistory($.undo, $.redo, outError);
+    }
+    
+    bool
+    Canvas::redo(string *outError)
+    {
+        $.finishBlits();
+        $.closeUndoGroup();
+        $.compactUndo();
+        return $.applyHistory($.redo, $.undo, outError);
+    }
+    
+    // Pushes the entry for an edit about to be made onto the undo stack, or
+    // folds it into the step on top of the stack if that step is still open.
+    void
+    Priv<Canvas>::pushHistory(History &&item)
+    {
+        auto now = chrono::steady_clock::now();
+        bool coalesce = $.undoGroupDepth == 0 && $.undoCoalesceWindow.count() > 0
+            && !$.undo.empty() && $.undo.back().name == item.name
+            && $.undo.back().tag != History::Tag::Spilled
+            && $.lastEdit != chrono::steady_clock::time_point()
+            && now - $.lastEdit < $.undoCoalesceWindow;
+        $.lastEdit = now;
+        if (!coalesce && $.undoGroupDepth == 0) {
+            $.undo.push_back(move(item));
+            return;
+        }
+        if ($.undo.back().tag != History::Tag::Group) {
+            GroupOp group;
+            group.items.push_back(move($.undo.back()));
+            $.undo.back() = History(item.name, move(group));
+        }
+        
+        vector<History> &items = $.undo.back().group.items;
+        if (!items.empty() && items.back().tag == item.tag) {
+            History &last = items.back();
+            switch (item.tag) {
+                case History::Tag::Replace:
+                    // the earlier snapshot already restores the layer
+                    if (last.replace.index == item.replace.index)
+                        return;
+                    break;
+                case History::Tag::SetParallax:
+                    if (last.setParallax.index == item.setParallax.index)
+                        return;
+                    break;
+                case History::Tag::Move:
+                    // swapping the same two layers again undoes the last swap
+                    if ((last.move.oldIndex == item.move.oldIndex && last.move.newIndex == item.move.newIndex)
+                        || (last.move.oldIndex == item.move.newIndex && last.move.newIndex == item.move.oldIndex)) {
+                        items.pop_back();
+                        return;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        items.push_back(move(item));
+    }
+    
+    // Ends the open undo group, if any, and any run of coalescing edits.
+    void
+    Priv<Canvas>::closeUndoGroup()
+    {
+        $.lastEdit = chrono::steady_clock::time_point();
+        if ($.undoGroupDepth == 0)
+            return;
+        $.undoGroupDepth = 0;
+        assert($.undo.back().tag == History::Tag::Group);
+        // a group nothing was done in isn't a step
+        if ($.undo.back().group.items.empty())
+            $.undo.pop_back();
+        $.trimHistory();
+    }
+    
+    bool
+    Priv<Canvas>::applyHistory(vector<History> &from, vector<History> &to, string *outError)
+    {
+        assert(!from.empty());
+        History item = move(from.back());
+        from.pop_back();
+        if (item.tag == History::Tag::Spilled && !$.unspillHistory(item, outError)) {
+            // the steps past this one only make sense applied after it
+            from.clear();
+            $.trimHistory();
+            return false;
+        }
+        $.applyHistoryItem(move(item), to);
+        $.trimHistory();
+        return true;
+    }
+    
+    // Applies item, pushing the entry that reverses it onto `to`.
+    void
+    Priv<Canvas>::applyHistoryItem(History &&item, vector<History> &to)
+    {
+        switch (item.tag) {
+            case History::Tag::Replace: {
+                Priv<Layer> &layer = $.layers[item.replace.index];
+                swap(item.replace.layer, layer);
+                layer.markChangedFrom(item.replace.layer, ++$.epoch);
+                to.emplace_back(move(item));
+                break;
+            }
+            case History::Tag::Erase: {
+                auto it = $.layers.begin() + item.erase.index;
+                to.emplace_back(move(item.name), InsertOp{item.erase.index, move(*it)});
+                $.layers.erase(it);
+                $.layersMoved(item.erase.index, $.layers.size());
+                break;
+            }
+            case History::Tag::Insert: {
+                size_t index = item.insert.index;
+                $.layers.emplace($.layers.begin() + index, move(item.insert.layer));
+                to.emplace_back(move(item.name), EraseOp{index});
+                $.layersMoved(index, $.layers.size());
+                break;
+            }
+            case History::Tag::Move:
+                swap($.layers[item.move.oldIndex], $.layers[item.move.newIndex]);
+                $.layersMoved(item.move.oldIndex, item.move.oldIndex+1);
+                $.layersMoved(item.move.newIndex, item.move.newIndex+1);
+                to.emplace_back(move(item));
+                break;
+            case History::Tag::SetParallax:
+                swap($.layers[item.setParallax.index].parallax, item.setParallax.parallax);
+                to.emplace_back(move(item));
+                break;
+            case History::Tag::Splice:
+                $.spliceLayers(item.splice);
+                to.emplace_back(move(item));
+                break;
+            case History::Tag::Delta:
+                $.applyDelta(item.delta);
+                to.emplace_back(move(item));
+                break;
+            case History::Tag::Group: {
+                // applying the steps newest first leaves their reversals in
+                // the order that reverses them in turn
+                GroupOp reversed;
+                vector<History> &items = item.group.items;
+                while (!items.empty()) {
+                    History step = move(items.back());
+                    items.pop_back();
+                    $.applyHistoryItem(move(step), reversed.items);
+                }
+                to.emplace_back(move(item.name), move(reversed));
+                break;
+            }
+            case History::Tag::Spilled:
+                assert(false);
+                break;
+        }
+    }
+    
+    // The tile offset of the square small covers within the square big
+    // covers, if big contains it.
+    static bool layerOffset(Priv<Layer> const &small, Priv<Layer> const &big, ptrdiff_t tileSize,
+                            size_t *outX, size_t *outY)
+    {
+        ptrdiff_t smallRadius = tileSize << (small.quadtreeDepth - 1);
+        ptrdiff_t bigRadius = tileSize << (big.quadtreeDepth - 1);
+        ptrdiff_t x = ptrdiff_t(small.origin.x - big.origin.x) - smallRadius + bigRadius;
+        ptrdiff_t y = ptrdiff_t(small.origin.y - big.origin.y) - smallRadius + bigRadius;
+        if (x < 0 || y < 0 || x + 2*smallRadius > 2*bigRadius || y + 2*smallRadius > 2*bigRadius
+            || x % (2*smallRadius) != 0 || y % (2*smallRadius) != 0)
+            return false;
+        *outX = size_t(x/tileSize);
+        *outY = size_t(y/tileSize);
+        return true;
+    }
+    
+    // Turns the ReplaceOp on top of the undo stack, or on top of the group
+    // there, once its edit is done, into a DeltaOp of just the tiles the edit
+    // changed, if that is smaller. Deltas for consecutive edits to a layer in
+    // a group are merged. Each ReplaceOp is only tried once.
+    void
+    Priv<Canvas>::compactUndo()
+    {
+        if ($.undo.empty())
+            return;
+        History &top = $.undo.back();
+        if (top.tag != History::Tag::Group) {
+            $.compactReplace(top);
+            return;
+        }
+        vector<History> &items = top.group.items;
+        if (!items.empty() && $.compactReplace(items.back())
+            && items.size() > 1 && $.mergeDeltas(items[items.size()-2], items.back()))
+            items.pop_back();
+    }
+    
+    bool
+    Priv<Canvas>::compactReplace(History &item)
+    {
+        if (item.tag != History::Tag::Replace || item.replace.compacted)
+            return false;
+        item.replace.compacted = true;
+        Priv<Layer> &old = item.replace.layer, &layer = $.layers[item.replace.index];
+        if (old.quadtreeDepth == 0 || layer.quadtreeDepth < old.quadtreeDepth
+            || old.parallax != layer.parallax)
+            return false;
+        size_t x, y;
+        if (!layerOffset(old, layer, $$.tileSize(), &x, &y))
+            return false;
+        
+        TileTree oldTiles = old.tiles;
+        oldTiles.embed(layer.quadtreeDepth, x, y);
+        DeltaOp op{item.replace.index, layer.origin, old.origin, layer.quadtreeDepth, old.quadtreeDepth, {}};
+        oldTiles.forEachDifference(layer.tiles, [&](size_t i) {
+            op.changes.push_back(DeltaOp::Change{i, layer.tiles[i], oldTiles[i]});
+        });
+        if (op.changes.size()*sizeof(DeltaOp::Change) > old.memorySize())
+            return false;
+        op.changes.shrink_to_fit();
+        item = History(item.name, move(op));
+        return true;
+    }
+    
+    // Folds the delta of a layer edit into the delta of the edit to the layer
+    // just before it, unless either one shrank the layer.
+    bool
+    Priv<Canvas>::mergeDeltas(History &earlier, History &later)
+    {
+        if (earlier.tag != History::Tag::Delta || later.tag != History::Tag::Delta)
+            return false;
+        DeltaOp &a = earlier.delta, &b = later.delta;
+        if (a.index != b.index || a.fromDepth < a.toDepth || b.fromDepth < b.toDepth
+            || b.toDepth != a.fromDepth || b.toOrigin != a.fromOrigin)
+            return false;
+        
+        // a's tiles make up an aligned square of b's, so a's indices just
+        // need offsetting
+        size_t base = 0;
+        if (b.fromDepth > a.fromDepth) {
+            Priv<Layer> small, big;
+            small.origin = a.fromOrigin;
+            small.quadtreeDepth = a.fromDepth;
+            big.origin = b.fromOrigin;
+            big.quadtreeDepth = b.fromDepth;
+            size_t x, y;
+            bool ok = layerOffset(small, big, $$.tileSize(), &x, &y);
+            assert(ok);
+            (void)ok;
+            base = swizzle(x, y);
+        }
+        
+        vector<DeltaOp::Change> merged;
+        merged.reserve(a.changes.size() + b.changes.size());
+        auto ai = a.changes.begin(), bi = b.changes.begin();
+        while (ai != a.changes.end() || bi != b.changes.end()) {
+            if (bi == b.changes.end() || (ai != a.changes.end() && ai->index + base < bi->index)) {
+                merged.push_back(DeltaOp::Change{ai->index + base, ai->from, ai->to});
+                ++ai;
+            } else if (ai == a.changes.end() || bi->index < ai->index + base) {
+                merged.push_back(*bi);
+                ++bi;
+            } else {
+                // changed by both; drop it if b put back what a replaced
+                if (bi->from != ai->to)
+                    merged.push_back(DeltaOp::Change{bi->index, bi->from, ai->to});
+                ++ai;
+                ++bi;
+            }
+        }
+        merged.shrink_to_fit();
+        a.changes = move(merged);
+        a.fromOrigin = b.fromOrigin;
+        a.fromDepth = b.fromDepth;
+        return true;
+    }
+    
+    void
+    Priv<Canvas>::applyDelta(DeltaOp &op)
+    {
+        Priv<Layer> &layer = $.layers[op.index];
+        assert(layer.quadtreeDepth == op.fromDepth && layer.origin == op.fromOrigin);
+        size_t x, y;
+        if (op.toDepth > op.fromDepth) {
+            Priv<Layer> grown;
+            grown.origin = op.toOrigin;
+            grown.quadtreeDepth = op.toDepth;
+            bool ok = layerOffset(layer, grown, $$.tileSize(), &x, &y);
+            assert(ok);
+            (void)ok;
+            layer.tiles.embed(op.toDepth, x, y);
+            layer.origin = op.toOrigin;
+            layer.quadtreeDepth = op.toDepth;
+        }
+        for (auto &change : op.changes) {
+            assert(layer.tiles[change.index] == change.from);
+            layer.tiles.set(change.index, change.to, $.tileIsOpaque(change.to));
+        }
+        if (op.toDepth < op.fromDepth) {
+            Priv<Layer> shrunk;
+            shrunk.origin = op.toOrigin;
+            shrunk.quadtreeDepth = op.toDepth;
+            bool ok = layerOffset(shrunk, layer, $$.tileSize(), &x, &y);
+            assert(ok);
+            (void)ok;
+            layer.tiles.extract(op.toDepth, x, y);
+            layer.origin = op.toOrigin;
+            layer.quadtreeDepth = op.toDepth;
+        }
+        
+        size_t epoch = ++$.epoch;
+        if (op.toDepth != op.fromDepth || op.changes.size() > MAX_DIRTY_LOG)
+            layer.markAllDirty(epoch);
+        else {
+            ptrdiff_t radius = 1 << (layer.quadtreeDepth - 1);
+            for (auto &change : op.changes) {
+                size_t tx, ty;
+                unswizzle(change.index, &tx, &ty);
+                layer.markDirty(ptrdiff_t(tx) - radius, ptrdiff_t(ty) - radius, epoch);
+            }
+        }
+        
+        swap(op.fromOrigin, op.toOrigin);
+        swap(op.fromDepth, op.toDepth);
+        for (auto &change : op.changes)
+            swap(change.from, change.to);
+    }
+    
+    //
+    // The history journal holds the layers and tile changes of spilled
+    // history entries. Tile maps are written as their nonzero tiles, each as
+    // the varint gap from the previous one's index and the varint tile id;
+    // deltas likewise. A group is its step count followed by its steps.
+    //
+    namespace {
+        struct JournalWriter {
+            vector<uint8_t> bytes;
+            
+            void varint(uint64_t x)
+            {
+                while (x >= 0x80) {
+                    bytes.push_back(uint8_t(x) | 0x80);
+                    x >>= 7;
+                }
+                bytes.push_back(uint8_t(x));
+            }
+            
+            void vec(Vec v)
+            {
+                uint8_t const *p = reinterpret_cast<uint8_t const*>(&v);
+                bytes.insert(bytes.end(), p, p + sizeof(Vec));
+            }
+            
+            void layer(Priv<Layer> const &layer)
+            {
+                vec(layer.parallax);
+                vec(layer.origin);
+                varint(layer.quadtreeDepth);
+                varint(layer.epoch);
+                size_t count = 0;
+                layer.tiles.forEachTile([&](size_t, Layer::tile_t) { ++count; });
+                varint(count);
+                size_t last = 0;
+                layer.tiles.forEachTile([&](size_t i, Layer::tile_t tile) {
+                    varint(i - last);
+                    varint(tile);
+                    last = i;
+                });
+            }
+            
+            void history(History const &item)
+            {
+                varint(size_t(item.tag));
+                switch (item.tag) {
+                    case History::Tag::Replace:
+                        varint(item.replace.index);
+                        layer(item.replace.layer);
+                        break;
+                    case History::Tag::Insert:
+                        varint(item.insert.index);
+                        layer(item.insert.layer);
+                        break;
+                    case History::Tag::Erase:
+                        varint(item.erase.index);
+                        break;
+                    case History::Tag::Move:
+                        varint(item.move.oldIndex);
+                        varint(item.move.newIndex);
+                        break;
+                    case History::Tag::SetParallax:
+                        varint(item.setParallax.index);
+                        vec(item.setParallax.parallax);
+                        break;
+                    case History::Tag::Splice:
+                        varint(item.splice.index);
+                        varint(item.splice.count);
+                        varint(item.splice.layers.size());
+                        for (auto &l : item.splice.layers)
+                            layer(l);
+                        break;
+                    case History::Tag::Delta: {
+                        DeltaOp const &op = item.delta;
+                        varint(op.index);
+                        vec(op.fromOrigin);
+                        vec(op.toOrigin);
+                        varint(op.fromDepth);
+                        varint(op.toDepth);
+                        varint(op.changes.size());
+                        size_t last = 0;
+                        for (auto &change : op.changes) {
+                            varint(change.index - last);
+                            varint(change.from);
+                            varint(change.to);
+                            last = change.index;
+                        }
+                        break;
+                    }
+                    case History::Tag::Group:
+                        varint(item.group.items.size());
+                        for (auto &step : item.group.items)
+                            history(step);
+                        break;
+                    case History::Tag::Spilled:
+                        assert(false);
+                        break;
+                }
+            }
+        };
+        
+        // Reading stops making progress, and bad is set, at the first thing
+        // that couldn't have been written: a truncated value, an unknown
+        // tag, or a count or index out of range.
+        struct JournalReader {
+            uint8_t const *p, *end;
+            Priv<Canvas> &canvas;
+            bool bad;
+            
+            uint64_t varint()
+            {
+                uint64_t x = 0;
+                for (unsigned shift = 0; shift < 64; shift += 7) {
+                    if (p == end)
+                        break;
+                    uint8_t byte = *p++;
+                    x |= uint64_t(byte & 0x7F) << shift;
+                    if (!(byte & 0x80))
+                        return x;
+                }
+                bad = true;
+                p = end;
+                return 0;
+            }
+            
+            // Every counted item takes at least a byte, so a count bigger
+            // than what's left is garbage.
+            size_t count()
+            {
+                uint64_t n = varint();
+                if (n > uint64_t(end - p)) {
+                    bad = true;
+                    p = end;
+                    return 0;
+                }
+                return size_t(n);
+            }
+            
+            Vec vec()
+            {
+                Vec v{0.0, 0.0};
+                if (end - p < ptrdiff_t(sizeof(Vec))) {
+                    bad = true;
+                    p = end;
+                    return v;
+                }
+                memcpy(&v, p, sizeof(Vec));
+                p += sizeof(Vec);
+                return v;
+            }
+            
+            Priv<Layer> layer()
+            {
+                Priv<Layer> layer;
+                layer.parallax = vec();
+                layer.origin = vec();
+                layer.quadtreeDepth = varint();
+                layer.epoch = layer.rescanEpoch = varint();
+                if (layer.quadtreeDepth >= 32) {
+                    bad = true;
+                    p = end;
+                    layer.quadtreeDepth = 0;
+                }
+                layer.tiles = TileTree(layer.quadtreeDepth);
+                size_t i = 0;
+                for (size_t n = count(); n > 0 && !bad; --n) {
+                    i += varint();
+                    Layer::tile_t tile = Layer::tile_t(varint());
+                    if (i >= layer.tiles.size()) {
+                        bad = true;
+                        p = end;
+                        break;
+                    }
+                    layer.tiles.set(i, tile, canvas.tileIsOpaque(tile));
+                }
+                return layer;
+            }
+            
+            History history(StringRef name)
+            {
+                switch (History::Tag(varint())) {
+                    case History::Tag::Replace: {
+                        size_t index = varint();
+                        return History(name, ReplaceOp{index, layer(), true});
+                    }
+                    case History::Tag::Insert: {
+                        size_t index = varint();
+                        return History(name, InsertOp{index, layer()});
+                    }
+                    case History::Tag::Erase:
+                        return History(name, EraseOp{size_t(varint())});
+                    case History::Tag::Move: {
+                        size_t oldIndex = varint();
+                        return History(name, MoveOp{oldIndex, size_t(varint())});
+                    }
+                    case History::Tag::SetParallax: {
+                        size_t index = varint();
+                        return History(name, SetParallaxOp{index, vec()});
+                    }
+                    case History::Tag::Splice: {
+                        SpliceOp op;
+                        op.index = varint();
+                        op.count = varint();
+                        for (size_t n = count(); n > 0 && !bad; --n)
+                            op.layers.push_back(layer());
+                        return History(name, move(op));
+                    }
+                    case History::Tag::Delta: {
+                        DeltaOp op;
+                        op.index = varint();
+                        op.fromOrigin = vec();
+                        op.toOrigin = vec();
+                        op.fromDepth = varint();
+                        op.toDepth = varint();
+                        op.changes.resize(count());
+                        size_t i = 0;
+                        for (auto &change : op.changes) {
+                            i += varint();
+                            change.index = i;
+                            change.from = Layer::tile_t(varint());
+                            change.to = Layer::tile_t(varint());
+                        }
+                        return History(name, move(op));
+                    }
+                    case History::Tag::Group: {
+                        GroupOp op;
+                        for (size_t n = count(); n > 0 && !bad; --n)
+                            op.items.push_back(history(name));
+                        return History(name, move(op));
+                    }
+                    default:
+                        bad = true;
+                        p = end;
+                        return History(name, EraseOp{0});
+                }
+            }
+        };
+    }
+    
+    void
+    Priv<Canvas>::trimHistory()
+    {
+        if ($.maxHistoryDepth != 0 && $.undo.size() > $.maxHistoryDepth)
+            $.undo.erase($.undo.begin(), $.undo.end() - $.maxHistoryDepth);
+        
+        // the entries nearest the present are the likeliest to be needed
+        size_t total = 0;
+        auto weigh = [&](History &item) {
+            size_t size = item.memorySize();
+            total += size;
+            if (total > $.historyMemoryBudget && $.spillHistory(item))
+                total -= size;
+        };
+        auto u = $.undo.rbegin();
+        // an open group is still being added to, so it stays in memory
+        if ($.undoGroupDepth > 0 && u != $.undo.rend())
+            total += (u++)->memorySize();
+        for (; u != $.undo.rend(); ++u)
+            weigh(*u);
+        for (auto i = $.redo.rbegin(); i != $.redo.rend(); ++i)
+            weigh(*i);
+    }
+    
+    bool
+    Priv<Canvas>::spillHistory(History &item)
+    {
+        // entries that hold no memory aren't worth spilling
+        if (item.memorySize() == 0)
+            return false;
+        JournalWriter writer;
+        writer.history(item);
+        
+        if (!$.historyJournal) {
+            SmallString<260> path;
+            raw_svector_ostream(path) << $.tilesPath << "/history.journal";
+            do {
+                $.historyJournal = fopen(path.c_str(), "w+b");
+            } while (!$.historyJournal && errno == EINTR);
+            if (!$.historyJournal)
+                return false;
+            // the journal lives only as long as it's open
+            unlink(path.c_str());
+        }
+        if (fseek($.historyJournal, 0, SEEK_END) != 0)
+            return false;
+        long offset = ftell($.historyJournal);
+        if (offset < 0 || fwrite(writer.bytes.data(), writer.bytes.size(), 1, $.historyJournal) != 1)
+            return false;
+        
+        item = History(item.name, SpilledOp{offset, writer.bytes.size()});
+        return true;
+    }
+    
+    bool
+    Priv<Canvas>::unspillHistory(History &item, string *outError)
+    {
+        assert(item.tag == History::Tag::Spilled);
+        vector<uint8_t> bytes(item.spilled.size);
+        clearerr($.historyJournal);
+        if (fseek($.historyJournal, item.spilled.offset, SEEK_SET) != 0
+            || fread(bytes.data(), bytes.size(), 1, $.historyJournal) != 1) {
+            if (outError) {
+                bool eof = feof($.historyJournal) && !ferror($.historyJournal);
+                *outError = "unable to read '" + item.name + "' back from history journal: "
+                    + (eof ? "journal is truncated" : strerror(errno));
+            }
+            return false;
+        }
+        
+        JournalReader reader{bytes.data(), bytes.data() + bytes.size(), $, false};
+        History read = reader.history(item.name);
+        if (reader.bad || reader.p != reader.end) {
+            if (outError)
+                *outError = "unable to read '" + item.name + "' back from history journal: entry is corrupt";
+            return false;
+        }
+        item = move(read);
+        return true;
+    }
+
+    // Swaps op's layers with the ones they replace, turning op into its own
+    // inverse.
+    void
+    Priv<Canvas>::spliceLayers(SpliceOp &op)
+    {
+        auto begin = $.layers.begin() + op.index;
+        vector<Priv<Layer>> removed(make_move_iterator(begin),
+                                    make_move_iterator(begin + op.count));
+        begin = $.layers.erase(begin, begin + op.count);
+        $.layers.insert(begin,
+                        make_move_iterator(op.layers.begin()),
+                        make_move_iterator(op.layers.end()));
+        $.layersMoved(op.index, $.layers.size());
+        op.count = op.layers.size();
+        op.layers = move(removed);
+    }
+    
+    // Layers in [begin, end) now hold different content than consumers
+    // indexing layers by position last saw there.
+    void
+    Priv<Canvas>::layersMoved(size_t begin, size_t end)
+    {
+        size_t epoch = ++$.epoch;
+        for (size_t i = begin; i < end; ++i)
+            $.layers[i].markAllDirty(epoch);
+    }
+
+    //
+    // Layer implementation
+    //
+    MEGA_PRIV_GETTER(Layer, parallax, Vec)
+    MEGA_PRIV_GETTER(Layer, origin, Vec)
+    MEGA_PRIV_GETTER(Layer, epoch, size_t)
+    
+    bool
+    Layer::dirtyTilesSince(size_t epoch, SmallVectorImpl<pair<ptrdiff_t, ptrdiff_t>> *outTiles)
+    {
+        if (epoch < $.rescanEpoch)
+            return false;
+        auto begin = $.dirtyTiles.end();
+        while (begin != $.dirtyTiles.begin() && (begin-1)->epoch > epoch)
+            --begin;
+        for (auto i = begin; i != $.dirtyTiles.end(); ++i)
+            outTiles->push_back(make_pair(i->x, i->y));
+        return true;
+    }
+    
+    static bool isPowerOfTwo(size_t x)
+    {
+        return (x & (x - 1)) == 0 && x != 0;
+    }
+    
+    Layer::SegmentRef
+    Layer::segment(size_t segmentSize, ptrdiff_t x, ptrdiff_t y)
+    {
+        assert(isPowerOfTwo(segmentSize) && segmentSize*segmentSize <= PTRDIFF_MAX);
+        using namespace std;
+        using namespace llvm;
+        size_t quadtreeDepth = $.quadtreeDepth;
+        if (quadtreeDepth == 0) {
+            return {ArrayRef<tile_t>(), 0};
+        }
+        size_t radius = 1 << (quadtreeDepth - 1);
+        size_t nodeSize = 1 << ((quadtreeDepth - 1) << 1);
+        // segments have to lie within one leaf of the tile tree to be contiguous
+        assert(segmentSize*segmentSize <= TileTree::LEAF_SIZE);
+        if (radius < segmentSize) {
             if ((x != -1 && x != 0) || (y != -1 && y != 0))
                 return {ArrayRef<tile_t>(), 0};
 
@@ -880,55 +2907,80 @@ error:
                 offset <<= 2;
                 segmentSize >>= 1;
             }
-            return {makeArrayRef(&tiles[node*nodeSize], nodeSize), (3-node)*offset};
+            return {$.tiles.run(node*nodeSize, nodeSize), (3-node)*offset};
         } else {
             ptrdiff_t segmentRadius = radius/segmentSize;
             if (x < -segmentRadius || x >= segmentRadius
                 || y < -segmentRadius || y >= segmentRadius) {
                 return {ArrayRef<tile_t>(), 0};
             }
-            Layer::tile_t *segment = $.segmentCorner(segmentSize, x, y);
-            return {makeArrayRef(segment, segmentSize*segmentSize), 0};
+            size_t segment = $.segmentIndex(segmentSize, x, y);
+            return {$.tiles.run(segment, segmentSize*segmentSize), 0};
         }
     }
     
     Layer::tile_t
     Layer::tile(ptrdiff_t x, ptrdiff_t y)
     {
-        return $$.segment(1, x, y)[0];
+        if ($.quadtreeDepth == 0)
+            return 0;
+        ptrdiff_t radius = ptrdiff_t(1) << ($.quadtreeDepth - 1);
+        if (x < -radius || x >= radius || y < -radius || y >= radius)
+            return 0;
+        return $.tiles[$.segmentIndex(1, x, y)];
     }
     
-    Layer::tile_t *
-    Priv<Layer>::segmentCorner(ptrdiff_t quadrantSize,
-                               ptrdiff_t x, ptrdiff_t y)
+    void
+    Layer::forEachTileInRect(Rect tiles, function<void (ptrdiff_t, ptrdiff_t, tile_t)> const &f)
     {
-        using namespace std;
-        size_t logRadius = $.quadtreeDepth - 1;
-        size_t radius = 1 << logRadius;
-        size_t nodeSize = 1 << (logRadius << 1);
+        if ($.quadtreeDepth == 0)
+            return;
+        ptrdiff_t radius = ptrdiff_t(1) << ($.quadtreeDepth - 1);
+        ptrdiff_t x0 = max(ptrdiff_t(floor(tiles.lo.x)), -radius) + radius;
+        ptrdiff_t y0 = max(ptrdiff_t(floor(tiles.lo.y)), -radius) + radius;
+        ptrdiff_t x1 = min(ptrdiff_t(ceil(tiles.hi.x)), radius) + radius;
+        ptrdiff_t y1 = min(ptrdiff_t(ceil(tiles.hi.y)), radius) + radius;
+        if (x0 >= x1 || y0 >= y1)
+            return;
+        $.tiles.forEachTileInRect(size_t(x0), size_t(y0), size_t(x1), size_t(y1),
+                                  [&](size_t x, size_t y, tile_t tile) {
+            f(ptrdiff_t(x) - radius, ptrdiff_t(y) - radius, tile);
+        });
+    }
+    
+    Layer::Coverage
+    Layer::coverage(Rect tiles)
+    {
+        ptrdiff_t lox = ptrdiff_t(floor(tiles.lo.x)), loy = ptrdiff_t(floor(tiles.lo.y));
+        ptrdiff_t hix = ptrdiff_t(ceil(tiles.hi.x)), hiy = ptrdiff_t(ceil(tiles.hi.y));
+        if (lox >= hix || loy >= hiy || $.quadtreeDepth == 0)
+            return Coverage::Empty;
+        ptrdiff_t radius = ptrdiff_t(1) << ($.quadtreeDepth - 1);
+        ptrdiff_t x0 = max(lox, -radius) + radius, y0 = max(loy, -radius) + radius;
+        ptrdiff_t x1 = min(hix, radius) + radius, y1 = min(hiy, radius) + radius;
+        if (x0 >= x1 || y0 >= y1)
+            return Coverage::Empty;
+        auto coverage = $.tiles.coverage(size_t(x0), size_t(y0), size_t(x1), size_t(y1));
+        if (coverage == TileTree::Coverage::Empty)
+            return Coverage::Empty;
+        // the part outside the layer is empty
+        bool clipped = x0 - radius != lox || y0 - radius != loy
+            || x1 - radius != hix || y1 - radius != hiy;
+        return coverage == TileTree::Coverage::Opaque && !clipped
+            ? Coverage::Opaque : Coverage::Partial;
+    }
+    
+    size_t
+    Priv<Layer>::segmentIndex(ptrdiff_t quadrantSize,
+                              ptrdiff_t x, ptrdiff_t y)
+    {
+        size_t radius = size_t(1) << ($.quadtreeDepth - 1);
         size_t xa = x*quadrantSize + radius, ya = y*quadrantSize + radius;
-        assert(xa >= 0 && xa < radius*2 && ya >= 0 && ya < radius*2);
-        Layer::tile_t *corner = tiles.data();
-        
-        while (xa != 0 || ya != 0) {
-            assert(nodeSize > 0 && radius > 0);
-            if (xa >= radius) {
-                corner += nodeSize;
-                xa -= radius;
-            }
-            if (ya >= radius) {
-                corner += 2*nodeSize;
-                ya -= radius;
-            }
-            nodeSize >>= 2;
-            radius >>= 1;
-        }
-        assert(xa == 0 && ya == 0);
-        
-        return corner;
+        assert(xa < radius*2 && ya < radius*2);
+        return swizzle(xa, ya);
     }
     
-    void
+    bool
     Priv<Layer>::reserve(ptrdiff_t x, ptrdiff_t y, ptrdiff_t w, ptrdiff_t h, ptrdiff_t tileSize)
     {
         if ($.quadtreeDepth == 0) {
@@ -938,15 +2990,14 @@ error:
                 ++$.quadtreeDepth;
                 size <<= 1;
             } while (size < w || size < h);
-            $.tiles.clear();
-            $.tiles.resize(1 << ($.quadtreeDepth << 1));
+            $.tiles = TileTree($.quadtreeDepth);
             errs() << "initialized layer to depth " << $.quadtreeDepth << "\n";
+            return true;
         } else {
             ptrdiff_t radius = tileSize << ($.quadtreeDepth - 1);
             Vec origin = $.origin, lo = origin - radius, hi = origin + radius;
             if (x >= lo.x && y >= lo.y && x+w <= hi.x && y+h <= hi.y)
-                return;
-            vector<Layer::tile_t> newTiles;
+                return false;
             if (x < lo.x || y < lo.y) {
                 size_t targetSize = max(hi.x - x, hi.y - y);
                 size_t size = radius << 1, depth = $.quadtreeDepth;
@@ -954,10 +3005,9 @@ error:
                     ++depth;
                     origin -= Vec{double(size >> 1), double(size >> 1)};
                     size <<= 1;
+                    // the old tiles end up in the bottom right
+                    $.tiles.grow(3);
                 } while (size < targetSize);
-                newTiles.resize(1 << (depth << 1));
-                copy($.tiles.begin(), $.tiles.end(), newTiles.end() - $.tiles.size());
-                $.tiles = move(newTiles);
                 $.quadtreeDepth = depth;
                 $.origin = origin;
                 radius = size >> 1;
@@ -970,21 +3020,62 @@ error:
                     ++depth;
                     origin += Vec{double(size >> 1), double(size >> 1)};
                     size <<= 1;
+                    // the old tiles end up in the top left
+                    $.tiles.grow(0);
                 } while (size < targetSize);
-                $.tiles.resize(1 << (depth << 1));
                 $.quadtreeDepth = depth;
                 $.origin = origin;
             }
+            return true;
         }
     }
     
     void
-    Priv<Layer>::setTile(ptrdiff_t x, ptrdiff_t y, size_t tile)
+    Priv<Layer>::setTile(ptrdiff_t x, ptrdiff_t y, size_t tile, bool opaque)
     {
-        Layer::SegmentRef seg = $$.segment(1, x, y);
-        assert(seg.tiles.size() == 1);
-        
-        //fixme gross, but i don't want SegmentRef to be generally mutable
-        const_cast<Layer::tile_t&>(seg.tiles[0]) = tile;
+        assert($.quadtreeDepth > 0);
+        $.tiles.set($.segmentIndex(1, x, y), tile, opaque);
+    }
+    
+    void
+    Priv<Layer>::markDirty(ptrdiff_t x, ptrdiff_t y, size_t epoch)
+    {
+        assert(epoch >= $.epoch);
+        $.epoch = epoch;
+        $.dirtyTiles.push_back(DirtyTile{epoch, x, y});
+        if ($.dirtyTiles.size() > MAX_DIRTY_LOG) {
+            auto mid = $.dirtyTiles.begin() + MAX_DIRTY_LOG/2;
+            $.rescanEpoch = (mid-1)->epoch;
+            $.dirtyTiles.erase($.dirtyTiles.begin(), mid);
+        }
+    }
+    
+    void
+    Priv<Layer>::markAllDirty(size_t epoch)
+    {
+        $.epoch = $.rescanEpoch = epoch;
+        $.dirtyTiles.clear();
+    }
+    
+    // Marks the tiles that differ from `other`, the state this layer just
+    // replaced, as dirty.
+    void
+    Priv<Layer>::markChangedFrom(Priv<Layer> const &other, size_t epoch)
+    {
+        if ($.quadtreeDepth != other.quadtreeDepth || $.origin != other.origin) {
+            $.markAllDirty(epoch);
+            return;
+        }
+        $.epoch = epoch;
+        $.rescanEpoch = other.epoch;
+        $.dirtyTiles.clear();
+        if ($.quadtreeDepth == 0)
+            return;
+        ptrdiff_t radius = 1 << ($.quadtreeDepth - 1);
+        $.tiles.forEachDifference(other.tiles, [&](size_t i) {
+            size_t x, y;
+            unswizzle(i, &x, &y);
+            $.markDirty(ptrdiff_t(x) - radius, ptrdiff_t(y) - radius, epoch);
+        });
     }
 }
\ No newline at end of file
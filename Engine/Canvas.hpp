@@ -11,6 +11,8 @@
 
 #include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/StringRef.h>
+#include <chrono>
+#include <future>
 #include "Engine/Util/MappedFile.hpp"
 #include "Engine/Util/OpaqueIterator.hpp"
 #include "Engine/Util/Priv.hpp"
@@ -22,12 +24,31 @@ namespace Mega {
     struct Canvas : HasPriv<Canvas> {
         typedef std::array<std::uint8_t, 4> pixel_t;
 
+        struct Brush {
+            double size, hardness, spacing;
+            pixel_t color;
+        };
+        
+        enum class Filter { Nearest, Bilinear, Lanczos };
+        
+        // How a blitAsync() turned out, and why, if it failed.
+        struct BlitResult {
+            bool ok;
+            std::string error;
+            explicit operator bool() const { return ok; }
+        };
+
         MEGA_PRIV_CTORS(Canvas)
 
         static Owner<Canvas> create(std::string *outError);
         static Owner<Canvas> load(llvm::StringRef path, std::string *outError);
 
         PrivArrayRef<Layer> layers();
+        // Moves finished blitAsync() results into layers() and the undo
+        // stack. Edits, undo() and redo() do this too; otherwise it happens
+        // only when called, typically once at the start of each frame, so
+        // layers() never changes behind a caller's back.
+        void publish();
 
         std::size_t tileLogSize();
         std::size_t tileSize();
@@ -50,19 +71,87 @@ namespace Mega {
         bool save(std::string *outError);
         bool saveAs(llvm::StringRef path, std::string *outError);
         
-        void undo();
-        void redo();
+        // undo() and redo() fail only if the step had been moved to the
+        // history journal and can't be read back. The step is then lost,
+        // along with every step past it on the same stack, since they can
+        // no longer be reached in order.
+        bool undo(std::string *outError = nullptr);
+        bool redo(std::string *outError = nullptr);
         llvm::StringRef undoName();
         llvm::StringRef redoName();
+        
+        // History past historyMemoryBudget() bytes, oldest first, is moved to
+        // a journal on disk, which undo() and redo() read back as needed. A
+        // nonzero maxHistoryDepth() limits how many steps can be undone.
+        std::size_t historyMemoryBudget();
+        void historyMemoryBudget(std::size_t bytes);
+        std::size_t maxHistoryDepth();
+        void maxHistoryDepth(std::size_t depth);
+        std::size_t historyMemorySize();
+        
+        // Edits between beginUndoGroup() and the matching endUndoGroup() undo
+        // and redo as a single step called undoName. Groups nest; the
+        // outermost one names the step. undo() and redo() end any open group.
+        void beginUndoGroup(llvm::StringRef undoName);
+        void endUndoGroup();
+        // Consecutive edits with the same undo name less than
+        // undoCoalesceWindow() apart, such as the blits of a drag, also
+        // coalesce into one step. A zero window (the default) turns this off.
+        std::chrono::milliseconds undoCoalesceWindow();
+        void undoCoalesceWindow(std::chrono::milliseconds window);
 
         void blit(llvm::StringRef undoName,
                   void const *source,
                   size_t sourcePitch, size_t sourceW, size_t sourceH,
                   size_t destLayer, ptrdiff_t destX, ptrdiff_t destY,
                   pixel_t (*blendFunc)(pixel_t src, pixel_t dest));
+        // Like blit, but blends and saves tiles on a background thread. source
+        // must stay valid until the future is ready. The result is published to
+        // layers() (and the undo stack) by the first publish(), edit, undo() or
+        // redo() after that; until then layers() shows the layer as it was. A
+        // blit that fails leaves the layer alone and isn't published.
+        std::shared_future<BlitResult> blitAsync(llvm::StringRef undoName,
+                                                 void const *source,
+                                                 size_t sourcePitch, size_t sourceW, size_t sourceH,
+                                                 size_t destLayer, ptrdiff_t destX, ptrdiff_t destY,
+                                                 pixel_t (*blendFunc)(pixel_t src, pixel_t dest));
+        // transform maps source pixel coordinates to canvas coordinates.
+        void blitTransformed(llvm::StringRef undoName,
+                             void const *source,
+                             size_t sourcePitch, size_t sourceW, size_t sourceH,
+                             size_t destLayer, Affine transform, Filter filter,
+                             pixel_t (*blendFunc)(pixel_t src, pixel_t dest));
+        // fillRect sets every pixel in the rectangle to color, and clearRect
+        // sets them to transparent; neither blends with what was there.
+        void fillRect(llvm::StringRef undoName, size_t destLayer,
+                      ptrdiff_t x, ptrdiff_t y, size_t w, size_t h, pixel_t color);
+        void clearRect(llvm::StringRef undoName, size_t destLayer,
+                       ptrdiff_t x, ptrdiff_t y, size_t w, size_t h);
+        // copyRegion copies the w*h rectangle at x,y in sourceLayer to
+        // destX,destY in destLayer, replacing what was there. Where the
+        // offset lines the two layers' tiles up, whole tiles are shared
+        // instead of copied.
+        void copyRegion(llvm::StringRef undoName, size_t sourceLayer,
+                        ptrdiff_t x, ptrdiff_t y, size_t w, size_t h,
+                        size_t destLayer, ptrdiff_t destX, ptrdiff_t destY);
+        // stroke paints brush dabs along path, in canvas coordinates, onto
+        // destLayer. Dabs are brush.size pixels across and land every
+        // brush.spacing*brush.size pixels (at least one) along the path,
+        // starting spacingOffset pixels in; brush.hardness, from 0 to 1, is
+        // how much of the radius is solid before the edge fades out, and
+        // brush.color's alpha is each dab's opacity. The result is how far
+        // into the next path the next dab falls, so passing it as
+        // spacingOffset to the stroke() that continues this one keeps the
+        // spacing even across the join.
+        double stroke(llvm::StringRef undoName,
+                      size_t destLayer, llvm::ArrayRef<Vec> path,
+                      Brush const &brush, double spacingOffset = 0.0);
         void insertLayer(llvm::StringRef undoName, size_t index);
         void deleteLayer(llvm::StringRef undoName, size_t index);
         void moveLayer(llvm::StringRef undoName, size_t oldIndex, size_t newIndex);
+        // Replaces layers [begin, end), which must share a parallax, with one
+        // layer holding them composited in order.
+        void mergeLayers(llvm::StringRef undoName, size_t begin, size_t end);
         void setLayerParallax(llvm::StringRef undoName, size_t index, Vec parallax);
     };
 }
@@ -8,6 +8,7 @@
 
 #include "Engine/Util/GLMeta.hpp"
 #include <llvm/Support/raw_ostream.h>
+#include <cstring>
 #include <limits>
 
 namespace Mega {
@@ -150,4 +151,98 @@ namespace Mega {
             vertexShader = fragmentShader = program = 0;
         }
     }
-}
\ No newline at end of file
+    
+    static bool hasBufferStorage()
+    {
+#ifdef GL_MAP_PERSISTENT_BIT
+        GLint major, minor;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if (major > 4 || (major == 4 && minor >= 4))
+            return true;
+        GLint extensionCount;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+        for (GLint i = 0; i < extensionCount; ++i) {
+            auto extension = reinterpret_cast<char const *>(glGetStringi(GL_EXTENSIONS, GLuint(i)));
+            if (strcmp(extension, "GL_ARB_buffer_storage") == 0)
+                return true;
+        }
+#endif
+        return false;
+    }
+    
+    GLStagingRing::~GLStagingRing()
+    {
+        for (GLsync fence : fences)
+            if (fence)
+                glDeleteSync(fence);
+        if (mapped) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            MEGA_ASSERT_GL_NO_ERROR;
+        }
+    }
+    
+    void GLStagingRing::create(size_t slotSize, size_t slotCount, bool allowPersistent)
+    {
+        assert(!buffer && slotSize > 0 && slotCount > 0);
+        this->slotSize = slotSize;
+        this->slotCount = slotCount;
+        buffer.gen();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+#ifdef GL_MAP_PERSISTENT_BIT
+        if (allowPersistent && hasBufferStorage()) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(slotSize*slotCount), nullptr, flags);
+            mapped = static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                                            GLsizeiptr(slotSize*slotCount), flags));
+            assert(mapped);
+            persistent = true;
+            fences.resize(slotCount);
+        }
+#endif
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        MEGA_ASSERT_GL_NO_ERROR;
+    }
+    
+    GLvoid const *GLStagingRing::write(void const *data, size_t size)
+    {
+        return write(size, [=](uint8_t *slot) { memcpy(slot, data, size); });
+    }
+    
+    GLvoid const *GLStagingRing::write(size_t size, std::function<void (uint8_t*)> const &fill)
+    {
+        assert(buffer && size <= slotSize);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        if (!persistent) {
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(slotSize), nullptr, GL_STREAM_DRAW);
+            void *slot = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, GLsizeiptr(size),
+                                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            assert(slot);
+            fill(static_cast<uint8_t*>(slot));
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            MEGA_ASSERT_GL_NO_ERROR;
+            return nullptr;
+        }
+        
+        // the commands issued since the last write are the ones that read
+        // the last slot
+        size_t slot = nextSlot;
+        if (wroteSlot) {
+            size_t lastSlot = (slot + slotCount - 1) % slotCount;
+            fences[lastSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+        if (GLsync fence = fences[slot]) {
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+                ;
+            glDeleteSync(fence);
+            fences[slot] = nullptr;
+        }
+        fill(mapped + slot*slotSize);
+        nextSlot = (slot + 1) % slotCount;
+        wroteSlot = true;
+        MEGA_ASSERT_GL_NO_ERROR;
+        return reinterpret_cast<GLvoid const *>(slot*slotSize);
+    }
+}
@@ -12,11 +12,13 @@
 #include <functional>
 #include <memory>
 #include <utility>
+#include <llvm/ADT/SmallVector.h>
 #include "Engine/Util/Priv.hpp"
 #include "Engine/Vec.hpp"
 
 namespace Mega {
     size_t swizzle(std::size_t x, std::size_t y);
+    void unswizzle(std::size_t i, std::size_t *outX, std::size_t *outY);
     
     struct Layer : HasPriv<Layer> {
         using tile_t = std::uint32_t;
@@ -42,6 +44,26 @@ namespace Mega {
         };
         SegmentRef segment(std::size_t segmentSize, std::ptrdiff_t x, std::ptrdiff_t y);
         tile_t tile(std::ptrdiff_t x, std::ptrdiff_t y);
+        // Calls f(x, y, tile) for every nonzero tile whose coordinates lie in
+        // `tiles` (a rectangle in tile units), walking the layer's tile tree
+        // once and skipping the empty parts of it.
+        void forEachTileInRect(Rect tiles,
+                               std::function<void (std::ptrdiff_t, std::ptrdiff_t, tile_t)> const &f);
+        
+        // epoch() changes whenever the layer's tiles do. dirtyTilesSince()
+        // appends the coordinates of the tiles changed after a given epoch,
+        // or returns false if the layer can't tell (because it was resized,
+        // replaced, or changed too much), in which case treat every tile as
+        // dirty.
+        std::size_t epoch();
+        bool dirtyTilesSince(std::size_t epoch,
+                             llvm::SmallVectorImpl<std::pair<std::ptrdiff_t, std::ptrdiff_t>> *outTiles);
+        
+        // Whether the tiles in `tiles` are all empty, all fully opaque, or
+        // neither, found from the tile tree's per-node counts without
+        // visiting the tiles themselves. Tiles outside the layer are empty.
+        enum class Coverage { Empty, Partial, Opaque };
+        Coverage coverage(Rect tiles);
     };
 }
 
@@ -1,11 +1,34 @@
 #version 150
 
 uniform sampler2DArray tilesTexture;
+uniform usampler2DArray pageTable;
+uniform float tilesTextureSize;
+uniform float tileSize;
 
-noperspective in vec3 frag_texCoord;
+noperspective in vec3 frag_layerCoord;
 
 out vec4 color;
 
 void main() {
-    color = texture(tilesTexture, frag_texCoord);
+    // the layer's page table wraps around it, with an entry per tile giving
+    // the pool slot that holds it, plus one, or zero for nothing
+    vec2 tile = floor(frag_layerCoord.xy/tileSize);
+    int layer = int(frag_layerCoord.z + 0.5);
+    ivec2 entry = ivec2(mod(tile, vec2(textureSize(pageTable, 0).xy)));
+    uint mapped = texelFetch(pageTable, ivec3(entry, layer), 0).r;
+    if (mapped == 0u) {
+        color = vec4(0.0);
+        return;
+    }
+    
+    // slots are numbered across the rows of each page of the shared pool
+    // in turn
+    uint slot = mapped - 1u, slotsPerRow = uint(tilesTextureSize/tileSize);
+    uint slotsPerPage = slotsPerRow*slotsPerRow, pageSlot = slot % slotsPerPage;
+    vec2 slotCoord = vec2(float(pageSlot % slotsPerRow), float(pageSlot / slotsPerRow))*tileSize;
+    // neighboring slots hold unrelated tiles, so keep the filter inside
+    // this one
+    vec2 tileCoord = clamp(frag_layerCoord.xy - tile*tileSize, 0.5, tileSize - 0.5);
+    color = texture(tilesTexture, vec3((slotCoord + tileCoord)/tilesTextureSize,
+                                       float(slot / slotsPerPage)));
 }
\ No newline at end of file
@@ -17,116 +17,714 @@
 #include <deque>
 #include <limits>
 #include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <map>
 #include <mutex>
 #include <thread>
-
-#define MEGA_TILE_MANAGER_STATS
+#include <tuple>
+#include <vector>
 
 namespace Mega {
     using namespace std;
     using namespace llvm;
     
+    // Tiles from every layer share one pool of texture slots, as many as
+    // fit in the pool's size in bytes, in pages (texture array layers) no
+    // bigger than TEXTURE_SIZE on a side.
     static constexpr size_t TEXTURE_SIZE = 4096;
+    static constexpr size_t DEFAULT_POOL_SIZE = 64 << 20;
+    // The page table maps the tiles in view to texture slots. It wraps
+    // around, so it has to be bigger than the view by at least a tile.
+    static constexpr size_t PAGE_TABLE_SIZE = 64;
     
     static constexpr Layer::tile_t NO_TILE = Layer::tile_t(-1);
+    static constexpr size_t NO_SLOT = size_t(-1);
+    
+    // prefetch() looks this many require() calls ahead, keeping at most
+    // this many tiles queued or read and waiting for a slot
+    static constexpr double PREFETCH_FRAMES = 8.0;
+    static constexpr size_t MAX_PREFETCH_TILES = 64;
+    
+    static constexpr unsigned MAX_STREAM_THREADS = 2;
+    
+    static constexpr size_t DEFAULT_UPLOAD_BUDGET = 4 << 20;
+    // Tiles next to each other in a row of the texture are uploaded
+    // together, up to this many at a time.
+    static constexpr size_t MAX_UPLOAD_RUN = 8;
+    static constexpr size_t UPLOAD_RING_SLOTS = 8;
     
     struct TileLayer {
         Rect readyRect = {0.0, 0.0, 0.0, 0.0};
+        // the region prefetch() last hinted, in layer pixels
+        Rect prefetchRect = {0.0, 0.0, 0.0, 0.0};
+        size_t epoch = 0;
+        // the center of the view at the last require(), in layer tiles
+        Vec centerTile = {0.0, 0.0};
+        // the tile meant to be at each page table entry, whether it's in a
+        // slot yet or not, and the slot the entry points at, plus one, or
+        // zero for nothing
         unique_ptr<Layer::tile_t[]> tileMap;
+        unique_ptr<GLushort[]> pageTable;
+        bool pageTableChanged = false;
+        
+        TileLayer()
+        : tileMap(new Layer::tile_t[PAGE_TABLE_SIZE*PAGE_TABLE_SIZE]),
+          pageTable(new GLushort[PAGE_TABLE_SIZE*PAGE_TABLE_SIZE]())
+        {
+            fill(&tileMap[0], &tileMap[PAGE_TABLE_SIZE*PAGE_TABLE_SIZE], NO_TILE);
+        }
     };
+    
+    // tile `tile`, at x,y in layer `layer`, belongs at page table entry
+    // `entry`
+    struct Upload { size_t tile; ptrdiff_t x, y; size_t entry; size_t layer; };
+    // pixels to upload to a texture slot
+    struct StagedUpload { size_t slot; uint8_t const *pixels; };
         
     template<>
     struct Priv<TileManager> {
         Canvas canvas;
-        GLTexture texture;
-        FlipFlop<GLBuffer> pixelBuffers;
+        GLTexture texture, pageTexture;
+        GLStagingRing uploadRing;
         
-        unique_ptr<uint8_t[]> zeroTile;
+        // one per layer, by position, so that sort comparators reaching for
+        // a layer's state don't go back to the canvas. require() catches the
+        // count up with the canvas's; layers that move are marked dirty, so
+        // their state is rebuilt as it would be for any other change.
         unique_ptr<TileLayer[]> tileLayers;
+        size_t layerCount;
         
-        size_t tileSize, textureTileSize, textureTileCount;
+        // the pool is poolPages pages textureSize pixels (textureTileSize
+        // tiles) on a side, with slotCount slots numbered across each page's
+        // rows in turn
+        size_t tileSize, textureSize, textureTileSize, poolPages, slotCount;
         
-        Priv(Canvas c);
+        // the tile in each slot, zero if none, and how many page table
+        // entries in any layer point at it. The slots nothing points at are
+        // kept in a list, least recently used first, threaded through
+        // lruPrev/lruNext with slotCount as its head.
+        unique_ptr<Layer::tile_t[]> slotTiles;
+        unique_ptr<size_t[]> slotRefs, lruPrev, lruNext;
         
-        void prepareTexture();
+        // the slot holding each nonzero tile, as opposed to tileMap, which
+        // has the tile each page table entry is meant to show whether it's
+        // been uploaded yet or not
+        DenseMap<Layer::tile_t, size_t> tileSlots;
         
-        bool loadTilesInView(Vec center, Vec viewport);
+        // scratch for loadTilesInView: the page table entries the layer
+        // being scanned has a tile for
+        BitVector entriesMapped;
+        
+        // layers below this one are hidden in the current view behind an
+        // opaque one, so they aren't loaded or drawn
+        size_t firstVisibleLayer;
+        
+        // the view at the last require(), and how much the view moved and
+        // grew per require() lately, for prefetch() to extrapolate from
+        bool hasView;
+        Vec lastCenter, lastViewport, velocity, viewportVelocity;
+        
+        // Tiles are read on streamThreads, never on the GL thread.
+        // loadTilesInView queues the tiles it maps in streamQueue (the ones
+        // that come into view first at the front) and leaves their page
+        // table entries as they were (empty, or showing the tile an edit
+        // replaced) until a stream thread has read them into stagedTiles.
+        // Uploads waiting on a read, or on a frame with room in their
+        // uploadBudget (bytes per require()), are kept in waitingUploads,
+        // which only the GL thread touches. Tiles that can't be read go in
+        // failedTiles instead, and the uploads waiting on them are dropped.
+        // Tiles prefetch() asks for go on
+        // the back of streamQueue and are kept in prefetchedTiles until
+        // they're uploaded to a free slot or come into view. streamMutex
+        // guards the rest.
+        vector<thread> streamThreads;
+        mutex streamMutex;
+        condition_variable streamWork, streamDone;
+        deque<Layer::tile_t> streamQueue;
+        DenseSet<Layer::tile_t> queuedTiles;
+        map<Layer::tile_t, unique_ptr<uint8_t[]>> stagedTiles;
+        DenseSet<Layer::tile_t> failedTiles;
+        size_t tilesInFlight;
+        bool stopStreaming;
+        vector<Upload> waitingUploads;
+        DenseSet<Layer::tile_t> prefetchedTiles;
+        size_t uploadBudget;
         
-        ArrayRef<uint8_t> zeroTileRef() {
-            return {zeroTile.get(), $.canvas.tileByteSize()};
+        TileManager::Stats stats;
+        
+        Priv(Canvas c, size_t poolSize);
+        ~Priv();
+        
+        void streamTiles();
+        void requestTiles(ArrayRef<Upload> uploads);
+        void prefetchTiles(ArrayRef<Layer::tile_t> tiles);
+        bool uploadStagedTiles(size_t budget, bool wait);
+        void uploadTiles(MutableArrayRef<StagedUpload> uploads);
+        void flushPageTables();
+        
+        size_t residentSlot(Layer::tile_t tile);
+        size_t allocateSlot(Layer::tile_t tile);
+        void pointEntry(size_t layer, size_t entry, size_t slot);
+        void releaseEntry(size_t layer, size_t entry);
+        void unlinkSlot(size_t slot);
+        void appendSlot(size_t slot);
+        
+        double distanceFromView(Upload const &upload)
+        {
+            Vec d = Vec{upload.x + 0.5, upload.y + 0.5} - $.tileLayersRef()[upload.layer].centerTile;
+            return d.x*d.x + d.y*d.y;
         }
         
+        void trackView(Vec center, Vec viewport);
+        
+        void prepareTexture();
+        void allocatePageTables();
+        void resizeLayers(size_t count);
+        
+        bool loadTilesInView(Vec center, Vec viewport);
+        
         MutableArrayRef<TileLayer> tileLayersRef() {
-            return {tileLayers.get(), $.canvas.layers().size()};
+            return {tileLayers.get(), layerCount};
         }
         
-        MutableArrayRef<Layer::tile_t> tileMapRef(size_t layer) {
-            return {tileLayersRef()[layer].tileMap.get(), $.textureTileCount};
+        static size_t entry(ptrdiff_t x, ptrdiff_t y) {
+            return (y & (PAGE_TABLE_SIZE-1))*PAGE_TABLE_SIZE + (x & (PAGE_TABLE_SIZE-1));
         }
     };
     MEGA_PRIV_DTOR(TileManager)
         
-    Priv<TileManager>::Priv(Canvas c)
+    // As many slots as fit in poolSize bytes, at least one, in square pages
+    // a power of two tiles on a side. A pool too small for a full page gets
+    // one smaller page; bigger ones get as many full pages as fit.
+    static void poolLayout(size_t poolSize, size_t tileLogSize,
+                           size_t *outTextureTileSize, size_t *outPoolPages)
+    {
+        size_t tileByteSize = size_t(4) << (tileLogSize << 1);
+        size_t slots = max(size_t(1), poolSize/tileByteSize);
+        size_t pageTiles = TEXTURE_SIZE >> tileLogSize;
+        while (pageTiles > 1 && pageTiles*pageTiles > slots)
+            pageTiles >>= 1;
+        *outTextureTileSize = pageTiles;
+        *outPoolPages = slots/(pageTiles*pageTiles);
+    }
+    
+    Priv<TileManager>::Priv(Canvas c, size_t poolSize)
     :
     canvas(c),
-    zeroTile(new uint8_t[c.tileByteSize()]()),
     tileLayers(new TileLayer[c.layers().size()]()),
+    layerCount(c.layers().size()),
     tileSize(c.tileSize()),
-    textureTileSize(TEXTURE_SIZE >> c.tileLogSize()),
-    textureTileCount(textureTileSize*textureTileSize)
+    entriesMapped(PAGE_TABLE_SIZE*PAGE_TABLE_SIZE),
+    firstVisibleLayer(0),
+    hasView(false),
+    lastCenter{0.0, 0.0}, lastViewport{0.0, 0.0}, velocity{0.0, 0.0}, viewportVelocity{0.0, 0.0},
+    tilesInFlight(0),
+    stopStreaming(false),
+    uploadBudget(DEFAULT_UPLOAD_BUDGET)
     {
+        poolLayout(poolSize, c.tileLogSize(), &$.textureTileSize, &$.poolPages);
+        $.textureSize = $.textureTileSize*$.tileSize;
+        // page table entries hold slot numbers plus one
+        $.slotCount = min($.poolPages*$.textureTileSize*$.textureTileSize,
+                          size_t(numeric_limits<GLushort>::max()));
+        
         // nb: must be constructed with a valid GL context available
         $.texture.gen();
-        $.pixelBuffers.gen();
+        $.pageTexture.gen();
+        $.uploadRing.create(MAX_UPLOAD_RUN*c.tileByteSize(), UPLOAD_RING_SLOTS);
         $.prepareTexture();
         
-        for (TileLayer &tl : $.tileLayersRef()) {
-            tl.tileMap.reset(new Layer::tile_t[$.textureTileCount]);
-            fill(&tl.tileMap[0], &tl.tileMap[$.textureTileCount], NO_TILE);
+        size_t slots = $.slotCount;
+            
+        // every slot starts out free, in order, so the first tiles uploaded
+        // sit side by side
+        $.slotTiles.reset(new Layer::tile_t[slots]());
+        $.slotRefs.reset(new size_t[slots]());
+        $.lruPrev.reset(new size_t[slots + 1]);
+        $.lruNext.reset(new size_t[slots + 1]);
+        $.lruPrev[slots] = $.lruNext[slots] = slots;
+        for (size_t slot = 0; slot < slots; ++slot)
+            $.appendSlot(slot);
+        
+        unsigned threads = max(1U, min(MAX_STREAM_THREADS, thread::hardware_concurrency()/2));
+        for (unsigned i = 0; i < threads; ++i)
+            $.streamThreads.emplace_back([this] { $.streamTiles(); });
+    }
+    
+    Priv<TileManager>::~Priv()
+    {
+        {
+            lock_guard<mutex> lock($.streamMutex);
+            $.stopStreaming = true;
+        }
+        $.streamWork.notify_all();
+        for (thread &t : $.streamThreads)
+            t.join();
+    }
+    
+    void Priv<TileManager>::streamTiles()
+    {
+        size_t tileByteSize = $.canvas.tileByteSize();
+        unique_lock<mutex> lock($.streamMutex);
+        for (;;) {
+            $.streamWork.wait(lock, [this] { return $.stopStreaming || !$.streamQueue.empty(); });
+            if ($.stopStreaming)
+                return;
+            Layer::tile_t tile = $.streamQueue.front();
+            $.streamQueue.pop_front();
+            ++$.tilesInFlight;
+            lock.unlock();
+            
+            unique_ptr<uint8_t[]> pixels(new uint8_t[tileByteSize]);
+            string error;
+            bool ok = $.canvas.loadTileInto(tile, {pixels.get(), tileByteSize}, &error);
+            
+            lock.lock();
+            --$.tilesInFlight;
+            $.queuedTiles.erase(tile);
+            if (ok)
+                $.stagedTiles[tile] = move(pixels);
+            else
+                $.failedTiles.insert(tile);
+            $.streamDone.notify_all();
+        }
+    }
+    
+    void Priv<TileManager>::requestTiles(ArrayRef<Upload> uploads)
+    {
+        if (uploads.empty())
+            return;
+        size_t waitingBefore = $.waitingUploads.size();
+        $.waitingUploads.insert($.waitingUploads.end(), uploads.begin(), uploads.end());
+        
+        {
+            lock_guard<mutex> lock($.streamMutex);
+            // tiles just mapped are in view now, so they go ahead of the
+            // ones still queued from earlier frames
+            SmallVector<Layer::tile_t, 16> tiles;
+            for (size_t i = waitingBefore; i < $.waitingUploads.size(); ++i) {
+                Layer::tile_t tile = Layer::tile_t($.waitingUploads[i].tile);
+                if ($.stagedTiles.count(tile))
+                    continue;
+                if ($.queuedTiles.insert(tile).second)
+                    tiles.push_back(tile);
+                else if ($.prefetchedTiles.erase(tile)) {
+                    // prefetched, but not read yet, so it moves up too
+                    auto queued = find($.streamQueue.begin(), $.streamQueue.end(), tile);
+                    if (queued != $.streamQueue.end()) {
+                        $.streamQueue.erase(queued);
+                        tiles.push_back(tile);
+                    }
+                }
+            }
+            $.streamQueue.insert($.streamQueue.begin(), tiles.begin(), tiles.end());
+        }
+        $.streamWork.notify_all();
+    }
+    
+    void Priv<TileManager>::prefetchTiles(ArrayRef<Layer::tile_t> tiles)
+    {
+        if (tiles.empty())
+            return;
+        {
+            lock_guard<mutex> lock($.streamMutex);
+            // behind everything in view
+            for (Layer::tile_t tile : tiles)
+                if (!$.stagedTiles.count(tile) && $.queuedTiles.insert(tile).second) {
+                    $.streamQueue.push_back(tile);
+                    $.prefetchedTiles.insert(tile);
+                }
+        }
+        $.streamWork.notify_all();
+    }
+    
+    bool Priv<TileManager>::uploadStagedTiles(size_t budget, bool wait)
+    {
+        size_t tileByteSize = $.canvas.tileByteSize();
+        unique_lock<mutex> lock($.streamMutex);
+        if (wait)
+            $.streamDone.wait(lock, [this] { return $.streamQueue.empty() && $.tilesInFlight == 0; });
+        $.stats.tilesFailed += $.failedTiles.size();
+        
+        // upload the ready tiles nearest the middle of the view first, as
+        // many as the budget allows (but at least one), to slots taken from
+        // the least recently used, and forget about the entries that have
+        // moved on
+        stable_sort($.waitingUploads.begin(), $.waitingUploads.end(),
+                    [this](Upload const &a, Upload const &b) {
+            return $.distanceFromView(a) < $.distanceFromView(b);
+        });
+        size_t uploaded = 0;
+        SmallVector<StagedUpload, 16> ready;
+        SmallVector<unique_ptr<uint8_t[]>, 16> readyPixels;
+        DenseSet<Layer::tile_t> stillWaiting;
+        auto remaining = remove_if($.waitingUploads.begin(), $.waitingUploads.end(),
+                                   [&](Upload const &upload) {
+            Layer::tile_t tile = Layer::tile_t(upload.tile);
+            if ($.tileLayersRef()[upload.layer].tileMap[upload.entry] != tile) {
+                ++$.stats.tilesSkipped;
+                return true;
+            }
+            // another entry showing the same tile may have brought it in
+            size_t slot = $.residentSlot(tile);
+            if (slot == NO_SLOT) {
+                if ($.failedTiles.count(tile))
+                    return true;
+                auto staged = $.stagedTiles.find(tile);
+                if (staged == $.stagedTiles.end()
+                    || (uploaded > 0 && uploaded + tileByteSize > budget)) {
+                    stillWaiting.insert(tile);
+                    return false;
+                }
+                slot = $.allocateSlot(tile);
+                if (slot == NO_SLOT) {
+                    ++$.stats.tilesNoSlot;
+                    return true;
+                }
+                readyPixels.push_back(move(staged->second));
+                $.stagedTiles.erase(staged);
+                ready.push_back(StagedUpload{slot, readyPixels.back().get()});
+                uploaded += tileByteSize;
+            }
+            $.releaseEntry(upload.layer, upload.entry);
+            $.pointEntry(upload.layer, upload.entry, slot);
+            return true;
+        });
+        $.waitingUploads.erase(remaining, $.waitingUploads.end());
+        
+        // prefetched tiles that have been read go into the slots nothing has
+        // pointed at for longest, as the most recently used, while there's
+        // budget left, without wrapping around onto each other
+        SmallVector<Layer::tile_t, 16> prefetchDone;
+        DenseSet<size_t> prefetchSlots;
+        for (Layer::tile_t tile : $.prefetchedTiles) {
+            if ($.residentSlot(tile) != NO_SLOT || $.failedTiles.count(tile)) {
+                prefetchDone.push_back(tile);
+                continue;
+            }
+            auto staged = $.stagedTiles.find(tile);
+            if (staged == $.stagedTiles.end() || stillWaiting.count(tile))
+                continue;
+            size_t head = $.lruNext[$.slotCount];
+            if (uploaded + tileByteSize > budget || head == $.slotCount || prefetchSlots.count(head))
+                break;
+            size_t slot = $.allocateSlot(tile);
+            $.unlinkSlot(slot);
+            $.appendSlot(slot);
+            prefetchSlots.insert(slot);
+            readyPixels.push_back(move(staged->second));
+            $.stagedTiles.erase(staged);
+            ready.push_back(StagedUpload{slot, readyPixels.back().get()});
+            uploaded += tileByteSize;
+            prefetchDone.push_back(tile);
         }
+        for (Layer::tile_t tile : prefetchDone)
+            $.prefetchedTiles.erase(tile);
+        $.failedTiles.clear();
+        
+        // nobody wants what's left over, or what hasn't been read yet for
+        // entries that have moved on
+        for (auto i = $.stagedTiles.begin(); i != $.stagedTiles.end();)
+            if (stillWaiting.count(i->first) || $.prefetchedTiles.count(i->first))
+                ++i;
+            else
+                $.stagedTiles.erase(i++);
+        $.streamQueue.erase(remove_if($.streamQueue.begin(), $.streamQueue.end(),
+                                      [&](Layer::tile_t tile) {
+            if (stillWaiting.count(tile) || $.prefetchedTiles.count(tile))
+                return false;
+            $.queuedTiles.erase(tile);
+            return true;
+        }), $.streamQueue.end());
+        
+        // the stream threads can go on staging tiles while these go up
+        lock.unlock();
+        $.uploadTiles(ready);
+        return $.waitingUploads.empty();
+    }
+    
+    size_t Priv<TileManager>::residentSlot(Layer::tile_t tile)
+    {
+        auto found = $.tileSlots.find(tile);
+        return found == $.tileSlots.end() ? NO_SLOT : found->second;
+    }
+    
+    size_t Priv<TileManager>::allocateSlot(Layer::tile_t tile)
+    {
+        // evict the tile nothing has pointed at for longest, if any
+        size_t slot = $.lruNext[$.slotCount];
+        if (slot == $.slotCount)
+            return NO_SLOT;
+        if ($.slotTiles[slot] != 0)
+            $.tileSlots.erase($.slotTiles[slot]);
+        $.slotTiles[slot] = tile;
+        $.tileSlots[tile] = slot;
+        return slot;
+    }
+    
+    void Priv<TileManager>::pointEntry(size_t layer, size_t entry, size_t slot)
+    {
+        TileLayer &tl = $.tileLayersRef()[layer];
+        assert(tl.pageTable[entry] == 0);
+        if ($.slotRefs[slot]++ == 0)
+            $.unlinkSlot(slot);
+        tl.pageTable[entry] = GLushort(slot + 1);
+        tl.pageTableChanged = true;
+    }
+    
+    void Priv<TileManager>::releaseEntry(size_t layer, size_t entry)
+    {
+        // the slot keeps its tile until it's needed for another
+        TileLayer &tl = $.tileLayersRef()[layer];
+        GLushort &mapped = tl.pageTable[entry];
+        if (mapped == 0)
+            return;
+        size_t slot = mapped - 1;
+        if (--$.slotRefs[slot] == 0)
+            $.appendSlot(slot);
+        mapped = 0;
+        tl.pageTableChanged = true;
+    }
+    
+    void Priv<TileManager>::unlinkSlot(size_t slot)
+    {
+        $.lruNext[$.lruPrev[slot]] = $.lruNext[slot];
+        $.lruPrev[$.lruNext[slot]] = $.lruPrev[slot];
+    }
+    
+    void Priv<TileManager>::appendSlot(size_t slot)
+    {
+        size_t head = $.slotCount;
+        $.lruPrev[slot] = $.lruPrev[head];
+        $.lruNext[slot] = head;
+        $.lruNext[$.lruPrev[head]] = slot;
+        $.lruPrev[head] = slot;
+    }
+    
+    void Priv<TileManager>::uploadTiles(MutableArrayRef<StagedUpload> uploads)
+    {
+        // runs of slots side by side in a row of the texture go up in one
+        // call, with the tiles' rows interleaved in the staging buffer
+        std::sort(uploads.begin(), uploads.end(), [](StagedUpload const &a, StagedUpload const &b) {
+            return a.slot < b.slot;
+        });
+        size_t tileByteSize = $.canvas.tileByteSize(), rowByteSize = $.tileSize*4;
+        SmallVector<uint8_t const *, MAX_UPLOAD_RUN> run;
+        for (size_t i = 0; i < uploads.size();) {
+            StagedUpload const &first = uploads[i];
+            size_t pageSlots = $.textureTileSize*$.textureTileSize;
+            size_t page = first.slot / pageSlots;
+            size_t xw = first.slot % pageSlots % $.textureTileSize, yw = first.slot % pageSlots / $.textureTileSize;
+            run.clear();
+            size_t j = i;
+            for (; j < uploads.size() && run.size() < MAX_UPLOAD_RUN; ++j) {
+                StagedUpload const &next = uploads[j];
+                if (next.slot != first.slot + run.size() || xw + run.size() >= $.textureTileSize)
+                    break;
+                run.push_back(next.pixels);
+            }
+            i = j;
+            
+            auto copyBegun = chrono::steady_clock::now();
+            GLvoid const *source = $.uploadRing.write(run.size()*tileByteSize, [&](uint8_t *out) {
+                for (size_t row = 0; row < $.tileSize; ++row)
+                    for (uint8_t const *pixels : run) {
+                        memcpy(out, pixels + row*rowByteSize, rowByteSize);
+                        out += rowByteSize;
+                    }
+            });
+            auto uploadBegun = chrono::steady_clock::now();
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0,
+                            GLuint(xw * $.tileSize),
+                            GLuint(yw * $.tileSize),
+                            GLuint(page),
+                            GLuint(run.size() * $.tileSize), GLuint($.tileSize), 1,
+                            GL_BGRA, GL_UNSIGNED_BYTE, source);
+            MEGA_ASSERT_GL_NO_ERROR;
+            auto uploadEnded = chrono::steady_clock::now();
+            
+            $.stats.copyTime.record(uploadBegun - copyBegun);
+            $.stats.uploadTime.record(uploadEnded - uploadBegun);
+            $.stats.tilesUploaded += run.size();
+            $.stats.bytesUploaded += run.size()*tileByteSize;
+            ++$.stats.uploadCalls;
+        }
+    }
+    
+    void Priv<TileManager>::flushPageTables()
+    {
+        // nb: GL_PIXEL_UNPACK_BUFFER must be unbound
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, $.pageTexture);
+        auto tileLayers = $.tileLayersRef();
+        for (size_t i = 0; i < tileLayers.size(); ++i) {
+            TileLayer &tl = tileLayers[i];
+            if (!tl.pageTableChanged)
+                continue;
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, GLint(i),
+                            PAGE_TABLE_SIZE, PAGE_TABLE_SIZE, 1,
+                            GL_RED_INTEGER, GL_UNSIGNED_SHORT, tl.pageTable.get());
+            tl.pageTableChanged = false;
+        }
+        glActiveTexture(GL_TEXTURE0);
+        MEGA_ASSERT_GL_NO_ERROR;
     }
     
     void Priv<TileManager>::prepareTexture()
     {
         assert($.texture);
+        
+        // each layer gets a page table of integer slot numbers, which can't
+        // be filtered, but the tiles all share one pool
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, $.pageTexture);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        $.allocatePageTables();
+        
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D_ARRAY, $.texture);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         MEGA_ASSERT_GL_NO_ERROR;
         
-        assert($.canvas.layers().size() <= numeric_limits<GLsizei>::max());
-        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_SRGB8_ALPHA8, 
-                     TEXTURE_SIZE, TEXTURE_SIZE, GLsizei($.canvas.layers().size()),
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_SRGB8_ALPHA8,
+                     GLsizei($.textureSize), GLsizei($.textureSize), GLsizei($.poolPages),
                      0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
         MEGA_ASSERT_GL_NO_ERROR;
     }
     
+    // nb: leaves the page table texture bound to texture unit 1
+    void Priv<TileManager>::allocatePageTables()
+    {
+        assert($.layerCount <= numeric_limits<GLsizei>::max());
+        GLsizei layerCount = GLsizei($.layerCount);
+        vector<GLushort> empty(PAGE_TABLE_SIZE*PAGE_TABLE_SIZE*layerCount);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, $.pageTexture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16UI,
+                     PAGE_TABLE_SIZE, PAGE_TABLE_SIZE, layerCount,
+                     0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, empty.data());
+        MEGA_ASSERT_GL_NO_ERROR;
+    }
+    
+    void Priv<TileManager>::resizeLayers(size_t count)
+    {
+        if (count == $.layerCount)
+            return;
+            
+        // layers past the end let go of their slots and uploads
+        for (size_t i = count; i < $.layerCount; ++i)
+            for (size_t e = 0; e < PAGE_TABLE_SIZE*PAGE_TABLE_SIZE; ++e)
+                $.releaseEntry(i, e);
+        $.waitingUploads.erase(remove_if($.waitingUploads.begin(), $.waitingUploads.end(),
+                                         [&](Upload const &upload) {
+            if (upload.layer < count)
+                return false;
+            ++$.stats.tilesSkipped;
+            return true;
+        }), $.waitingUploads.end());
+        
+        unique_ptr<TileLayer[]> tileLayers(new TileLayer[count]());
+        move(&$.tileLayers[0], &$.tileLayers[min(count, $.layerCount)], &tileLayers[0]);
+        $.tileLayers = move(tileLayers);
+        $.layerCount = count;
+        
+        // the new texture starts out empty, so every page table goes up again
+        $.allocatePageTables();
+        glActiveTexture(GL_TEXTURE0);
+        for (TileLayer &tl : $.tileLayersRef())
+            tl.pageTableChanged = true;
+    }
+    
+    void Priv<TileManager>::trackView(Vec center, Vec viewport)
+    {
+        // average out the jitter of individual frames
+        if ($.hasView) {
+            $.velocity = 0.5*$.velocity + 0.5*(center - $.lastCenter);
+            $.viewportVelocity = 0.5*$.viewportVelocity + 0.5*(viewport - $.lastViewport);
+        }
+        $.hasView = true;
+        $.lastCenter = center;
+        $.lastViewport = viewport;
+    }
+    
     bool Priv<TileManager>::loadTilesInView(Vec center, Vec viewport)
     {
-#ifdef MEGA_TILE_MANAGER_STATS
-        auto begun = chrono::high_resolution_clock::now();
-#endif
+        auto begun = chrono::steady_clock::now();
         size_t tileSize = $.tileSize;
-        size_t tileByteSize = $.canvas.tileByteSize();
         auto layers = $.canvas.layers();
         Vec radius = 0.5*viewport;
+        $.resizeLayers(layers.size());
         
-        struct Upload { size_t tile; size_t xw; size_t yw; size_t layer; };
         SmallVector<Upload, 16> uploads;
+        SmallVector<pair<ptrdiff_t, ptrdiff_t>, 16> dirtyTiles;
         
-        if (viewport.x > (TEXTURE_SIZE - $.tileSize)
-            || viewport.y > (TEXTURE_SIZE - $.tileSize))
+        if (viewport.x > (PAGE_TABLE_SIZE - 1)*tileSize
+            || viewport.y > (PAGE_TABLE_SIZE - 1)*tileSize)
             errs() << "warning: viewport dimensions " << viewport.x << ","
-            << viewport.y << " too large for texture size\n";
+            << viewport.y << " too large for page table size\n";
 
-        for (size_t i = 0, end = layers.size(); i < end; ++i) {
+        // layers are drawn bottom up, so everything under the topmost layer
+        // that is opaque over the whole view can be skipped
+        $.firstVisibleLayer = 0;
+        for (size_t i = layers.size(); i-- > 0;) {
+            Layer l = layers[i];
+            Vec layerCenter = (center - l.origin()) * l.parallax();
+            Rect view{((layerCenter - radius)/tileSize).floor(), ((layerCenter + radius)/tileSize).ceil()};
+            if (l.coverage(view) == Layer::Coverage::Opaque) {
+                $.firstVisibleLayer = i;
+                break;
+            }
+        }
+
+        for (size_t i = $.firstVisibleLayer, end = layers.size(); i < end; ++i) {
             Layer l = layers[i];
             TileLayer &tl = $.tileLayersRef()[i];
             
             Vec layerCenter = (center - l.origin()) * l.parallax();
+            tl.centerTile = layerCenter/tileSize;
+            
+            auto mapTile = [&](ptrdiff_t x, ptrdiff_t y, Layer::tile_t layerTile) {
+                size_t e = entry(x, y);
+                Layer::tile_t &mappedTile = tl.tileMap[e];
+                if (mappedTile == layerTile)
+                    return;
+                mappedTile = layerTile;
+                // tiles seen lately may still be in the texture
+                size_t slot = layerTile == 0 ? NO_SLOT : $.residentSlot(layerTile);
+                if (slot != NO_SLOT) {
+                    $.releaseEntry(i, e);
+                    $.pointEntry(i, e, slot);
+                    ++$.stats.tilesResident;
+                    return;
+                }
+                // an entry already showing this spot keeps showing the tile
+                // the canvas replaced until the new one is uploaded, but one
+                // that showed somewhere else in the layer can't
+                if (layerTile == 0 || !tl.readyRect.contains(Vec{double(x), double(y)}*tileSize))
+                    $.releaseEntry(i, e);
+                if (layerTile != 0)
+                    uploads.push_back(Upload{layerTile, x, y, e, i});
+            };
+            
+            // remap tiles the canvas changed inside the region we already
+            // have, or start over if it can't say which ones changed
+            size_t epoch = l.epoch();
+            if (tl.epoch != epoch) {
+                dirtyTiles.clear();
+                if (l.dirtyTilesSince(tl.epoch, &dirtyTiles)) {
+                    for (auto &tile : dirtyTiles)
+                        if (tl.readyRect.contains(Vec{double(tile.first), double(tile.second)}*tileSize))
+                            mapTile(tile.first, tile.second, l.tile(tile.first, tile.second));
+                } else
+                    tl.readyRect = tl.prefetchRect = Rect{0.0, 0.0, 0.0, 0.0};
+                tl.epoch = epoch;
+            }
             
             if (tl.readyRect.contains(layerCenter - radius)
                 && tl.readyRect.contains(layerCenter + radius))
@@ -135,104 +733,199 @@ namespace Mega {
             Vec loTile = ((layerCenter - radius)/tileSize).floor();
             Vec hiTile = ((layerCenter + radius)/tileSize).ceil();
             
-            for (ptrdiff_t y = loTile.y, yend = hiTile.y; y < yend; ++y)
-                for (ptrdiff_t x = loTile.x, xend = hiTile.x; x < xend; ++x) {
-                    size_t xw = x & ($.textureTileSize-1), yw = y & ($.textureTileSize-1);
-                    Layer::tile_t layerTile = l.segment(1, x, y)[0];
-                    Layer::tile_t &loadedTile = $.tileMapRef(i)[yw*textureTileSize + xw];
-                    
-                    if (loadedTile != layerTile) {
-                        loadedTile = layerTile;
-                        uploads.push_back(Upload{layerTile, xw, yw, i});
-                        $.canvas.wantTile(layerTile);
+            // map the tiles the layer has in one walk of its tile tree, then
+            // the empty space between them, unless the view holds none
+            if (l.coverage(Rect{loTile, hiTile}) == Layer::Coverage::Empty) {
+                for (ptrdiff_t y = loTile.y, yend = hiTile.y; y < yend; ++y)
+                    for (ptrdiff_t x = loTile.x, xend = hiTile.x; x < xend; ++x)
+                        mapTile(x, y, 0);
+            } else {
+                $.entriesMapped.reset();
+                l.forEachTileInRect(Rect{loTile, hiTile}, [&](ptrdiff_t x, ptrdiff_t y, Layer::tile_t tile) {
+                    mapTile(x, y, tile);
+                    $.entriesMapped.set(entry(x, y));
+                });
+                for (ptrdiff_t y = loTile.y, yend = hiTile.y; y < yend; ++y)
+                    for (ptrdiff_t x = loTile.x, xend = hiTile.x; x < xend; ++x)
+                        if (!$.entriesMapped.test(entry(x, y)))
+                            mapTile(x, y, 0);
+            }
+            
+            // entries left over from earlier views let go of their slots,
+            // which keep their tiles until the slots are needed again
+            ptrdiff_t lox = loTile.x, loy = loTile.y, hix = hiTile.x, hiy = hiTile.y;
+            ptrdiff_t mask = PAGE_TABLE_SIZE - 1;
+            for (ptrdiff_t ey = 0; ey < ptrdiff_t(PAGE_TABLE_SIZE); ++ey) {
+                bool rowInView = loy + ((ey - loy) & mask) < hiy;
+                for (ptrdiff_t ex = 0; ex < ptrdiff_t(PAGE_TABLE_SIZE); ++ex)
+                    if (!rowInView || lox + ((ex - lox) & mask) >= hix) {
+                        size_t e = size_t(ey)*PAGE_TABLE_SIZE + size_t(ex);
+                        $.releaseEntry(i, e);
+                        tl.tileMap[e] = NO_TILE;
                     }
-                }
+            }
             
             tl.readyRect = Rect{loTile * tileSize, hiTile * tileSize};
         }
+        $.stats.mapTime.record(chrono::steady_clock::now() - begun);
+        $.stats.tilesRequested += uploads.size();
 
-        for (Upload &upload : uploads) {
-            std::string error;
-#ifdef MEGA_TILE_MANAGER_STATS
-            auto uploadBegun = chrono::high_resolution_clock::now();
-#endif
-            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, $.pixelBuffers.next());
-            glBufferData(GL_PIXEL_UNPACK_BUFFER, tileByteSize, nullptr, GL_STREAM_DRAW);
-            void *buf = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
-            assert(buf);
-            bool ok = $.canvas.loadTileInto(upload.tile,
-                                            {reinterpret_cast<uint8_t*>(buf), tileByteSize},
-                                            &error);
-            assert(ok);
-            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-            MEGA_ASSERT_GL_NO_ERROR;
-            
-#ifdef MEGA_TILE_MANAGER_STATS
-            auto texImageBegun = chrono::high_resolution_clock::now();
-#endif
-            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0,
-                            GLuint(upload.xw * $.tileSize),
-                            GLuint(upload.yw * $.tileSize),
-                            GLuint(upload.layer),
-                            GLuint($.tileSize), GLuint($.tileSize), 1,
-                            GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
-#ifdef MEGA_TILE_MANAGER_STATS
-            auto uploadEnded = chrono::high_resolution_clock::now();
-            errs() << "glBufferData in "
-            << chrono::duration_cast<chrono::nanoseconds>(texImageBegun - uploadBegun).count() << " ns, "
-            "glTexSubImage3D in "
-            << chrono::duration_cast<chrono::nanoseconds>(uploadEnded - texImageBegun).count() << " ns\n";
-#endif
-            MEGA_ASSERT_GL_NO_ERROR;
-        }
+        // finish what earlier frames started, then start on this one, reading
+        // from the middle of the view out
+        $.uploadStagedTiles($.uploadBudget, false);
+        std::sort(uploads.begin(), uploads.end(), [this](Upload const &a, Upload const &b) {
+            return $.distanceFromView(a) < $.distanceFromView(b);
+        });
+        $.requestTiles(uploads);
         
         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
         MEGA_ASSERT_GL_NO_ERROR;
-
-#ifdef MEGA_TILE_MANAGER_STATS
-        auto ended = chrono::high_resolution_clock::now();
-        errs() << "uploaded " << uploads.size() << " tiles in "
-        << chrono::duration_cast<chrono::nanoseconds>(ended - begun).count() << " ns\n";
-#endif
+        $.flushPageTables();
         
-        return true;
+        return $.waitingUploads.empty();
     }
     
     Owner<TileManager> TileManager::create(Canvas c)
     {
-        return createOwner<TileManager>(c);
+        return createOwner<TileManager>(c, DEFAULT_POOL_SIZE);
+    }
+    
+    Owner<TileManager> TileManager::create(Canvas c, std::size_t poolSize)
+    {
+        return createOwner<TileManager>(c, poolSize);
     }
     
     void TileManager::bindState()
     {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, $.pageTexture);
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D_ARRAY, $.texture);
     }
     
     MEGA_PRIV_GETTER(TileManager, texture, GLuint)
+    MEGA_PRIV_GETTER(TileManager, textureSize, size_t)
+    MEGA_PRIV_GETTER(TileManager, poolPages, size_t)
+    MEGA_PRIV_GETTER(TileManager, slotCount, size_t)
     
-    size_t TileManager::textureSize()
+    bool TileManager::require(Vec center, Vec viewport)
     {
-        return TEXTURE_SIZE;
+        $.trackView(center, viewport);
+        bool ready = $.loadTilesInView(center, viewport);
+#ifdef MEGA_TILE_MANAGER_STATS
+        $.stats.print(errs());
+        $$.resetStats();
+#endif
+        return ready;
     }
     
-    bool TileManager::require(Vec center, Vec viewport)
+    void TileManager::finishLoading()
     {
-        return $.loadTilesInView(center, viewport);
+        $.uploadStagedTiles(numeric_limits<size_t>::max(), true);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        MEGA_ASSERT_GL_NO_ERROR;
+        $.flushPageTables();
     }
     
-    bool TileManager::prefetch() {
+    bool TileManager::prefetch()
+    {
+        if (!$.hasView)
+            return false;
+        // a view that has (nearly) stopped won't uncover anything new
+        Vec moved = PREFETCH_FRAMES*$.velocity, grown = PREFETCH_FRAMES*$.viewportVelocity;
+        if (both(-1.0 < moved & moved < 1.0) && both(grown < 1.0))
+            return false;
         
+        size_t tileSize = $.tileSize;
+        auto layers = $.canvas.layers();
+        Vec center = $.lastCenter + moved;
+        Vec viewport = $.lastViewport + grown;
+        viewport = Vec{max(viewport.x, $.lastViewport.x), max(viewport.y, $.lastViewport.y)};
+        Vec radius = 0.5*viewport;
+        
+        // queue the tiles that will scroll into view that aren't mapped or
+        // queued already, behind the tiles in view, which require() asked
+        // for first
+        size_t budget = MAX_PREFETCH_TILES - min(MAX_PREFETCH_TILES, size_t($.prefetchedTiles.size()));
+        SmallVector<Layer::tile_t, MAX_PREFETCH_TILES> tiles;
+        // layers added since the last require() wait for the next one
+        size_t end = min(size_t(layers.size()), $.layerCount);
+        for (size_t i = $.firstVisibleLayer; i < end && budget > 0; ++i) {
+            Layer l = layers[i];
+            TileLayer &tl = $.tileLayersRef()[i];
+            Vec layerCenter = (center - l.origin()) * l.parallax();
+            Vec loTile = ((layerCenter - radius)/tileSize).floor();
+            Vec hiTile = ((layerCenter + radius)/tileSize).ceil();
+            
+            l.forEachTileInRect(Rect{loTile, hiTile}, [&](ptrdiff_t x, ptrdiff_t y, Layer::tile_t tile) {
+                Vec pixel = Vec{double(x), double(y)}*tileSize;
+                if (budget == 0 || tl.readyRect.contains(pixel) || tl.prefetchRect.contains(pixel)
+                    || $.residentSlot(tile) != NO_SLOT)
+                    return;
+                tiles.push_back(tile);
+                --budget;
+            });
+            if (budget > 0)
+                tl.prefetchRect = Rect{loTile * tileSize, hiTile * tileSize};
+        }
+        $.prefetchTiles(tiles);
+        return !tiles.empty();
+    }
+    
+    MEGA_PRIV_GETTER(TileManager, firstVisibleLayer, size_t)
+    
+    TileManager::Stats const &TileManager::stats()
+    {
+        return $.stats;
+    }
+    
+    void TileManager::resetStats()
+    {
+        $.stats = Stats();
+    }
+    
+    static void printHistogram(raw_ostream &os, char const *name, Histogram const &h)
+    {
+        os << name << ": " << h.count << " in " << h.total.count() << " ns, mean "
+        << h.mean().count() << " ns, p50 < " << h.quantile(0.5).count() << " ns, p99 < "
+        << h.quantile(0.99).count() << " ns, max " << h.max.count() << " ns\n";
+    }
+    
+    void TileManager::Stats::print(raw_ostream &os) const
+    {
+        os << "tiles: " << tilesResident << " resident, " << tilesRequested << " requested, "
+        << tilesUploaded << " uploaded (" << bytesUploaded << " bytes in " << uploadCalls
+        << " calls), " << tilesSkipped << " skipped, " << tilesNoSlot << " with no slot, "
+        << tilesFailed << " unreadable\n";
+        printHistogram(os, "map", mapTime);
+        printHistogram(os, "copy", copyTime);
+        printHistogram(os, "upload", uploadTime);
+    }
+    
+    MEGA_PRIV_GETTER_SETTER(TileManager, uploadBudget, size_t)
+    
+    size_t TileManager::pendingTileCount()
+    {
+        return $.waitingUploads.size();
     }
     
     bool TileManager::isTileReady(size_t tile)
     {
-        for (size_t l = 0, end = $.canvas.layers().size(); l < end; ++l) {
-            auto tileMap = $.tileMapRef(l);
-            for (Layer::tile_t mappedTile : tileMap)
-                if (mappedTile == tile)
-                    return true;
-        }
-        return false;
+        if (tile == 0 || tile == NO_TILE)
+            return false;
+        return $.tileSlots.count(Layer::tile_t(tile)) != 0;
+    }
+    
+    size_t TileManager::tileSlot(size_t tile)
+    {
+        if (tile == 0 || tile == NO_TILE)
+            return size_t(-1);
+        return $.residentSlot(Layer::tile_t(tile));
+    }
+    
+    size_t TileManager::mappedTile(size_t layer, ptrdiff_t x, ptrdiff_t y)
+    {
+        GLushort mapped = $.tileLayersRef()[layer].pageTable[$.entry(x, y)];
+        return mapped == 0 ? 0 : $.slotTiles[mapped - 1];
     }
 }
\ No newline at end of file
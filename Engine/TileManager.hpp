@@ -9,6 +9,9 @@
 #ifndef Megacanvas_TileManager_hpp
 #define Megacanvas_TileManager_hpp
 
+#include <cstdint>
+#include <llvm/Support/raw_ostream.h>
+#include "Engine/Util/Histogram.hpp"
 #include "Engine/Util/Priv.hpp"
 #include "Engine/Vec.hpp"
 
@@ -18,16 +21,77 @@ namespace Mega {
     struct TileManager : HasPriv<TileManager> {
         MEGA_PRIV_CTORS(TileManager)
         
+        // What require() and finishLoading() have done since the manager was
+        // created or the stats last reset. Tiles mapped into view are either
+        // already resident or requested from disk; requested tiles are
+        // uploaded, skipped if the view moved on by the time they were read,
+        // or dropped if every slot was taken by tiles in view (tilesNoSlot)
+        // or they couldn't be read (tilesFailed). The histograms time each
+        // require()'s walk of the view (map), each copy into the staging
+        // ring (copy), and each glTexSubImage3D call (upload).
+        struct Stats {
+            std::uint64_t tilesResident = 0, tilesRequested = 0;
+            std::uint64_t tilesUploaded = 0, tilesSkipped = 0, tilesNoSlot = 0, tilesFailed = 0;
+            std::uint64_t bytesUploaded = 0, uploadCalls = 0;
+            Histogram mapTime, copyTime, uploadTime;
+            
+            void print(llvm::raw_ostream &os) const;
+        };
+        
+        // Tiles from all the layers share one pool of tile-sized texture
+        // slots, as many as fit in poolSize bytes (64MB by default), no
+        // matter how many layers there are. The pool texture is an array of
+        // poolPages() pages, textureSize() pixels on a side.
         static Owner<TileManager> create(Canvas c);
+        static Owner<TileManager> create(Canvas c, std::size_t poolSize);
         
         void bindState();
         GLuint texture();
         std::size_t textureSize();
+        std::size_t poolPages();
+        std::size_t slotCount();
         
+        // Maps the tiles in view into the pool, through a page table per
+        // layer on texture unit 1 that gives the slot holding the tile at
+        // each position. Slots the view no longer needs keep their tiles
+        // until they're reused, least recently used first, so tiles seen
+        // lately come back without being read or uploaded again. Other
+        // tiles are read from disk in the background and uploaded by later
+        // calls, nearest the center first and no more than uploadBudget()
+        // bytes per call, with transparent placeholders in the meantime.
+        // Returns false if some tiles in view are still placeholders;
+        // pendingTileCount() says how many. finishLoading() waits for the
+        // reads and uploads the tiles.
         bool require(Vec center, Vec viewport);
+        void finishLoading();
+        std::size_t pendingTileCount();
+        
+        std::size_t uploadBudget();
+        void uploadBudget(std::size_t bytes);
+        // Extrapolates the view a few frames ahead from how it has moved and
+        // zoomed between require() calls, and queues the tiles that would
+        // come into view to be read behind the ones in view and uploaded to
+        // free slots as the upload budget allows. Returns whether there were
+        // any.
         bool prefetch();
+        // The bottommost layer not hidden behind an opaque one, as of the
+        // last require().
+        std::size_t firstVisibleLayer();
                 
+        // Stats are always kept. Builds with MEGA_TILE_MANAGER_STATS defined
+        // also print them to stderr and reset them after every require().
+        Stats const &stats();
+        void resetStats();
+        
+        // Whether a nonzero tile is resident in the pool, and where:
+        // tileSlot() gives the slot holding it, or size_t(-1), numbering
+        // slots across the rows of textureSize()/tileSize tiles of each
+        // page in turn. A tile in several layers or places has one slot.
         bool isTileReady(std::size_t tile);
+        std::size_t tileSlot(std::size_t tile);
+        // The tile the page table shows at x,y in a layer, or 0 for none,
+        // for positions in the last require()'s view.
+        std::size_t mappedTile(std::size_t layer, std::ptrdiff_t x, std::ptrdiff_t y);
     };
 }
 
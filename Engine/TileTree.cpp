@@ -0,0 +1,473 @@
+//
+//  TileTree.cpp
+//  Megacanvas
+//
+//  Created by Joe Groff on 8/9/12.
+//  Copyright (c) 2012 Durian Software. All rights reserved.
+//
+
+#include "Engine/TileTree.hpp"
+#include "Engine/Util/Morton.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <vector>
+
+namespace Mega {
+    using namespace std;
+    using namespace llvm;
+
+    // Nodes more than LEAF_LOG_SIZE levels above the bottom of the tree have
+    // four children; the rest (the leaves, or a small tree's root) hold
+    // 4^level tiles. A leaf with few nonzero tiles keeps only those, sorted by
+    // index, in `entries`; one that fills up switches to keeping all of them
+    // in `tiles`, and back again if it empties out. Every node counts the
+    // nonzero and opaque tiles under it; leaves mark which of theirs are
+    // opaque in `opaque`.
+    struct TileTree::Node {
+        struct Entry {
+            uint32_t index;
+            tile_t tile;
+        };
+        
+        shared_ptr<Node> children[4];
+        vector<tile_t> tiles;
+        vector<Entry> entries;
+        size_t count = 0, opaqueCount = 0;
+        uint64_t opaque[LEAF_SIZE/64] = {};
+        // run()'s dense copy of a sparse leaf, made on demand. Readers on
+        // other threads may be filling it in while a tree sharing this node
+        // copies it, so it's only ever touched through atomic_load and
+        // friends.
+        mutable shared_ptr<vector<tile_t> const> expanded;
+        
+        Node() = default;
+        // a copy is made to be written to, so it starts without a dense copy
+        // rather than sharing the original's
+        Node(Node const &n)
+        : tiles(n.tiles), entries(n.entries), count(n.count), opaqueCount(n.opaqueCount)
+        {
+            std::copy(begin(n.children), end(n.children), children);
+            std::copy(begin(n.opaque), end(n.opaque), opaque);
+        }
+        Node &operator=(Node const &) = delete;
+        
+        bool isSparse() const { return tiles.empty(); }
+        
+        tile_t tile(size_t i) const
+        {
+            if (!isSparse())
+                return tiles[i];
+            auto found = lower_bound(entries.begin(), entries.end(), i,
+                                     [](Entry e, size_t i) { return e.index < i; });
+            return found != entries.end() && found->index == i ? found->tile : 0;
+        }
+        
+        bool isOpaque(size_t i) const { return (opaque[i >> 6] >> (i & 63)) & 1; }
+        void setOpaque(size_t i, bool o)
+        {
+            if (o)
+                opaque[i >> 6] |= uint64_t(1) << (i & 63);
+            else
+                opaque[i >> 6] &= ~(uint64_t(1) << (i & 63));
+        }
+        
+        // copies the leaf's `n` tiles starting at `begin` to `out`
+        void copyTiles(size_t begin, size_t n, tile_t *out) const
+        {
+            if (!isSparse()) {
+                copy(tiles.begin() + begin, tiles.begin() + begin + n, out);
+                return;
+            }
+            fill(out, out + n, 0);
+            for (auto &e : entries)
+                if (e.index >= begin && e.index < begin + n)
+                    out[e.index - begin] = e.tile;
+        }
+    };
+    
+    // sparse leaves of 4^level tiles hold no more than this many entries...
+    static size_t maxSparseCount(size_t level) { return (size_t(1) << (level << 1)) / 8; }
+    // ...and dense leaves go back to being sparse below this many
+    static size_t minDenseCount(size_t level) { return (size_t(1) << (level << 1)) / 16; }
+
+    static const TileTree::tile_t zeroTiles[TileTree::LEAF_SIZE] = {};
+
+    TileTree::TileTree(size_t depth, ArrayRef<tile_t> swizzledTiles)
+    : depth(depth)
+    {
+        assert(swizzledTiles.size() == size());
+        for (size_t i = 0; i < swizzledTiles.size(); ++i)
+            if (swizzledTiles[i] != 0)
+                set(i, swizzledTiles[i]);
+    }
+
+    TileTree::Node *TileTree::mutableNode(shared_ptr<Node> &slot)
+    {
+        if (!slot)
+            slot = make_shared<Node>();
+        else if (slot.use_count() > 1)
+            slot = make_shared<Node>(*slot);
+        else
+            atomic_store(&slot->expanded, shared_ptr<vector<tile_t> const>());
+        return slot.get();
+    }
+
+    // the leaf holding tile i, if any, with i made relative to it
+    static TileTree::Node const *findLeaf(TileTree::Node const *node, size_t level, size_t *i)
+    {
+        while (node && level > TileTree::LEAF_LOG_SIZE) {
+            --level;
+            size_t shift = level << 1;
+            node = node->children[*i >> shift].get();
+            *i &= (size_t(1) << shift) - 1;
+        }
+        return node;
+    }
+
+    TileTree::tile_t TileTree::operator[](size_t i) const
+    {
+        assert(i < size());
+        Node const *node = findLeaf(root.get(), depth, &i);
+        return node ? node->tile(i) : 0;
+    }
+
+    bool TileTree::isOpaque(size_t i) const
+    {
+        assert(i < size());
+        Node const *node = findLeaf(root.get(), depth, &i);
+        return node && node->isOpaque(i);
+    }
+
+    void TileTree::set(size_t i, tile_t tile, bool opaque)
+    {
+        assert(i < size());
+        opaque = opaque && tile != 0;
+        // don't copy a path just to write what's already there
+        if ((*this)[i] == tile && isOpaque(i) == opaque)
+            return;
+        shared_ptr<Node> *path[sizeof(size_t)*4];
+        size_t pathSize = 0;
+        shared_ptr<Node> *slot = &root;
+        size_t level = depth;
+        Node *node;
+        for (;;) {
+            path[pathSize++] = slot;
+            node = mutableNode(*slot);
+            if (level <= LEAF_LOG_SIZE)
+                break;
+            --level;
+            size_t shift = level << 1;
+            slot = &node->children[i >> shift];
+            i &= (size_t(1) << shift) - 1;
+        }
+        
+        tile_t old = node->tile(i);
+        ptrdiff_t countChange = ptrdiff_t(tile != 0) - ptrdiff_t(old != 0);
+        ptrdiff_t opaqueChange = ptrdiff_t(opaque) - ptrdiff_t(node->isOpaque(i));
+        for (size_t p = 0; p < pathSize; ++p) {
+            Node *n = path[p]->get();
+            n->count += countChange;
+            n->opaqueCount += opaqueChange;
+        }
+        node->setOpaque(i, opaque);
+        if (old == tile) {
+            // only the tile's opacity changed
+        } else if (node->isSparse()) {
+            auto found = lower_bound(node->entries.begin(), node->entries.end(), i,
+                                     [](Node::Entry e, size_t i) { return e.index < i; });
+            if (old == 0)
+                node->entries.insert(found, Node::Entry{uint32_t(i), tile});
+            else if (tile == 0)
+                node->entries.erase(found);
+            else
+                found->tile = tile;
+            if (node->count > maxSparseCount(level)) {
+                node->tiles.resize(size_t(1) << (level << 1));
+                for (auto &e : node->entries)
+                    node->tiles[e.index] = e.tile;
+                node->entries = vector<Node::Entry>();
+            }
+        } else {
+            node->tiles[i] = tile;
+            if (node->count < minDenseCount(level)) {
+                node->entries.reserve(node->count);
+                for (size_t j = 0; j < node->tiles.size(); ++j)
+                    if (node->tiles[j] != 0)
+                        node->entries.push_back(Node::Entry{uint32_t(j), node->tiles[j]});
+                node->tiles = vector<tile_t>();
+            }
+        }
+        
+        // drop the topmost node that no longer holds anything, so that only
+        // subtrees with nonzero tiles are non-null
+        for (size_t p = 0; p < pathSize; ++p)
+            if ((*path[p])->count == 0) {
+                path[p]->reset();
+                break;
+            }
+    }
+
+    ArrayRef<TileTree::tile_t> TileTree::run(size_t i, size_t count) const
+    {
+        assert(count <= LEAF_SIZE && count <= size() && i % count == 0 && i < size());
+        size_t level = min(depth, LEAF_LOG_SIZE);
+        Node const *node = findLeaf(root.get(), depth, &i);
+        if (!node)
+            return makeArrayRef(zeroTiles, count);
+        if (!node->isSparse())
+            return makeArrayRef(&node->tiles[i], count);
+        
+        // the first caller to ask expands a sparse leaf; anyone racing it
+        // uses its copy
+        auto expanded = atomic_load(&node->expanded);
+        if (!expanded) {
+            auto dense = make_shared<vector<tile_t>>(size_t(1) << (level << 1));
+            node->copyTiles(0, dense->size(), dense->data());
+            shared_ptr<vector<tile_t> const> none;
+            expanded = dense;
+            if (!atomic_compare_exchange_strong(&node->expanded, &none, expanded))
+                expanded = none;
+        }
+        return makeArrayRef(expanded->data() + i, count);
+    }
+
+    void TileTree::grow(unsigned quadrant)
+    {
+        assert(quadrant < 4);
+        if (root && depth < LEAF_LOG_SIZE) {
+            // small trees are a single leaf, which has to grow in place
+            size_t oldSize = size();
+            auto newRoot = make_shared<Node>();
+            newRoot->count = root->count;
+            newRoot->opaqueCount = root->opaqueCount;
+            for (size_t j = 0; j < oldSize; ++j)
+                newRoot->setOpaque(j + quadrant*oldSize, root->isOpaque(j));
+            if (root->isSparse()) {
+                newRoot->entries = root->entries;
+                for (auto &e : newRoot->entries)
+                    e.index += quadrant*oldSize;
+            } else {
+                newRoot->tiles.resize(oldSize << 2);
+                copy(root->tiles.begin(), root->tiles.end(), newRoot->tiles.begin() + quadrant*oldSize);
+            }
+            root = move(newRoot);
+        } else if (root) {
+            auto newRoot = make_shared<Node>();
+            newRoot->count = root->count;
+            newRoot->opaqueCount = root->opaqueCount;
+            newRoot->children[quadrant] = move(root);
+            root = move(newRoot);
+        }
+        ++depth;
+    }
+
+    void TileTree::embed(size_t newDepth, size_t x, size_t y)
+    {
+        assert(newDepth >= depth);
+        assert((x & ((size_t(1) << depth) - 1)) == 0 && (y & ((size_t(1) << depth) - 1)) == 0);
+        while (depth < newDepth)
+            grow(unsigned(((x >> depth) & 1) | (((y >> depth) & 1) << 1)));
+    }
+
+    void TileTree::extract(size_t newDepth, size_t x, size_t y)
+    {
+        assert(newDepth <= depth);
+        assert((x & ((size_t(1) << newDepth) - 1)) == 0 && (y & ((size_t(1) << newDepth) - 1)) == 0);
+        shared_ptr<Node> node = root;
+        size_t level = depth;
+        while (node && level > max(newDepth, LEAF_LOG_SIZE)) {
+            --level;
+            node = node->children[((x >> level) & 1) | (((y >> level) & 1) << 1)];
+        }
+        if (node && level > newDepth) {
+            // the new tree is smaller than a leaf; copy its part of the leaf
+            size_t offset = 0;
+            while (level > newDepth) {
+                --level;
+                offset += (((x >> level) & 1) | (((y >> level) & 1) << 1)) << (level << 1);
+            }
+            size_t n = size_t(1) << (newDepth << 1);
+            auto leaf = make_shared<Node>();
+            if (node->isSparse()) {
+                for (auto &e : node->entries)
+                    if (e.index >= offset && e.index < offset + n)
+                        leaf->entries.push_back(Node::Entry{uint32_t(e.index - offset), e.tile});
+                leaf->count = leaf->entries.size();
+            } else {
+                leaf->tiles.assign(node->tiles.begin() + offset, node->tiles.begin() + offset + n);
+                leaf->count = n - size_t(count(leaf->tiles.begin(), leaf->tiles.end(), 0));
+            }
+            for (size_t j = 0; j < n; ++j)
+                if (node->isOpaque(offset + j)) {
+                    leaf->setOpaque(j, true);
+                    ++leaf->opaqueCount;
+                }
+            node = leaf->count != 0 ? move(leaf) : nullptr;
+        }
+        root = move(node);
+        depth = newDepth;
+    }
+
+    static void forEachTileIn(TileTree::Node const *node, size_t level, size_t base,
+                              function<void (size_t, TileTree::tile_t)> const &f);
+
+    void TileTree::forEachTile(function<void (size_t, tile_t)> const &f) const
+    {
+        forEachTileIn(root.get(), depth, 0, f);
+    }
+
+    static void forEachTileIn(TileTree::Node const *node, size_t level, size_t base,
+                              function<void (size_t, TileTree::tile_t)> const &f)
+    {
+        if (!node)
+            return;
+        if (level <= TileTree::LEAF_LOG_SIZE) {
+            if (node->isSparse()) {
+                for (auto &e : node->entries)
+                    f(base + e.index, e.tile);
+                return;
+            }
+            for (size_t i = 0, end = node->tiles.size(); i < end; ++i)
+                if (node->tiles[i] != 0)
+                    f(base + i, node->tiles[i]);
+            return;
+        }
+        size_t childSize = size_t(1) << ((level - 1) << 1);
+        for (size_t c = 0; c < 4; ++c)
+            forEachTileIn(node->children[c].get(), level - 1, base + c*childSize, f);
+    }
+
+    static void forEachTileInRectIn(TileTree::Node const *node, size_t level, size_t bx, size_t by,
+                                    size_t x0, size_t y0, size_t x1, size_t y1,
+                                    function<void (size_t, size_t, TileTree::tile_t)> const &f)
+    {
+        size_t size = size_t(1) << level;
+        if (!node || bx >= x1 || by >= y1 || bx + size <= x0 || by + size <= y0)
+            return;
+        if (level <= TileTree::LEAF_LOG_SIZE) {
+            auto visit = [&](size_t i, TileTree::tile_t tile) {
+                uint32_t lx, ly;
+                mortonDecode(i, &lx, &ly);
+                size_t x = bx + lx, y = by + ly;
+                if (x >= x0 && x < x1 && y >= y0 && y < y1)
+                    f(x, y, tile);
+            };
+            if (node->isSparse()) {
+                for (auto &e : node->entries)
+                    visit(e.index, e.tile);
+                return;
+            }
+            for (size_t i = 0, end = node->tiles.size(); i < end; ++i)
+                if (node->tiles[i] != 0)
+                    visit(i, node->tiles[i]);
+            return;
+        }
+        size_t half = size >> 1;
+        for (size_t c = 0; c < 4; ++c)
+            forEachTileInRectIn(node->children[c].get(), level - 1,
+                                bx + (c & 1)*half, by + (c >> 1)*half,
+                                x0, y0, x1, y1, f);
+    }
+
+    void TileTree::forEachTileInRect(size_t x0, size_t y0, size_t x1, size_t y1,
+                                     function<void (size_t, size_t, tile_t)> const &f) const
+    {
+        forEachTileInRectIn(root.get(), depth, 0, 0, x0, y0, x1, y1, f);
+    }
+
+    // Folds the part of the node at bx,by within x0,y0,x1,y1 into `any` (has
+    // a nonzero tile) and `all` (every tile is opaque), stopping as soon as
+    // the answer is known to be Partial.
+    static void coverageIn(TileTree::Node const *node, size_t level, size_t bx, size_t by,
+                           size_t x0, size_t y0, size_t x1, size_t y1, bool *any, bool *all)
+    {
+        size_t size = size_t(1) << level;
+        if ((*any && !*all) || bx >= x1 || by >= y1 || bx + size <= x0 || by + size <= y0)
+            return;
+        if (!node) {
+            *all = false;
+            return;
+        }
+        if (bx >= x0 && by >= y0 && bx + size <= x1 && by + size <= y1) {
+            *any = *any || node->count > 0;
+            *all = *all && node->opaqueCount == size_t(1) << (level << 1);
+            return;
+        }
+        if (level <= TileTree::LEAF_LOG_SIZE) {
+            for (size_t y = max(by, y0), yEnd = min(by + size, y1); y < yEnd; ++y)
+                for (size_t x = max(bx, x0), xEnd = min(bx + size, x1); x < xEnd; ++x) {
+                    size_t i = size_t(mortonEncode(uint32_t(x - bx), uint32_t(y - by)));
+                    *all = *all && node->isOpaque(i);
+                    *any = *any || node->tile(i) != 0;
+                }
+            return;
+        }
+        size_t half = size >> 1;
+        for (size_t c = 0; c < 4; ++c)
+            coverageIn(node->children[c].get(), level - 1,
+                       bx + (c & 1)*half, by + (c >> 1)*half,
+                       x0, y0, x1, y1, any, all);
+    }
+
+    TileTree::Coverage TileTree::coverage(size_t x0, size_t y0, size_t x1, size_t y1) const
+    {
+        if (x0 >= x1 || y0 >= y1)
+            return Coverage::Empty;
+        bool any = false, all = true;
+        coverageIn(root.get(), depth, 0, 0, x0, y0, x1, y1, &any, &all);
+        return all ? Coverage::Opaque : any ? Coverage::Partial : Coverage::Empty;
+    }
+
+    static void forEachDifferenceIn(TileTree::Node const *a, TileTree::Node const *b,
+                                    size_t level, size_t base,
+                                    function<void (size_t)> const &f)
+    {
+        if (a == b)
+            return;
+        if (level <= TileTree::LEAF_LOG_SIZE) {
+            size_t count = size_t(1) << (level << 1);
+            TileTree::tile_t ta[TileTree::LEAF_SIZE] = {}, tb[TileTree::LEAF_SIZE] = {};
+            if (a)
+                a->copyTiles(0, count, ta);
+            if (b)
+                b->copyTiles(0, count, tb);
+            for (size_t i = 0; i < count; ++i)
+                if (ta[i] != tb[i])
+                    f(base + i);
+            return;
+        }
+        size_t childSize = size_t(1) << ((level - 1) << 1);
+        for (size_t c = 0; c < 4; ++c)
+            forEachDifferenceIn(a ? a->children[c].get() : nullptr,
+                                b ? b->children[c].get() : nullptr,
+                                level - 1, base + c*childSize, f);
+    }
+
+    void TileTree::forEachDifference(TileTree const &other,
+                                     function<void (size_t)> const &f) const
+    {
+        assert(depth == other.depth);
+        forEachDifferenceIn(root.get(), other.root.get(), depth, 0, f);
+    }
+
+    static size_t ownedMemorySizeOf(shared_ptr<TileTree::Node> const &node)
+    {
+        if (!node || node.use_count() > 1)
+            return 0;
+        size_t size = sizeof(TileTree::Node) + node->tiles.capacity()*sizeof(TileTree::tile_t)
+            + node->entries.capacity()*sizeof(TileTree::Node::Entry);
+        // held by the node and by us
+        auto expanded = atomic_load(&node->expanded);
+        if (expanded && expanded.use_count() == 2)
+            size += expanded->capacity()*sizeof(TileTree::tile_t);
+        for (auto &child : node->children)
+            size += ownedMemorySizeOf(child);
+        return size;
+    }
+
+    size_t TileTree::ownedMemorySize() const
+    {
+        return ownedMemorySizeOf(root);
+    }
+}
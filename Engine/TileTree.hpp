@@ -0,0 +1,97 @@
+//
+//  TileTree.hpp
+//  Megacanvas
+//
+//  Created by Joe Groff on 8/9/12.
+//  Copyright (c) 2012 Durian Software. All rights reserved.
+//
+
+#ifndef Megacanvas_TileTree_hpp
+#define Megacanvas_TileTree_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <llvm/ADT/ArrayRef.h>
+
+namespace Mega {
+    //
+    // A square grid of tile ids, 2^depth tiles on a side, indexed in swizzled
+    // order and stored as a persistent quadtree. Copies share all their
+    // nodes, so copying a tree is O(1); set() copies only the shared nodes on
+    // the path to the tile it changes. Subtrees that were never written are
+    // null and read as zero.
+    //
+    // Each tile also carries an opaque bit, which the tree's owner sets for
+    // tiles it knows have no transparent pixels, and every node counts the
+    // nonzero and opaque tiles under it, so coverage() can tell an empty or
+    // fully opaque region in time proportional to its perimeter in nodes.
+    //
+    struct TileTree {
+        using tile_t = std::uint32_t;
+
+        // leaves hold 2^LEAF_LOG_SIZE tiles on a side, stored contiguously
+        static constexpr std::size_t LEAF_LOG_SIZE = 4;
+        static constexpr std::size_t LEAF_SIZE = std::size_t(1) << (LEAF_LOG_SIZE << 1);
+
+        TileTree() : depth(0) {}
+        explicit TileTree(std::size_t depth) : depth(depth) {}
+        TileTree(std::size_t depth, llvm::ArrayRef<tile_t> swizzledTiles);
+
+        std::size_t size() const { return std::size_t(1) << (depth << 1); }
+
+        enum class Coverage { Empty, Partial, Opaque };
+
+        tile_t operator[](std::size_t i) const;
+        bool isOpaque(std::size_t i) const;
+        // Zero tiles are never opaque.
+        void set(std::size_t i, tile_t tile, bool opaque = false);
+
+        // The `count` tiles starting at i, where count is a power of four no
+        // bigger than LEAF_SIZE and i is a multiple of count.
+        llvm::ArrayRef<tile_t> run(std::size_t i, std::size_t count) const;
+
+        // Doubles the tree's size, keeping the current tiles in the given
+        // quadrant (0 to 3, in swizzle order) of the new tree.
+        void grow(unsigned quadrant);
+
+        // Makes this tree the square of a tree 2^newDepth on a side whose
+        // corner is x,y (which must be multiples of the current size), the
+        // rest of which is empty.
+        void embed(std::size_t newDepth, std::size_t x, std::size_t y);
+        // Replaces this tree with its square 2^newDepth on a side with corner
+        // x,y (which must be multiples of that size).
+        void extract(std::size_t newDepth, std::size_t x, std::size_t y);
+
+        // Calls f(i, tile) for every nonzero tile, in index order.
+        void forEachTile(std::function<void (std::size_t, tile_t)> const &f) const;
+        // Calls f(x, y, tile) for every nonzero tile with x0 <= x < x1 and
+        // y0 <= y < y1, in index order. Subtrees outside the rectangle or
+        // never written aren't visited.
+        void forEachTileInRect(std::size_t x0, std::size_t y0, std::size_t x1, std::size_t y1,
+                               std::function<void (std::size_t, std::size_t, tile_t)> const &f) const;
+        // Whether the tiles with x0 <= x < x1 and y0 <= y < y1 are all zero,
+        // all opaque, or neither.
+        Coverage coverage(std::size_t x0, std::size_t y0, std::size_t x1, std::size_t y1) const;
+        // Calls f(i) for every index at which the trees, which must be the
+        // same size, hold different tiles. Subtrees the trees share are
+        // skipped, so this costs time proportional to how far they diverged.
+        void forEachDifference(TileTree const &other,
+                               std::function<void (std::size_t)> const &f) const;
+
+        // The bytes held by nodes that no other tree shares, which is what
+        // dropping this tree would free.
+        std::size_t ownedMemorySize() const;
+
+        std::size_t depth;
+
+        struct Node;
+    private:
+        std::shared_ptr<Node> root;
+
+        static Node *mutableNode(std::shared_ptr<Node> &slot);
+    };
+}
+
+#endif
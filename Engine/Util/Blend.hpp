@@ -0,0 +1,90 @@
+//
+//  Blend.hpp
+//  Megacanvas
+//
+//  Created by Joe Groff on 8/2/12.
+//  Copyright (c) 2012 Durian Software. All rights reserved.
+//
+
+#ifndef Megacanvas_Blend_hpp
+#define Megacanvas_Blend_hpp
+
+#include <cstdint>
+#include <cstring>
+#include <emmintrin.h>
+
+//
+// SSE helpers for working with tile pixels. A pixel is four 8-bit unorm
+// channels in tile byte order (BGRA) with straight alpha in the last channel;
+// in registers a pixel is one __m128 of floats in [0,1], one channel per lane.
+//
+
+namespace Mega {
+    inline __m128 loadPixel(std::uint8_t const *p)
+    {
+        std::int32_t word;
+        std::memcpy(&word, p, 4);
+        __m128i zero = _mm_setzero_si128();
+        __m128i x = _mm_cvtsi32_si128(word);
+        x = _mm_unpacklo_epi8(x, zero);
+        x = _mm_unpacklo_epi16(x, zero);
+        return _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(1.0f/255.0f));
+    }
+
+    inline void storePixel(std::uint8_t *p, __m128 v)
+    {
+        __m128i x = _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+        x = _mm_packs_epi32(x, x);
+        x = _mm_packus_epi16(x, x);
+        std::int32_t word = _mm_cvtsi128_si32(x);
+        std::memcpy(p, &word, 4);
+    }
+
+    inline __m128 splatAlpha(__m128 v)
+    {
+        return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3,3,3,3));
+    }
+    
+    // color's color channels with alpha's alpha channel
+    inline __m128 withAlpha(__m128 color, __m128 alpha)
+    {
+        __m128 alphaLane = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+        return _mm_or_ps(_mm_andnot_ps(alphaLane, color), _mm_and_ps(alphaLane, alpha));
+    }
+    
+    inline __m128 premultiply(__m128 v)
+    {
+        return withAlpha(_mm_mul_ps(v, splatAlpha(v)), v);
+    }
+    
+    // Also clamps v to a valid premultiplied color first, since filters with
+    // negative lobes can overshoot.
+    inline __m128 unpremultiply(__m128 v)
+    {
+        __m128 a = _mm_min_ps(_mm_max_ps(splatAlpha(v), _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        __m128 color = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), a);
+        __m128 covered = _mm_cmpgt_ps(a, _mm_setzero_ps());
+        color = _mm_and_ps(covered, _mm_div_ps(color, _mm_max_ps(a, _mm_set1_ps(1e-20f))));
+        return withAlpha(color, a);
+    }
+
+    // Straight-alpha source-over of src onto dest, with src's alpha scaled by
+    // coverage (which should have the same value in every lane).
+    inline __m128 sourceOver(__m128 src, __m128 dest, __m128 coverage)
+    {
+        __m128 sa = _mm_mul_ps(splatAlpha(src), coverage);
+        __m128 da = _mm_mul_ps(splatAlpha(dest), _mm_sub_ps(_mm_set1_ps(1.0f), sa));
+        __m128 oa = _mm_add_ps(sa, da);
+        __m128 color = _mm_add_ps(_mm_mul_ps(src, sa), _mm_mul_ps(dest, da));
+        __m128 covered = _mm_cmpgt_ps(oa, _mm_setzero_ps());
+        color = _mm_and_ps(covered, _mm_div_ps(color, _mm_max_ps(oa, _mm_set1_ps(1e-20f))));
+        return withAlpha(color, oa);
+    }
+
+    inline __m128 sourceOver(__m128 src, __m128 dest)
+    {
+        return sourceOver(src, dest, _mm_set1_ps(1.0f));
+    }
+}
+
+#endif
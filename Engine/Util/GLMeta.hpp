@@ -15,6 +15,9 @@
 #include "Engine/Util/GL.h"
 #include "Engine/Util/StructMeta.hpp"
 #include <array>
+#include <cstdint>
+#include <functional>
+#include <vector>
 
 namespace Mega {
     enum class GLError : GLenum {
@@ -282,6 +285,42 @@ namespace Mega {
     _MEGA_GL_RESOURCE(Renderbuffer)
     _MEGA_GL_RESOURCE(VertexArray)
 #undef _MEGA_GL_RESOURCE
+    
+    //
+    // A pixel unpack buffer divided into slotCount slots of slotSize bytes,
+    // written in turn. Where GL_ARB_buffer_storage is available the buffer
+    // stays mapped, persistently and coherently, and a slot is only waited on
+    // if the GPU hasn't finished reading it by the time the ring comes back
+    // around to it, so copying into one slot overlaps the transfers out of
+    // the others. Elsewhere each write orphans and maps a one-slot buffer.
+    //
+    struct GLStagingRing {
+        GLStagingRing() = default;
+        GLStagingRing(const GLStagingRing&) = delete;
+        void operator=(const GLStagingRing&) = delete;
+        ~GLStagingRing();
+        
+        // needs a current GL context; allowPersistent = false forces the
+        // orphaning path
+        void create(std::size_t slotSize, std::size_t slotCount, bool allowPersistent = true);
+        
+        // Copies `size` (at most slotSize) bytes into the next slot and
+        // leaves the ring bound to GL_PIXEL_UNPACK_BUFFER. Returns the
+        // pointer argument that reads them back out, for glTexSubImage etc.
+        GLvoid const *write(void const *data, std::size_t size);
+        // Like write(), but lets fill() write the `size` bytes in place.
+        GLvoid const *write(std::size_t size, std::function<void (std::uint8_t*)> const &fill);
+        
+        bool isPersistent() const { return persistent; }
+        explicit operator bool() const { return bool(buffer); }
+        
+    private:
+        GLBuffer buffer;
+        std::size_t slotSize = 0, slotCount = 0, nextSlot = 0;
+        bool persistent = false, wroteSlot = false;
+        std::uint8_t *mapped = nullptr;
+        std::vector<GLsync> fences;
+    };
 }
 
 #endif
@@ -0,0 +1,72 @@
+//
+//  Histogram.hpp
+//  Megacanvas
+//
+//  Created by Joe Groff on 8/24/12.
+//  Copyright (c) 2012 Durian Software. All rights reserved.
+//
+
+#ifndef Megacanvas_Histogram_hpp
+#define Megacanvas_Histogram_hpp
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+//
+// A histogram of durations, cheap enough to record into on every frame. Bucket
+// i counts durations of at least 2^(i-1) and under 2^i nanoseconds (bucket 0
+// counts zeros), and the last bucket counts everything longer, so quantiles
+// come out as upper bounds within a factor of two.
+//
+
+namespace Mega {
+    struct Histogram {
+        static constexpr std::size_t BUCKETS = 40;
+        
+        std::uint64_t buckets[BUCKETS] = {};
+        std::uint64_t count = 0;
+        std::chrono::nanoseconds total{0}, max{0};
+        
+        static std::size_t bucket(std::chrono::nanoseconds d)
+        {
+            if (d.count() <= 0)
+                return 0;
+            std::uint64_t ns = std::uint64_t(d.count());
+            return std::min(BUCKETS - 1, std::size_t(64 - __builtin_clzll(ns)));
+        }
+        
+        void record(std::chrono::nanoseconds d)
+        {
+            ++buckets[bucket(d)];
+            ++count;
+            total += d;
+            max = std::max(max, d);
+        }
+        
+        std::chrono::nanoseconds mean() const
+        {
+            return count == 0 ? std::chrono::nanoseconds(0) : total/std::int64_t(count);
+        }
+        
+        // The upper bound of the bucket holding the q quantile, 0 <= q <= 1,
+        // or max if that's smaller.
+        std::chrono::nanoseconds quantile(double q) const
+        {
+            if (count == 0)
+                return std::chrono::nanoseconds(0);
+            std::uint64_t rank = std::uint64_t(q*double(count - 1)) + 1, seen = 0;
+            for (std::size_t i = 0; i < BUCKETS - 1; ++i) {
+                seen += buckets[i];
+                if (seen >= rank)
+                    return std::min(max, std::chrono::nanoseconds(i == 0 ? 0 : (std::int64_t(1) << i) - 1));
+            }
+            return max;
+        }
+        
+        void reset() { *this = Histogram(); }
+    };
+}
+
+#endif
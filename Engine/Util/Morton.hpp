@@ -0,0 +1,118 @@
+//
+//  Morton.hpp
+//  Megacanvas
+//
+//  Created by Joe Groff on 8/12/12.
+//  Copyright (c) 2012 Durian Software. All rights reserved.
+//
+
+#ifndef Megacanvas_Morton_hpp
+#define Megacanvas_Morton_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <emmintrin.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+//
+// Morton (Z-order) indices interleave the bits of an x,y pair, x in the even
+// bits and y in the odd bits, so that every aligned power-of-two square is a
+// contiguous run of indices. Tile trees are indexed this way. Coordinates
+// can be up to 32 bits. With BMI2 encoding and decoding are a pdep or pext
+// each; otherwise they go a byte at a time through lookup tables.
+//
+
+namespace Mega {
+    namespace MortonDetail {
+        // spread[b] is b with a zero bit after each of its bits; gather[b]
+        // is b's even bits in the low nibble and its odd bits in the high
+        // nibble
+        struct Tables {
+            std::uint16_t spread[256];
+            std::uint8_t gather[256];
+
+            Tables()
+            {
+                for (unsigned b = 0; b < 256; ++b) {
+                    spread[b] = 0;
+                    gather[b] = 0;
+                    for (unsigned bit = 0; bit < 8; ++bit) {
+                        spread[b] |= ((b >> bit) & 1) << (bit << 1);
+                        gather[b] |= ((b >> bit) & 1) << ((bit >> 1) + ((bit & 1) << 2));
+                    }
+                }
+            }
+        };
+
+        inline Tables const &tables()
+        {
+            static Tables const t;
+            return t;
+        }
+
+        inline std::uint64_t spread(std::uint32_t x)
+        {
+#ifdef __BMI2__
+            return _pdep_u64(x, 0x5555555555555555ULL);
+#else
+            auto &t = tables();
+            return std::uint64_t(t.spread[x & 0xFF])
+                | std::uint64_t(t.spread[(x >> 8) & 0xFF]) << 16
+                | std::uint64_t(t.spread[(x >> 16) & 0xFF]) << 32
+                | std::uint64_t(t.spread[x >> 24]) << 48;
+#endif
+        }
+    }
+
+    inline std::uint64_t mortonEncode(std::uint32_t x, std::uint32_t y)
+    {
+        return MortonDetail::spread(x) | MortonDetail::spread(y) << 1;
+    }
+
+    inline void mortonDecode(std::uint64_t i, std::uint32_t *outX, std::uint32_t *outY)
+    {
+#ifdef __BMI2__
+        *outX = std::uint32_t(_pext_u64(i, 0x5555555555555555ULL));
+        *outY = std::uint32_t(_pext_u64(i, 0xAAAAAAAAAAAAAAAAULL));
+#else
+        auto &t = MortonDetail::tables();
+        std::uint32_t x = 0, y = 0;
+        for (unsigned byte = 0; byte < 8; ++byte) {
+            std::uint8_t g = t.gather[(i >> (byte << 3)) & 0xFF];
+            x |= std::uint32_t(g & 0xF) << (byte << 2);
+            y |= std::uint32_t(g >> 4) << (byte << 2);
+        }
+        *outX = x;
+        *outY = y;
+#endif
+    }
+
+    // Writes the indices of x..x+count-1 in row y to out, two at a time with
+    // SSE2.
+    inline void mortonEncodeRow(std::uint32_t x, std::uint32_t y, std::size_t count,
+                                std::uint64_t *out)
+    {
+        std::uint64_t yBits = MortonDetail::spread(y) << 1;
+        __m128i ys = _mm_set1_epi64x(std::int64_t(yBits));
+        __m128i xs = _mm_set_epi64x(std::int64_t(x) + 1, std::int64_t(x));
+        __m128i two = _mm_set1_epi64x(2);
+        __m128i low32 = _mm_set1_epi64x(0xFFFFFFFF);
+        std::size_t i = 0;
+        for (; i + 2 <= count; i += 2) {
+            __m128i v = _mm_and_si128(xs, low32);
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 16)), _mm_set1_epi64x(0x0000FFFF0000FFFFLL));
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 8)), _mm_set1_epi64x(0x00FF00FF00FF00FFLL));
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 4)), _mm_set1_epi64x(0x0F0F0F0F0F0F0F0FLL));
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 2)), _mm_set1_epi64x(0x3333333333333333LL));
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi64(v, 1)), _mm_set1_epi64x(0x5555555555555555LL));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_or_si128(v, ys));
+            xs = _mm_add_epi64(xs, two);
+        }
+        if (i < count)
+            out[i] = MortonDetail::spread(std::uint32_t(x + i)) | yBits;
+    }
+}
+
+#endif
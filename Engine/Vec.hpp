@@ -83,6 +83,42 @@ namespace Mega {
             };
         }
     };
+    
+    // Maps v to {xx*v.x + xy*v.y + tx, yx*v.x + yy*v.y + ty}.
+    struct Affine {
+        double xx, xy, yx, yy, tx, ty;
+        
+        static constexpr Affine identity() { return Affine{1.0, 0.0, 0.0, 1.0, 0.0, 0.0}; }
+        static constexpr Affine translate(Vec t) { return Affine{1.0, 0.0, 0.0, 1.0, t.x, t.y}; }
+        static constexpr Affine scale(Vec s) { return Affine{s.x, 0.0, 0.0, s.y, 0.0, 0.0}; }
+        static Affine rotate(double radians)
+        {
+            double c = std::cos(radians), s = std::sin(radians);
+            return Affine{c, -s, s, c, 0.0, 0.0};
+        }
+        
+        Vec operator()(Vec v) const { return Vec{xx*v.x + xy*v.y + tx, yx*v.x + yy*v.y + ty}; }
+        Vec linear(Vec v) const { return Vec{xx*v.x + xy*v.y, yx*v.x + yy*v.y}; }
+        
+        // (a*b)(v) == a(b(v))
+        Affine operator*(Affine o) const
+        {
+            return Affine{
+                xx*o.xx + xy*o.yx, xx*o.xy + xy*o.yy,
+                yx*o.xx + yy*o.yx, yx*o.xy + yy*o.yy,
+                xx*o.tx + xy*o.ty + tx, yx*o.tx + yy*o.ty + ty
+            };
+        }
+        
+        constexpr double determinant() const { return xx*yy - xy*yx; }
+        
+        Affine inverse() const
+        {
+            double invDet = 1.0/determinant();
+            double ixx = yy*invDet, ixy = -xy*invDet, iyx = -yx*invDet, iyy = xx*invDet;
+            return Affine{ixx, ixy, iyx, iyy, -(ixx*tx + ixy*ty), -(iyx*tx + iyy*ty)};
+        }
+    };
 }
 
 #endif
@@ -30,7 +30,9 @@ namespace Mega {
     x(center, GLint)\
     x(viewport, GLint)\
     x(tilesTextureSize, GLint)\
-    x(tilesTexture, GLint)
+    x(tileSize, GLint)\
+    x(tilesTexture, GLint)\
+    x(pageTable, GLint)
     
     MEGA_STRUCT(ViewUniforms)
     
@@ -118,7 +120,9 @@ namespace Mega {
         $$.bindState();
 
         glUniform1f($.uniforms.tilesTextureSize, $.tiles->textureSize());
+        glUniform1f($.uniforms.tileSize, $.canvas.tileSize());
         glUniform1i($.uniforms.tilesTexture, 0);
+        glUniform1i($.uniforms.pageTable, 1);
         MEGA_ASSERT_GL_NO_ERROR;
         
         $.updateMesh();
@@ -207,21 +211,26 @@ namespace Mega {
         $.updateViewport();
     }
     
-    void View::renderLayers(std::size_t begin, std::size_t end)
+    bool View::renderLayers(std::size_t begin, std::size_t end)
     {
         assert($.good);
         
-        $.tiles->require($.center, $.viewport/$.zoom);
+        $.canvas.publish();
+        bool complete = $.tiles->require($.center, $.viewport/$.zoom);
+        begin = std::min(std::max(begin, $.tiles->firstVisibleLayer()), end);
         
         glClear(GL_COLOR_BUFFER_BIT);
         glDrawElements(GL_TRIANGLES, 6*(end - begin), GL_UNSIGNED_SHORT,
-                       reinterpret_cast<GLvoid const *>(begin * sizeof(GLushort)));
+                       reinterpret_cast<GLvoid const *>(6 * begin * sizeof(GLushort)));
         MEGA_ASSERT_GL_NO_ERROR;
+        
+        $.tiles->prefetch();
+        return complete;
     }
     
-    void View::render()
+    bool View::render()
     {
-        $$.renderLayers(0, $.canvas.layers().size());
+        return $$.renderLayers(0, $.canvas.layers().size());
     }
     
     MEGA_PRIV_GETTER(View, center, Vec)
@@ -25,8 +25,10 @@ namespace Mega {
         void bindState();
         void resize(double width, double height);
 
-        void render();
-        void renderLayers(std::size_t begin, std::size_t end);
+        // Return false if tiles in view were still loading, in which case
+        // render again soon.
+        bool render();
+        bool renderLayers(std::size_t begin, std::size_t end);
 
         Vec center();
         void center(Vec c);
@@ -29,18 +29,36 @@ namespace Mega { namespace test {
         CPPUNIT_TEST(testLayerGetSegment);
         CPPUNIT_TEST(testLayerGetSegmentEmptyLayer);
         CPPUNIT_TEST(testLayerGetTile);
+        CPPUNIT_TEST(testLayerForEachTileInRect);
+        CPPUNIT_TEST(testLayerCoverage);
         CPPUNIT_TEST(testVerifyTiles);
         CPPUNIT_TEST(testLoadTile);
         CPPUNIT_TEST(testLoadTileIntoAsync);
         CPPUNIT_TEST(testBlitIntoEmptySmall);
         CPPUNIT_TEST(testBlitIntoEmptyLarge);
         CPPUNIT_TEST(testBlitBlending);
+        CPPUNIT_TEST(testBlitOverGradient);
         CPPUNIT_TEST(testBlitGrowsLayer);
+        CPPUNIT_TEST(testBlitAsync);
+        CPPUNIT_TEST(testDirtyTiles);
+        CPPUNIT_TEST(testFillRect);
+        CPPUNIT_TEST(testClearRect);
+        CPPUNIT_TEST(testBlitTransformedNearest);
+        CPPUNIT_TEST(testBlitTransformedSmooth);
+        CPPUNIT_TEST(testCopyRegionAligned);
+        CPPUNIT_TEST(testCopyRegionUnaligned);
+        CPPUNIT_TEST(testStroke);
+        CPPUNIT_TEST(testStrokeSpacing);
         CPPUNIT_TEST(testInsertDeleteLayer);
         CPPUNIT_TEST(testUndoRedoBlit);
         CPPUNIT_TEST(testUndoRedoInsertDeleteLayer);
         CPPUNIT_TEST(testMoveLayer);
         CPPUNIT_TEST(testUndoMoveLayer);
+        CPPUNIT_TEST(testMergeLayers);
+        CPPUNIT_TEST(testHistoryBudget);
+        CPPUNIT_TEST(testHistoryDeltas);
+        CPPUNIT_TEST(testUndoGroup);
+        CPPUNIT_TEST(testUndoCoalesce);
         CPPUNIT_TEST(testSetLayerParallax);
         CPPUNIT_TEST(testUndoSetLayerParallax);
         CPPUNIT_TEST_SUITE_END();
@@ -298,6 +316,77 @@ namespace Mega { namespace test {
             _MEGA_CPPUNIT_ASSERT_SEGMENT_EMPTY(layer0.segment(4,  0,  0));
         }
         
+        void testLayerForEachTileInRect()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            ptrdiff_t tileSize = ptrdiff_t(canvas->tileSize());
+            Canvas::pixel_t color{{1,2,3,255}};
+            canvas->fillRect("a", 0, -3*tileSize, -tileSize, 2*tileSize, 1, color);
+            canvas->fillRect("b", 0, 5*tileSize, 6*tileSize, 1, 1, color);
+            Layer layer0 = canvas->layers()[0];
+            // layer tile coordinates count from the layer's origin
+            ptrdiff_t ox = ptrdiff_t(layer0.origin().x)/tileSize, oy = ptrdiff_t(layer0.origin().y)/tileSize;
+            
+            // the same tiles, in some order, as asking for each one
+            std::vector<std::tuple<ptrdiff_t, ptrdiff_t, Layer::tile_t>> visited, expected;
+            layer0.forEachTileInRect(Rect{double(-3 - ox), double(-2 - oy), double(6 - ox), double(7 - oy)},
+                                     [&](ptrdiff_t x, ptrdiff_t y, Layer::tile_t tile) {
+                visited.emplace_back(x, y, tile);
+            });
+            for (ptrdiff_t y = -2 - oy; y < 7 - oy; ++y)
+                for (ptrdiff_t x = -3 - ox; x < 6 - ox; ++x)
+                    if (Layer::tile_t tile = layer0.tile(x, y))
+                        expected.emplace_back(x, y, tile);
+            std::sort(visited.begin(), visited.end());
+            std::sort(expected.begin(), expected.end());
+            CPPUNIT_ASSERT_EQUAL(std::size_t(3), expected.size());
+            CPPUNIT_ASSERT(visited == expected);
+            
+            // outside the layer is fine, and empty
+            visited.clear();
+            layer0.forEachTileInRect(Rect{1000.0, 1000.0, 2000.0, 2000.0},
+                                     [&](ptrdiff_t x, ptrdiff_t y, Layer::tile_t tile) {
+                visited.emplace_back(x, y, tile);
+            });
+            CPPUNIT_ASSERT(visited.empty());
+        }
+        
+        void testLayerCoverage()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            ptrdiff_t tileSize = ptrdiff_t(canvas->tileSize());
+            canvas->fillRect("opaque", 0, 0, 0, 4*tileSize, 4*tileSize, Canvas::pixel_t{{1,2,3,255}});
+            canvas->fillRect("translucent", 0, 4*tileSize, 0, 2*tileSize, 2*tileSize, Canvas::pixel_t{{1,2,3,128}});
+            Layer layer0 = canvas->layers()[0];
+            double ox = double(ptrdiff_t(layer0.origin().x)/tileSize);
+            double oy = double(ptrdiff_t(layer0.origin().y)/tileSize);
+            auto coverage = [&](double x0, double y0, double x1, double y1) {
+                return layer0.coverage(Rect{x0 - ox, y0 - oy, x1 - ox, y1 - oy});
+            };
+            
+            CPPUNIT_ASSERT(coverage(0, 0, 4, 4) == Layer::Coverage::Opaque);
+            CPPUNIT_ASSERT(coverage(1, 1, 3, 2) == Layer::Coverage::Opaque);
+            CPPUNIT_ASSERT(coverage(4, 0, 6, 2) == Layer::Coverage::Partial);
+            CPPUNIT_ASSERT(coverage(0, 0, 5, 4) == Layer::Coverage::Partial);
+            CPPUNIT_ASSERT(coverage(0, 4, 4, 5) == Layer::Coverage::Empty);
+            CPPUNIT_ASSERT(layer0.coverage(Rect{1000.0, 1000.0, 2000.0, 2000.0}) == Layer::Coverage::Empty);
+            
+            // covering a hole makes the region opaque; undoing it doesn't
+            canvas->fillRect("cover", 0, 4*tileSize, 0, 2*tileSize, 2*tileSize, Canvas::pixel_t{{4,5,6,255}});
+            CPPUNIT_ASSERT(coverage(0, 0, 6, 2) == Layer::Coverage::Opaque);
+            canvas->undo();
+            CPPUNIT_ASSERT(coverage(0, 0, 6, 2) == Layer::Coverage::Partial);
+            canvas->redo();
+            CPPUNIT_ASSERT(coverage(0, 0, 6, 2) == Layer::Coverage::Opaque);
+            
+            canvas->clearRect("clear", 0, 0, 0, 6*tileSize, 4*tileSize);
+            CPPUNIT_ASSERT(coverage(0, 0, 6, 4) == Layer::Coverage::Empty);
+        }
+        
 #undef _MEGA_CPPUNIT_ASSERT_SEGMENT
 #undef _MEGA_CPPUNIT_ASSERT_SEGMENT_EMPTY
         
@@ -535,6 +624,33 @@ namespace Mega { namespace test {
             CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{6,8,10,12}}), pixels[66][66]);
         }
         
+        void testBlitOverGradient()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            
+            // a tile that reads differently across than down
+            unique_ptr<array<uint8_t,4>[]> gradient(new array<uint8_t,4>[128*128]);
+            for (size_t y = 0; y < 128; ++y)
+                for (size_t x = 0; x < 128; ++x)
+                    gradient[y*128 + x] = array<uint8_t,4>{{uint8_t(x), uint8_t(y), 0, 255}};
+            canvas->blit("gradient", gradient.get(), 128, 128, 128, 0, 0, 0,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d){ return s; });
+                         
+            // blending that keeps the destination, both under the source and
+            // around it, leaves the tile as it was
+            unique_ptr<array<uint8_t,4>[]> stuffToBlit(new array<uint8_t,4>[32*32]);
+            fill(&stuffToBlit[0], &stuffToBlit[32*32], array<uint8_t,4>{{9,9,9,9}});
+            canvas->blit("keep", stuffToBlit.get(), 32, 32, 32, 0, 16, 48,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d){ return d; });
+            for (ptrdiff_t y = 0; y < 128; y += 7)
+                for (ptrdiff_t x = 0; x < 128; x += 5)
+                    CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{uint8_t(x), uint8_t(y), 0, 255}}),
+                                         pixelAt(canvas.get(), layer0, x, y));
+        }
+        
         void testUndoRedoBlit()
         {
             string error;
@@ -796,6 +912,521 @@ namespace Mega { namespace test {
             CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[0][0]);
         }
         
+        void testBlitAsync()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT_EQUAL(string(""), error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            
+            unique_ptr<array<uint8_t,4>[]> stuffToBlit1(new array<uint8_t,4>[256*256]);
+            fill(&stuffToBlit1[0], &stuffToBlit1[256*256], array<uint8_t,4>{{1,2,3,4}});
+            unique_ptr<array<uint8_t,4>[]> stuffToBlit2(new array<uint8_t,4>[128*128]);
+            fill(&stuffToBlit2[0], &stuffToBlit2[128*128], array<uint8_t,4>{{5,6,7,8}});
+            
+            vector<uint8_t> tileData;
+            tileData.resize(canvas->tileByteSize());
+            Array2DRef<Canvas::pixel_t> pixels{
+                reinterpret_cast<Canvas::pixel_t const*>(tileData.data()),
+                canvas->tileSize(), canvas->tileSize()
+            };
+            
+            shared_future<Canvas::BlitResult> done1 = canvas->blitAsync("test1", stuffToBlit1.get(),
+                                                                        256, 256, 256,
+                                                                        0, 0, 0,
+                                                                        [](Canvas::pixel_t s, Canvas::pixel_t d){ return s; });
+            // the second blit builds on the first, even though it hasn't
+            // been published yet
+            shared_future<Canvas::BlitResult> done2 = canvas->blitAsync("test2", stuffToBlit2.get(),
+                                                                        128, 128, 128,
+                                                                        0, 1, 1,
+                                                                        [](Canvas::pixel_t s, Canvas::pixel_t d) {
+                                                                            return Canvas::pixel_t{{
+                                                                                uint8_t(s[0]+d[0]),
+                                                                                uint8_t(s[1]+d[1]),
+                                                                                uint8_t(s[2]+d[2]),
+                                                                                uint8_t(s[3]+d[3])
+                                                                            }};
+                                                                        });
+            CPPUNIT_ASSERT(done1.get());
+            CPPUNIT_ASSERT(done2.get());
+            CPPUNIT_ASSERT(done2.get().error.empty());
+            // finished blits don't show up until they're published
+            CPPUNIT_ASSERT_EQUAL(layer0.tile(-1, -1), Layer::tile_t(0));
+            CPPUNIT_ASSERT(canvas->undoName().empty());
+            canvas->publish();
+            
+            CPPUNIT_ASSERT_EQUAL(size_t(1), canvas->layers().size());
+            CPPUNIT_ASSERT_EQUAL(string("test2"), canvas->undoName().str());
+            bool ok = canvas->loadTileInto(layer0.tile(-1, -1), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{1,2,3,4}}), pixels[0][0]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{6,8,10,12}}), pixels[1][1]);
+            
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(string("test1"), canvas->undoName().str());
+            ok = canvas->loadTileInto(layer0.tile(-1, -1), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{1,2,3,4}}), pixels[1][1]);
+            
+            // a synchronous blit waits for pending async ones
+            canvas->redo();
+            done1 = canvas->blitAsync("test3", stuffToBlit2.get(),
+                                      128, 128, 128,
+                                      0, 0, 0,
+                                      [](Canvas::pixel_t s, Canvas::pixel_t d){ return s; });
+            canvas->blit("test4", stuffToBlit1.get(),
+                         256, 256, 256,
+                         0, 0, 0,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d){ return d; });
+            CPPUNIT_ASSERT(done1.get());
+            CPPUNIT_ASSERT_EQUAL(string("test4"), canvas->undoName().str());
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(string("test3"), canvas->undoName().str());
+            ok = canvas->loadTileInto(layer0.tile(-1, -1), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{5,6,7,8}}), pixels[0][0]);
+            CPPUNIT_ASSERT(canvas->verifyTiles(&error));
+        }
+        
+        void testDirtyTiles()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            SmallVector<pair<ptrdiff_t, ptrdiff_t>, 16> dirty;
+            
+            unique_ptr<array<uint8_t,4>[]> stuffToBlit(new array<uint8_t,4>[256*256]);
+            fill(&stuffToBlit[0], &stuffToBlit[256*256], array<uint8_t,4>{{1,2,3,4}});
+            
+            size_t epoch0 = layer0.epoch();
+            canvas->blit("test1", stuffToBlit.get(),
+                         256, 256, 256,
+                         0, -128, -128,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d){ return s; });
+            size_t epoch1 = layer0.epoch();
+            CPPUNIT_ASSERT(epoch1 > epoch0);
+            // the layer was initialized, so everything is dirty
+            CPPUNIT_ASSERT(!layer0.dirtyTilesSince(epoch0, &dirty));
+            CPPUNIT_ASSERT(layer0.dirtyTilesSince(epoch1, &dirty));
+            CPPUNIT_ASSERT(dirty.empty());
+            
+            canvas->blit("test2", stuffToBlit.get(),
+                         256, 16, 16,
+                         0, 8, -8,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d){ return s; });
+            size_t epoch2 = layer0.epoch();
+            CPPUNIT_ASSERT(epoch2 > epoch1);
+            CPPUNIT_ASSERT(layer0.dirtyTilesSince(epoch1, &dirty));
+            std::sort(dirty.begin(), dirty.end());
+            CPPUNIT_ASSERT_EQUAL(size_t(2), dirty.size());
+            CPPUNIT_ASSERT(dirty[0] == make_pair(ptrdiff_t(0), ptrdiff_t(-1)));
+            CPPUNIT_ASSERT(dirty[1] == make_pair(ptrdiff_t(0), ptrdiff_t(0)));
+            
+            // undo reports exactly the tiles it put back
+            canvas->undo();
+            size_t epoch3 = layer0.epoch();
+            CPPUNIT_ASSERT(epoch3 > epoch2);
+            dirty.clear();
+            CPPUNIT_ASSERT(layer0.dirtyTilesSince(epoch2, &dirty));
+            CPPUNIT_ASSERT_EQUAL(size_t(2), dirty.size());
+            // and, since it undid a delta, doesn't lose track of older changes
+            dirty.clear();
+            CPPUNIT_ASSERT(layer0.dirtyTilesSince(epoch1, &dirty));
+            CPPUNIT_ASSERT_EQUAL(size_t(4), dirty.size());
+            
+            // moving layers around invalidates them
+            canvas->insertLayer("insert", 0);
+            CPPUNIT_ASSERT(!canvas->layers()[1].dirtyTilesSince(epoch3, &dirty));
+        }
+        
+        void testFillRect()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            
+            vector<uint8_t> tileData;
+            tileData.resize(canvas->tileByteSize());
+            Array2DRef<Canvas::pixel_t> pixels{
+                reinterpret_cast<Canvas::pixel_t const*>(tileData.data()),
+                canvas->tileSize(), canvas->tileSize()
+            };
+            
+            canvas->fillRect("fill", 0, -10, -10, 300, 300, Canvas::pixel_t{{1,2,3,4}});
+            CPPUNIT_ASSERT_EQUAL((Vec{140, 140}), layer0.origin());
+            CPPUNIT_ASSERT_EQUAL(string("fill"), canvas->undoName().str());
+            
+            // the four covered tiles share one solid tile
+            Layer::tile_t solid = layer0.tile(-1, -1);
+            CPPUNIT_ASSERT(solid != 0);
+            CPPUNIT_ASSERT_EQUAL(solid, layer0.tile(0, -1));
+            CPPUNIT_ASSERT_EQUAL(solid, layer0.tile(-1, 0));
+            CPPUNIT_ASSERT_EQUAL(solid, layer0.tile(0, 0));
+            bool ok = canvas->loadTileInto(solid, tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{1,2,3,4}}), pixels[0][0]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{1,2,3,4}}), pixels[127][127]);
+            
+            // edges are partially covered
+            ok = canvas->loadTileInto(layer0.tile(-2, -2), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[105][105]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[106][105]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{1,2,3,4}}), pixels[106][106]);
+            ok = canvas->loadTileInto(layer0.tile(1, -1), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{1,2,3,4}}), pixels[0][21]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[0][22]);
+            // the edge tiles along each side are alike, so one solid tile
+            // and eight edge tiles cover the rectangle
+            CPPUNIT_ASSERT_EQUAL(layer0.tile(1, -1), layer0.tile(1, 0));
+            CPPUNIT_ASSERT_EQUAL(size_t(9), canvas->tileCount());
+            
+            // filling with the same color again reuses the solid tile
+            canvas->fillRect("fill2", 0, 12, 12, 128, 128, Canvas::pixel_t{{1,2,3,4}});
+            CPPUNIT_ASSERT_EQUAL(size_t(9), canvas->tileCount());
+            
+            // a huge fill costs next to nothing
+            canvas->fillRect("fill3", 0, -50000, -50000, 100000, 100000, Canvas::pixel_t{{5,6,7,8}});
+            CPPUNIT_ASSERT_EQUAL(size_t(18), canvas->tileCount());
+            ok = canvas->loadTileInto(layer0.tile(0, 0), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{5,6,7,8}}), pixels[64][64]);
+            
+            canvas->undo();
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(solid, layer0.tile(0, 0));
+        }
+        
+        void testClearRect()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            
+            vector<uint8_t> tileData;
+            tileData.resize(canvas->tileByteSize());
+            Array2DRef<Canvas::pixel_t> pixels{
+                reinterpret_cast<Canvas::pixel_t const*>(tileData.data()),
+                canvas->tileSize(), canvas->tileSize()
+            };
+            
+            // clearing an empty layer does nothing, not even leave an undo step
+            canvas->clearRect("clear", 0, 0, 0, 100, 100);
+            CPPUNIT_ASSERT_EQUAL(size_t(0), canvas->tileCount());
+            CPPUNIT_ASSERT(canvas->undoName().empty());
+            
+            canvas->fillRect("fill", 0, 0, 0, 256, 256, Canvas::pixel_t{{1,2,3,4}});
+            CPPUNIT_ASSERT_EQUAL(size_t(1), canvas->tileCount());
+            
+            // nor do empty rectangles or ones outside the layer, which
+            // leave redo alone
+            canvas->undo();
+            canvas->fillRect("empty", 0, 0, 0, 0, 100, Canvas::pixel_t{{1,2,3,4}});
+            canvas->clearRect("empty", 0, 0, 0, 100, 0);
+            canvas->clearRect("empty", 0, 100000, 100000, 100, 100);
+            CPPUNIT_ASSERT_EQUAL(string("fill"), canvas->redoName().str());
+            canvas->redo();
+            CPPUNIT_ASSERT_EQUAL(string("fill"), canvas->undoName().str());
+            
+            // covered tiles become empty, partially covered ones are cut,
+            // and the rectangle is clipped to the layer
+            canvas->clearRect("clear", 0, -1000, -1000, 1128, 1138);
+            CPPUNIT_ASSERT_EQUAL(Layer::tile_t(0), layer0.tile(-1, -1));
+            CPPUNIT_ASSERT_EQUAL(Layer::tile_t(1), layer0.tile(0, -1));
+            CPPUNIT_ASSERT_EQUAL(Layer::tile_t(1), layer0.tile(0, 0));
+            CPPUNIT_ASSERT_EQUAL(size_t(2), canvas->tileCount());
+            bool ok = canvas->loadTileInto(layer0.tile(-1, 0), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[9][0]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[9][127]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{1,2,3,4}}), pixels[10][0]);
+            
+            // a transparent fill is a clear
+            canvas->fillRect("fill0", 0, 128, 128, 128, 128, Canvas::pixel_t{{9,9,9,0}});
+            CPPUNIT_ASSERT_EQUAL(Layer::tile_t(0), layer0.tile(0, 0));
+            
+            // but an edit that does something clears redo
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(string("fill0"), canvas->redoName().str());
+            canvas->clearRect("clear", 0, 0, 0, 10, 10);
+            CPPUNIT_ASSERT(canvas->redoName().empty());
+        }
+        
+        static Canvas::pixel_t pixelAt(Canvas canvas, Layer layer, ptrdiff_t x, ptrdiff_t y)
+        {
+            Vec origin = layer.origin();
+            ptrdiff_t lx = x - ptrdiff_t(origin.x), ly = y - ptrdiff_t(origin.y);
+            Layer::tile_t tile = layer.tile(lx >> 7, ly >> 7);
+            if (tile == 0)
+                return Canvas::pixel_t{{0,0,0,0}};
+            string error;
+            vector<uint8_t> tileData(canvas.tileByteSize());
+            bool ok = canvas.loadTileInto(tile, tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            return reinterpret_cast<Canvas::pixel_t const*>(tileData.data())[(ly & 127)*128 + (lx & 127)];
+        }
+        
+        void testBlitTransformedNearest()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            auto replace = [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; };
+            
+            Canvas::pixel_t source[4*4];
+            for (uint8_t i = 0; i < 16; ++i)
+                source[i] = Canvas::pixel_t{{i, uint8_t(i*2), uint8_t(i*3), 255}};
+            
+            // the identity transform is a plain blit
+            canvas->blitTransformed("identity", source, 4, 4, 4, 0,
+                                    Affine::translate(Vec{-2, 3}), Canvas::Filter::Nearest, replace);
+            CPPUNIT_ASSERT_EQUAL(string("identity"), canvas->undoName().str());
+            for (ptrdiff_t y = 0; y < 4; ++y)
+                for (ptrdiff_t x = 0; x < 4; ++x)
+                    CPPUNIT_ASSERT_EQUAL(source[y*4 + x], pixelAt(canvas.get(), layer0, x - 2, y + 3));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer0, 2, 3));
+            
+            // scaling up by two replicates each pixel
+            canvas->blitTransformed("scale", source, 4, 4, 4, 0,
+                                    Affine::translate(Vec{100, 200})*Affine::scale(Vec{2, 2}),
+                                    Canvas::Filter::Nearest, replace);
+            for (ptrdiff_t y = 0; y < 8; ++y)
+                for (ptrdiff_t x = 0; x < 8; ++x)
+                    CPPUNIT_ASSERT_EQUAL(source[(y/2)*4 + x/2], pixelAt(canvas.get(), layer0, x + 100, y + 200));
+            
+            // a quarter turn maps source (x, y) to canvas (9 - y, x) here
+            canvas->blitTransformed("rotate", source, 4, 4, 4, 0,
+                                    Affine::translate(Vec{10, -300})*Affine::rotate(M_PI/2),
+                                    Canvas::Filter::Nearest, replace);
+            for (ptrdiff_t y = 0; y < 4; ++y)
+                for (ptrdiff_t x = 0; x < 4; ++x)
+                    CPPUNIT_ASSERT_EQUAL(source[y*4 + x], pixelAt(canvas.get(), layer0, 9 - y, x - 300));
+            
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer0, 9, -300));
+            CPPUNIT_ASSERT_EQUAL(source[0], pixelAt(canvas.get(), layer0, 100, 200));
+        }
+        
+        void testBlitTransformedSmooth()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            auto replace = [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; };
+            
+            vector<Canvas::pixel_t> source(40*40, Canvas::pixel_t{{10,20,30,255}});
+            
+            // a constant image stays constant away from its edges under any filter
+            canvas->blitTransformed("bilinear", source.data(), 40, 40, 40, 0,
+                                    Affine::scale(Vec{1.5, 1.5})*Affine::rotate(0.3),
+                                    Canvas::Filter::Bilinear, replace);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{10,20,30,255}}), pixelAt(canvas.get(), layer0, 20, 40));
+            canvas->blitTransformed("lanczos", source.data(), 40, 40, 40, 0,
+                                    Affine::translate(Vec{300, 0})*Affine::scale(Vec{0.3, 2.5}),
+                                    Canvas::Filter::Lanczos, replace);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{10,20,30,255}}), pixelAt(canvas.get(), layer0, 306, 50));
+            
+            // edges fade out instead of smearing
+            Canvas::pixel_t edge = pixelAt(canvas.get(), layer0, 300, 50);
+            CPPUNIT_ASSERT(edge[3] > 0 && edge[3] < 255);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{10,20,30,edge[3]}}), edge);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer0, 296, 50));
+            
+            // bilinear weights neighbors by distance
+            Canvas::pixel_t pair[2] = {{{0,0,0,255}}, {{200,100,40,255}}};
+            canvas->blitTransformed("pair", pair, 2, 2, 1, 0,
+                                    Affine::translate(Vec{-500, 0})*Affine::scale(Vec{2, 1}),
+                                    Canvas::Filter::Bilinear, replace);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{50,25,10,255}}), pixelAt(canvas.get(), layer0, -499, 0));
+            
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer0, -499, 0));
+        }
+        
+        static Canvas::pixel_t gradient(ptrdiff_t x, ptrdiff_t y)
+        {
+            return Canvas::pixel_t{{uint8_t(x), uint8_t(y), 7, 255}};
+        }
+        
+        void blitGradient(Canvas canvas, size_t layer)
+        {
+            vector<Canvas::pixel_t> source(256*256);
+            for (ptrdiff_t y = 0; y < 256; ++y)
+                for (ptrdiff_t x = 0; x < 256; ++x)
+                    source[y*256 + x] = gradient(x, y);
+            canvas.blit("gradient", source.data(), 256, 256, 256, layer, 0, 0,
+                        [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+        }
+        
+        void testCopyRegionAligned()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            blitGradient(canvas.get(), 0);
+            canvas->insertLayer("insert", 1);
+            Layer layer0 = canvas->layers()[0], layer1 = canvas->layers()[1];
+            CPPUNIT_ASSERT_EQUAL((Vec{128, 128}), layer0.origin());
+            CPPUNIT_ASSERT_EQUAL(size_t(4), canvas->tileCount());
+            
+            // whole tiles are shared without writing anything
+            canvas->copyRegion("copy", 0, 0, 0, 256, 256, 1, 1024, 0);
+            CPPUNIT_ASSERT_EQUAL(string("copy"), canvas->undoName().str());
+            CPPUNIT_ASSERT_EQUAL((Vec{1152, 128}), layer1.origin());
+            CPPUNIT_ASSERT_EQUAL(size_t(4), canvas->tileCount());
+            for (ptrdiff_t y = -1; y < 1; ++y)
+                for (ptrdiff_t x = -1; x < 1; ++x)
+                    CPPUNIT_ASSERT_EQUAL(layer0.tile(x, y), layer1.tile(x, y));
+            
+            // only the partly covered tiles along the edges are written
+            canvas->copyRegion("copy2", 0, 0, 0, 200, 200, 1, 1024, 256);
+            CPPUNIT_ASSERT_EQUAL((Vec{1280, 256}), layer1.origin());
+            CPPUNIT_ASSERT_EQUAL(layer0.tile(-1, -1), layer1.tile(-2, 0));
+            CPPUNIT_ASSERT_EQUAL(size_t(7), canvas->tileCount());
+            CPPUNIT_ASSERT_EQUAL(gradient(150, 150), pixelAt(canvas.get(), layer1, 1174, 406));
+            CPPUNIT_ASSERT_EQUAL(gradient(199, 10), pixelAt(canvas.get(), layer1, 1223, 266));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer1, 1224, 266));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer1, 1030, 456));
+            
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL((Vec{1152, 128}), layer1.origin());
+            CPPUNIT_ASSERT_EQUAL(layer0.tile(0, 0), layer1.tile(0, 0));
+        }
+        
+        void testCopyRegionUnaligned()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            blitGradient(canvas.get(), 0);
+            canvas->insertLayer("insert", 1);
+            Layer layer0 = canvas->layers()[0], layer1 = canvas->layers()[1];
+            
+            canvas->copyRegion("copy", 0, 10, 100, 180, 50, 1, -333, 77);
+            for (ptrdiff_t y = 0; y < 50; y += 7)
+                for (ptrdiff_t x = 0; x < 180; x += 7)
+                    CPPUNIT_ASSERT_EQUAL(gradient(x + 10, y + 100), pixelAt(canvas.get(), layer1, x - 333, y + 77));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer1, -334, 77));
+            
+            // copying from a layer onto itself reads it as it was before
+            canvas->copyRegion("self", 0, 0, 0, 256, 256, 0, 64, 3);
+            for (ptrdiff_t y = 0; y < 256; y += 5)
+                for (ptrdiff_t x = 0; x < 256; x += 5)
+                    CPPUNIT_ASSERT_EQUAL(gradient(x, y), pixelAt(canvas.get(), layer0, x + 64, y + 3));
+            CPPUNIT_ASSERT_EQUAL(gradient(10, 2), pixelAt(canvas.get(), layer0, 10, 2));
+            
+            // empty space copies as transparent
+            canvas->copyRegion("clear", 0, 1000, 1000, 20, 20, 0, 100, 100);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer0, 110, 110));
+            CPPUNIT_ASSERT_EQUAL(gradient(120 - 64, 120 - 3), pixelAt(canvas.get(), layer0, 120, 120));
+            
+            canvas->undo();
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(gradient(100, 100), pixelAt(canvas.get(), layer0, 100, 100));
+            
+            // likewise when the copy's undo step is folded into a group
+            canvas->beginUndoGroup("group");
+            canvas->copyRegion("self", 0, 0, 0, 256, 256, 0, 64, 3);
+            canvas->copyRegion("self", 0, 0, 0, 256, 256, 0, 64, 3);
+            canvas->endUndoGroup();
+            for (ptrdiff_t y = 0; y < 256; y += 5)
+                for (ptrdiff_t x = 0; x < 256; x += 5)
+                    CPPUNIT_ASSERT_EQUAL(x < 64 || y < 3 ? gradient(x, y) : gradient(x - 64, y - 3),
+                                         pixelAt(canvas.get(), layer0, x + 64, y + 3));
+        }
+        
+        void testStroke()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT_EQUAL(string(""), error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            
+            vector<uint8_t> tileData;
+            tileData.resize(canvas->tileByteSize());
+            Array2DRef<Canvas::pixel_t> pixels{
+                reinterpret_cast<Canvas::pixel_t const*>(tileData.data()),
+                canvas->tileSize(), canvas->tileSize()
+            };
+            
+            Canvas::Brush brush{20.0, 1.0, 0.25, {{10,20,30,255}}};
+            Vec dab[] = {Vec{0.0, 0.0}};
+            canvas->stroke("stroke1", 0, dab, brush);
+            CPPUNIT_ASSERT_EQUAL((Vec{0.0, 0.0}), layer0.origin());
+            CPPUNIT_ASSERT_EQUAL(string("stroke1"), string(canvas->undoName()));
+            CPPUNIT_ASSERT_EQUAL(size_t(4), canvas->tileCount());
+            
+            bool ok = canvas->loadTileInto(layer0.tile(0, 0), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{10,20,30,255}}), pixels[0][0]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{10,20,30,255}}), pixels[5][5]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[0][15]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[10][10]);
+            ok = canvas->loadTileInto(layer0.tile(-1, -1), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{10,20,30,255}}), pixels[127][127]);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixels[0][0]);
+            
+            Canvas::Brush translucent{20.0, 1.0, 0.25, {{200,200,200,128}}};
+            canvas->stroke("stroke2", 0, dab, translucent);
+            ok = canvas->loadTileInto(layer0.tile(0, 0), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            Canvas::pixel_t blended = pixels[0][0];
+            CPPUNIT_ASSERT_EQUAL(uint8_t(255), blended[3]);
+            CPPUNIT_ASSERT(blended[0] > 100 && blended[0] < 110);
+            
+            canvas->undo();
+            ok = canvas->loadTileInto(layer0.tile(0, 0), tileData, &error);
+            CPPUNIT_ASSERT(ok);
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{10,20,30,255}}), pixels[0][0]);
+            CPPUNIT_ASSERT_EQUAL(string("stroke1"), string(canvas->undoName()));
+            
+            // the tiles inside a big opaque dab share one solid tile, and the
+            // tiles around its edge are blended only where it reaches
+            Canvas::Brush big{800.0, 1.0, 0.25, {{40,50,60,255}}};
+            Vec middle[] = {Vec{64.0, 64.0}};
+            canvas->stroke("stroke3", 0, middle, big);
+            auto tileAt = [&](ptrdiff_t x, ptrdiff_t y) {
+                Vec origin = layer0.origin();
+                return layer0.tile((x - ptrdiff_t(origin.x)) >> 7, (y - ptrdiff_t(origin.y)) >> 7);
+            };
+            CPPUNIT_ASSERT_EQUAL(tileAt(-86, 64), tileAt(214, 64));
+            CPPUNIT_ASSERT_EQUAL(tileAt(-86, 64), tileAt(64, 214));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{40,50,60,255}}), pixelAt(canvas.get(), layer0, 64, 64));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{40,50,60,255}}), pixelAt(canvas.get(), layer0, 454, 64));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer0, 469, 64));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,0,0}}), pixelAt(canvas.get(), layer0, 454, 164));
+            CPPUNIT_ASSERT(canvas->verifyTiles(&error));
+        }
+        
+        void testStrokeSpacing()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT_EQUAL(string(""), error);
+            CPPUNIT_ASSERT(canvas);
+            Layer layer0 = canvas->layers()[0];
+            
+            Canvas::Brush brush{10.0, 0.5, 0.25, {{1,2,3,255}}};
+            Vec path1[] = {Vec{0.0, 0.0}, Vec{100.0, 0.0}};
+            double offset = canvas->stroke("stroke1", 0, path1, brush);
+            CPPUNIT_ASSERT_EQUAL(2.5, offset);
+            
+            Vec path2[] = {Vec{100.0, 0.0}, Vec{101.0, 0.0}};
+            offset = canvas->stroke("stroke2", 0, path2, brush, offset);
+            CPPUNIT_ASSERT_EQUAL(1.5, offset);
+            CPPUNIT_ASSERT_EQUAL(string("stroke1"), string(canvas->undoName()));
+        }
+        
         void testInsertDeleteLayer()
         {
             string error;
@@ -1029,6 +1660,201 @@ namespace Mega { namespace test {
             CPPUNIT_ASSERT(canvas->redoName().empty());
         }
         
+        void testMergeLayers()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            canvas->insertLayer("insert1", 1);
+            canvas->insertLayer("insert2", 2);
+            canvas->insertLayer("insert3", 3);
+            canvas->fillRect("fill0", 0, 0, 0, 256, 256, Canvas::pixel_t{{0,0,255,255}});
+            canvas->fillRect("fill1", 1, 100, 100, 50, 50, Canvas::pixel_t{{255,0,0,128}});
+            blitGradient(canvas.get(), 2);
+            canvas->copyRegion("copy", 2, 0, 0, 256, 256, 2, 1024, 0);
+            canvas->clearRect("clear", 2, 0, 0, 256, 256);
+            canvas->fillRect("fill3", 3, 0, 0, 10, 10, Canvas::pixel_t{{0,255,0,255}});
+            auto tileAt = [](Layer layer, ptrdiff_t x, ptrdiff_t y) {
+                return layer.tile((x - ptrdiff_t(layer.origin().x)) >> 7, (y - ptrdiff_t(layer.origin().y)) >> 7);
+            };
+            Layer::tile_t gradientTile = tileAt(canvas->layers()[2], 1152, 128);
+            CPPUNIT_ASSERT(gradientTile != 0);
+            size_t tileCount = canvas->tileCount();
+            
+            canvas->mergeLayers("merge", 0, 3);
+            CPPUNIT_ASSERT_EQUAL(size_t(2), canvas->layers().size());
+            CPPUNIT_ASSERT_EQUAL(string("merge"), canvas->undoName().str());
+            Layer merged = canvas->layers()[0];
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,0,255,255}}), pixelAt(canvas.get(), merged, 99, 99));
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{128,0,127,255}}), pixelAt(canvas.get(), merged, 100, 100));
+            CPPUNIT_ASSERT_EQUAL(gradient(30, 40), pixelAt(canvas.get(), merged, 1054, 40));
+            // tiles drawn over empty space are shared, and only the four
+            // tiles under two layers' content are written
+            CPPUNIT_ASSERT_EQUAL(size_t(tileCount + 4), canvas->tileCount());
+            CPPUNIT_ASSERT_EQUAL(gradientTile, tileAt(merged, 1152, 128));
+            // layers above the range are untouched
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{0,255,0,255}}), pixelAt(canvas.get(), canvas->layers()[1], 5, 5));
+            
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(size_t(4), canvas->layers().size());
+            CPPUNIT_ASSERT_EQUAL(string("fill3"), canvas->undoName().str());
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{255,0,0,128}}), pixelAt(canvas.get(), canvas->layers()[1], 100, 100));
+            CPPUNIT_ASSERT_EQUAL(gradientTile, tileAt(canvas->layers()[2], 1152, 128));
+            
+            canvas->redo();
+            CPPUNIT_ASSERT_EQUAL(size_t(2), canvas->layers().size());
+            CPPUNIT_ASSERT_EQUAL((Canvas::pixel_t{{128,0,127,255}}), pixelAt(canvas.get(), canvas->layers()[0], 100, 100));
+        }
+        
+        void testHistoryBudget()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Canvas::pixel_t a{{1,2,3,255}}, b{{4,5,6,255}}, d{{7,8,9,255}}, clear{{0,0,0,0}};
+            canvas->fillRect("a", 0, 0, 0, 300, 300, a);
+            canvas->fillRect("b", 0, 100, 100, 50, 50, b);
+            canvas->insertLayer("c", 1);
+            canvas->fillRect("d", 1, 0, 0, 10, 10, d);
+            canvas->mergeLayers("e", 0, 2);
+            CPPUNIT_ASSERT(canvas->historyMemorySize() > 0);
+            
+            // everything that can be spilled is
+            canvas->historyMemoryBudget(0);
+            CPPUNIT_ASSERT_EQUAL(size_t(0), canvas->historyMemorySize());
+            CPPUNIT_ASSERT_EQUAL(string("e"), canvas->undoName().str());
+            
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(size_t(2), canvas->layers().size());
+            CPPUNIT_ASSERT_EQUAL(d, pixelAt(canvas.get(), canvas->layers()[1], 5, 5));
+            CPPUNIT_ASSERT_EQUAL(a, pixelAt(canvas.get(), canvas->layers()[0], 5, 5));
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(clear, pixelAt(canvas.get(), canvas->layers()[1], 5, 5));
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(size_t(1), canvas->layers().size());
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(a, pixelAt(canvas.get(), canvas->layers()[0], 120, 120));
+            CPPUNIT_ASSERT_EQUAL(size_t(0), canvas->historyMemorySize());
+            
+            for (int i = 0; i < 4; ++i)
+                canvas->redo();
+            CPPUNIT_ASSERT_EQUAL(size_t(1), canvas->layers().size());
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 120, 120));
+            CPPUNIT_ASSERT_EQUAL(d, pixelAt(canvas.get(), canvas->layers()[0], 5, 5));
+            
+            canvas->maxHistoryDepth(2);
+            canvas->undo();
+            canvas->undo();
+            CPPUNIT_ASSERT(canvas->undoName().empty());
+            CPPUNIT_ASSERT_EQUAL(clear, pixelAt(canvas.get(), canvas->layers()[1], 5, 5));
+        }
+        
+        void testHistoryDeltas()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Canvas::pixel_t a{{1,2,3,255}}, b{{4,5,6,255}}, clear{{0,0,0,0}};
+            canvas->fillRect("a", 0, 0, 0, 4096, 4096, a);
+            size_t filled = canvas->historyMemorySize();
+
+            // a small edit to a big layer only remembers the tiles it changed
+            // (once the next edit is under way)
+            canvas->fillRect("b", 0, 10, 10, 5, 5, b);
+            canvas->insertLayer("i", 1);
+            CPPUNIT_ASSERT(canvas->historyMemorySize() - filled < 64);
+            canvas->undo();
+
+            // edits that grow the layer come back out the same size
+            Vec origin = canvas->layers()[0].origin();
+            canvas->fillRect("c", 0, -5000, -5000, 5, 5, b);
+            CPPUNIT_ASSERT(canvas->layers()[0].origin().x < origin.x);
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], -4998, -4998));
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(origin, canvas->layers()[0].origin());
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 12, 12));
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(a, pixelAt(canvas.get(), canvas->layers()[0], 12, 12));
+            canvas->redo();
+            canvas->redo();
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 12, 12));
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], -4998, -4998));
+            CPPUNIT_ASSERT_EQUAL(clear, pixelAt(canvas.get(), canvas->layers()[0], -4990, -4990));
+        }
+        
+        void testUndoGroup()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Canvas::pixel_t a{{1,2,3,255}}, b{{4,5,6,255}}, clear{{0,0,0,0}};
+            canvas->fillRect("a", 0, 0, 0, 1024, 1024, a);
+            
+            canvas->beginUndoGroup("group");
+            canvas->fillRect("b", 0, 0, 0, 10, 10, b);
+            canvas->beginUndoGroup("inner");
+            canvas->setLayerParallax("p", 0, Vec{0.5, 0.5});
+            canvas->setLayerParallax("p", 0, Vec{0.25, 0.25});
+            canvas->endUndoGroup();
+            canvas->insertLayer("i", 1);
+            canvas->fillRect("c", 0, 2000, 2000, 10, 10, b);
+            canvas->endUndoGroup();
+            CPPUNIT_ASSERT_EQUAL(string("group"), canvas->undoName().str());
+            
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(string("a"), canvas->undoName().str());
+            CPPUNIT_ASSERT_EQUAL(size_t(1), canvas->layers().size());
+            CPPUNIT_ASSERT_EQUAL((Vec{1.0, 1.0}), canvas->layers()[0].parallax());
+            CPPUNIT_ASSERT_EQUAL(a, pixelAt(canvas.get(), canvas->layers()[0], 5, 5));
+            CPPUNIT_ASSERT_EQUAL(clear, pixelAt(canvas.get(), canvas->layers()[0], 2005, 2005));
+            
+            canvas->redo();
+            CPPUNIT_ASSERT_EQUAL(string("group"), canvas->undoName().str());
+            CPPUNIT_ASSERT_EQUAL(size_t(2), canvas->layers().size());
+            CPPUNIT_ASSERT_EQUAL((Vec{0.25, 0.25}), canvas->layers()[0].parallax());
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 5, 5));
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 2005, 2005));
+            
+            // an empty group leaves no step behind
+            canvas->beginUndoGroup("empty");
+            canvas->endUndoGroup();
+            CPPUNIT_ASSERT_EQUAL(string("group"), canvas->undoName().str());
+        }
+        
+        void testUndoCoalesce()
+        {
+            string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Canvas::pixel_t a{{1,2,3,255}}, b{{4,5,6,255}};
+            canvas->fillRect("a", 0, 0, 0, 4096, 4096, a);
+            canvas->undoCoalesceWindow(std::chrono::hours(1));
+            
+            // a drag's worth of small edits is one small step
+            for (int i = 0; i < 50; ++i)
+                canvas->fillRect("drag", 0, 40*i, 40*i, 10, 10, b);
+            canvas->insertLayer("i", 1);
+            CPPUNIT_ASSERT(canvas->historyMemorySize() < 50*64);
+            canvas->undo();
+            canvas->fillRect("other", 0, 3000, 0, 10, 10, b);
+            
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(string("drag"), canvas->undoName().str());
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 5, 5));
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 40*49 + 5, 40*49 + 5));
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(string("a"), canvas->undoName().str());
+            CPPUNIT_ASSERT_EQUAL(a, pixelAt(canvas.get(), canvas->layers()[0], 5, 5));
+            CPPUNIT_ASSERT_EQUAL(a, pixelAt(canvas.get(), canvas->layers()[0], 40*49 + 5, 40*49 + 5));
+            canvas->redo();
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 40*25 + 5, 40*25 + 5));
+            
+            // undoing ends the drag
+            canvas->fillRect("drag", 0, 3000, 3000, 10, 10, b);
+            canvas->undo();
+            CPPUNIT_ASSERT_EQUAL(b, pixelAt(canvas.get(), canvas->layers()[0], 5, 5));
+        }
+        
         void testSetLayerParallax()
         {
             string error;
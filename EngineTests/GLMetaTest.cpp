@@ -13,6 +13,8 @@
 #include <llvm/Support/raw_ostream.h>
 #include "Engine/Util/GLMeta.hpp"
 #include "GLTest.hpp"
+#include <algorithm>
+#include <vector>
 
 namespace Mega { namespace test {
     class GLMetaContextTest : public GLContextTestFixture {
@@ -20,6 +22,7 @@ namespace Mega { namespace test {
         CPPUNIT_TEST(testGLContext);
         CPPUNIT_TEST(testProgram);
         CPPUNIT_TEST(testBindVertexAttributes);
+        CPPUNIT_TEST(testStagingRing);
         CPPUNIT_TEST_SUITE_END();
 
     public:
@@ -124,6 +127,37 @@ namespace Mega { namespace test {
             _MEGA_ASSERT_ATTRIBUTE(color, GL_UNSIGNED_BYTE, GL_TRUE, 4)
 #undef _MEGA_ASSERT_ATTRIBUTE
         }
+        
+        void testStagingRing()
+        {
+            for (bool allowPersistent : {true, false}) {
+                // more rows than slots, so the ring comes around a few times
+                GLStagingRing ring;
+                ring.create(256, 4, allowPersistent);
+                CPPUNIT_ASSERT(ring);
+                if (!allowPersistent)
+                    CPPUNIT_ASSERT(!ring.isPersistent());
+                
+                GLTexture texture(gen);
+                glBindTexture(GL_TEXTURE_2D, texture);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 64, 16, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+                for (unsigned row = 0; row < 16; ++row) {
+                    std::uint8_t pixels[256];
+                    std::fill(std::begin(pixels), std::end(pixels), std::uint8_t(row + 1));
+                    GLvoid const *source = ring.write(pixels, sizeof(pixels));
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, GLint(row), 64, 1, GL_RGBA, GL_UNSIGNED_BYTE, source);
+                }
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                MEGA_CPPUNIT_ASSERT_GL_NO_ERROR;
+                
+                std::vector<std::uint8_t> readBack(64*16*4);
+                glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, readBack.data());
+                for (unsigned row = 0; row < 16; ++row) {
+                    CPPUNIT_ASSERT_EQUAL(std::uint8_t(row + 1), readBack[row*256]);
+                    CPPUNIT_ASSERT_EQUAL(std::uint8_t(row + 1), readBack[row*256 + 255]);
+                }
+            }
+        }
     };
 
     CPPUNIT_TEST_SUITE_REGISTRATION(GLMetaContextTest);
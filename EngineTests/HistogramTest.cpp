@@ -0,0 +1,82 @@
+//
+//  HistogramTest.cpp
+//  Megacanvas
+//
+//  Created by Joe Groff on 8/24/12.
+//  Copyright (c) 2012 Durian Software. All rights reserved.
+//
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "Engine/Util/Histogram.hpp"
+#include <chrono>
+
+namespace Mega { namespace test {
+    using std::chrono::nanoseconds;
+    
+    class HistogramTest : public CppUnit::TestFixture {
+        CPPUNIT_TEST_SUITE(HistogramTest);
+        CPPUNIT_TEST(testBucket);
+        CPPUNIT_TEST(testRecord);
+        CPPUNIT_TEST(testQuantile);
+        CPPUNIT_TEST_SUITE_END();
+        
+    public:
+        void setUp() override
+        {
+        }
+        
+        void tearDown() override
+        {
+        }
+        
+        void testBucket()
+        {
+            CPPUNIT_ASSERT_EQUAL(std::size_t(0), Histogram::bucket(nanoseconds(0)));
+            CPPUNIT_ASSERT_EQUAL(std::size_t(1), Histogram::bucket(nanoseconds(1)));
+            CPPUNIT_ASSERT_EQUAL(std::size_t(2), Histogram::bucket(nanoseconds(2)));
+            CPPUNIT_ASSERT_EQUAL(std::size_t(2), Histogram::bucket(nanoseconds(3)));
+            CPPUNIT_ASSERT_EQUAL(std::size_t(11), Histogram::bucket(nanoseconds(1024)));
+            // everything past the last bucket lands in it
+            CPPUNIT_ASSERT_EQUAL(Histogram::BUCKETS - 1, Histogram::bucket(nanoseconds(std::int64_t(1) << 50)));
+        }
+        
+        void testRecord()
+        {
+            Histogram h;
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), h.count);
+            CPPUNIT_ASSERT(h.mean() == nanoseconds(0));
+            CPPUNIT_ASSERT(h.quantile(0.5) == nanoseconds(0));
+            
+            h.record(nanoseconds(100));
+            h.record(nanoseconds(300));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(2), h.count);
+            CPPUNIT_ASSERT(h.total == nanoseconds(400));
+            CPPUNIT_ASSERT(h.mean() == nanoseconds(200));
+            CPPUNIT_ASSERT(h.max == nanoseconds(300));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(1), h.buckets[Histogram::bucket(nanoseconds(100))]);
+            
+            h.reset();
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), h.count);
+            CPPUNIT_ASSERT(h.total == nanoseconds(0));
+            CPPUNIT_ASSERT(h.max == nanoseconds(0));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), h.buckets[Histogram::bucket(nanoseconds(100))]);
+        }
+        
+        void testQuantile()
+        {
+            Histogram h;
+            for (int i = 0; i < 99; ++i)
+                h.record(nanoseconds(100));
+            h.record(nanoseconds(5000));
+            // quantiles are the tops of their buckets, 100ns being in [64, 128)
+            CPPUNIT_ASSERT(h.quantile(0.0) == nanoseconds(127));
+            CPPUNIT_ASSERT(h.quantile(0.5) == nanoseconds(127));
+            CPPUNIT_ASSERT(h.quantile(0.99) == nanoseconds(127));
+            // but never past the longest duration recorded
+            CPPUNIT_ASSERT(h.quantile(1.0) == nanoseconds(5000));
+        }
+    };
+    CPPUNIT_TEST_SUITE_REGISTRATION(HistogramTest);
+}}
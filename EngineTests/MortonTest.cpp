@@ -0,0 +1,70 @@
+//
+//  MortonTest.cpp
+//  Megacanvas
+//
+//  Created by Joe Groff on 8/12/12.
+//  Copyright (c) 2012 Durian Software. All rights reserved.
+//
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "Engine/Util/Morton.hpp"
+#include <vector>
+
+namespace Mega { namespace test {
+    class MortonTest : public CppUnit::TestFixture {
+        CPPUNIT_TEST_SUITE(MortonTest);
+        CPPUNIT_TEST(testEncode);
+        CPPUNIT_TEST(testDecode);
+        CPPUNIT_TEST(testEncodeRow);
+        CPPUNIT_TEST_SUITE_END();
+
+    public:
+        void setUp() override
+        {
+        }
+
+        void tearDown() override
+        {
+        }
+
+        void testEncode()
+        {
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), mortonEncode(0, 0));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(1), mortonEncode(1, 0));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(2), mortonEncode(0, 1));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(3), mortonEncode(1, 1));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(769), mortonEncode(17, 16));
+            // past 65536 tiles a side
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(1) << 32, mortonEncode(0x10000, 0));
+            CPPUNIT_ASSERT_EQUAL(~std::uint64_t(0), mortonEncode(0xFFFFFFFF, 0xFFFFFFFF));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0xAAAAAAAAAAAAAAAAULL), mortonEncode(0, 0xFFFFFFFF));
+        }
+
+        void testDecode()
+        {
+            std::uint32_t coords[][2] = {
+                {0, 0}, {1, 0}, {0, 1}, {17, 16}, {0x10000, 3},
+                {0x12345678, 0x9ABCDEF0}, {0xFFFFFFFF, 0}
+            };
+            for (auto &c : coords) {
+                std::uint32_t x, y;
+                mortonDecode(mortonEncode(c[0], c[1]), &x, &y);
+                CPPUNIT_ASSERT_EQUAL(c[0], x);
+                CPPUNIT_ASSERT_EQUAL(c[1], y);
+            }
+        }
+
+        void testEncodeRow()
+        {
+            for (std::size_t count : {0, 1, 2, 7, 64}) {
+                std::vector<std::uint64_t> row(count);
+                mortonEncodeRow(0xFFFFFFF0, 12345, count, row.data());
+                for (std::size_t i = 0; i < count; ++i)
+                    CPPUNIT_ASSERT_EQUAL(mortonEncode(std::uint32_t(0xFFFFFFF0 + i), 12345), row[i]);
+            }
+        }
+    };
+    CPPUNIT_TEST_SUITE_REGISTRATION(MortonTest);
+}}
@@ -11,13 +11,30 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "EngineTests/GLTest.hpp"
 #include "Engine/Canvas.hpp"
+#include "Engine/Layer.hpp"
 #include "Engine/TileManager.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace Mega { namespace test {
     class TileManagerTest : public GLContextTestFixture {
         CPPUNIT_TEST_SUITE(TileManagerTest);
         CPPUNIT_TEST(testRequire);
+        CPPUNIT_TEST(testRequireAfterBlit);
+        CPPUNIT_TEST(testPrefetch);
+        CPPUNIT_TEST(testUploadBudget);
+        CPPUNIT_TEST(testCoalescedUploads);
+        CPPUNIT_TEST(testTileSlots);
+        CPPUNIT_TEST(testSlotEviction);
+        CPPUNIT_TEST(testSharedPool);
+        CPPUNIT_TEST(testLayersChange);
+        CPPUNIT_TEST(testStats);
         CPPUNIT_TEST_SUITE_END();
         
         Owner<Canvas> canvas;
@@ -44,7 +61,11 @@ namespace Mega { namespace test {
         
         void testRequire()
         {
-            tileManager->require(Vec{0.0, 0.0}, Vec{128.0, 128.0});
+            // tiles are read in the background, so they aren't there yet
+            CPPUNIT_ASSERT(!tileManager->require(Vec{0.0, 0.0}, Vec{128.0, 128.0}));
+            CPPUNIT_ASSERT(!tileManager->isTileReady(1));
+            tileManager->finishLoading();
+            CPPUNIT_ASSERT(tileManager->require(Vec{0.0, 0.0}, Vec{128.0, 128.0}));
             CPPUNIT_ASSERT(tileManager->isTileReady(1));
             CPPUNIT_ASSERT(tileManager->isTileReady(2));
             CPPUNIT_ASSERT(tileManager->isTileReady(3));
@@ -53,11 +74,447 @@ namespace Mega { namespace test {
             CPPUNIT_ASSERT(tileManager->isTileReady(13));
             
             tileManager->require(Vec{444.0, -64.0}, Vec{128.0, 128.0});
+            tileManager->finishLoading();
             CPPUNIT_ASSERT(tileManager->isTileReady(8));
             CPPUNIT_ASSERT(tileManager->isTileReady(11));
             CPPUNIT_ASSERT(tileManager->isTileReady(14));
             CPPUNIT_ASSERT(tileManager->isTileReady(17));
         }
+        
+        void testRequireAfterBlit()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Owner<TileManager> tileManager = TileManager::create(canvas.get());
+            Layer layer0 = canvas->layers()[0];
+            
+            std::unique_ptr<Canvas::pixel_t[]> pixels(new Canvas::pixel_t[256*256]);
+            std::fill(&pixels[0], &pixels[256*256], Canvas::pixel_t{{1,2,3,4}});
+            canvas->blit("test1", pixels.get(), 256, 256, 256, 0, -128, -128,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+            
+            tileManager->require(Vec{0.0, 0.0}, Vec{128.0, 128.0});
+            tileManager->finishLoading();
+            Layer::tile_t before = layer0.tile(0, 0);
+            CPPUNIT_ASSERT(tileManager->isTileReady(before));
+            
+            // an edit inside the region already mapped shows up without
+            // moving the view
+            canvas->blit("test2", pixels.get(), 256, 16, 16, 0, 8, 8,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+            Layer::tile_t after = layer0.tile(0, 0);
+            CPPUNIT_ASSERT(after != before);
+            // the old tile stays up until the new one is in
+            CPPUNIT_ASSERT(!tileManager->require(Vec{0.0, 0.0}, Vec{128.0, 128.0}));
+            CPPUNIT_ASSERT_EQUAL(std::size_t(before), tileManager->mappedTile(0, 0, 0));
+            tileManager->finishLoading();
+            CPPUNIT_ASSERT(tileManager->isTileReady(after));
+            CPPUNIT_ASSERT_EQUAL(std::size_t(after), tileManager->mappedTile(0, 0, 0));
+            CPPUNIT_ASSERT(tileManager->isTileReady(layer0.tile(-1, -1)));
+            
+            // the old tile is still resident, so undoing brings it right back
+            canvas->undo();
+            CPPUNIT_ASSERT(tileManager->require(Vec{0.0, 0.0}, Vec{128.0, 128.0}));
+            CPPUNIT_ASSERT_EQUAL(std::size_t(before), tileManager->mappedTile(0, 0, 0));
+        }
+        
+        void testPrefetch()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Owner<TileManager> tileManager = TileManager::create(canvas.get());
+            CPPUNIT_ASSERT(!tileManager->prefetch());
+            
+            ptrdiff_t tileSize = ptrdiff_t(canvas->tileSize());
+            // a different color in each column, so every tile has to be read
+            for (ptrdiff_t x = 0; x < 64; ++x)
+                canvas->fillRect("strip", 0, (x - 1)*tileSize, -tileSize, tileSize, 2*tileSize,
+                                 Canvas::pixel_t{{uint8_t(x),2,3,255}});
+            Layer layer0 = canvas->layers()[0];
+            
+            // standing still, there's nothing to look ahead to
+            tileManager->require(Vec{0.0, 0.0}, Vec{128.0, 128.0});
+            CPPUNIT_ASSERT(!tileManager->prefetch());
+            
+            // scrolling along the strip, there is, once
+            tileManager->require(Vec{double(tileSize), 0.0}, Vec{128.0, 128.0});
+            CPPUNIT_ASSERT(tileManager->prefetch());
+            CPPUNIT_ASSERT(!tileManager->prefetch());
+            tileManager->finishLoading();
+            // the tiles ahead are read in the background, then go into
+            // free slots
+            Vec inView = ((Vec{double(tileSize), 0.0} - layer0.origin())/tileSize).floor();
+            bool ahead = false;
+            for (ptrdiff_t x = ptrdiff_t(inView.x) + 1; x < ptrdiff_t(inView.x) + 16; ++x)
+                ahead = ahead || tileManager->isTileReady(layer0.tile(x, ptrdiff_t(inView.y)));
+            CPPUNIT_ASSERT(ahead);
+            
+            // and scrolling away from it, there isn't
+            for (int i = 1; i < 16; ++i)
+                tileManager->require(Vec{double(tileSize), -double(i*tileSize)}, Vec{128.0, 128.0});
+            CPPUNIT_ASSERT(!tileManager->prefetch());
+        }
+        
+        void testUploadBudget()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Owner<TileManager> tileManager = TileManager::create(canvas.get());
+            tileManager->uploadBudget(canvas->tileByteSize());
+            
+            // four different tiles around the layer's origin
+            std::unique_ptr<Canvas::pixel_t[]> pixels(new Canvas::pixel_t[256*256]);
+            for (std::size_t i = 0; i < 256*256; ++i)
+                pixels[i] = Canvas::pixel_t{{std::uint8_t(i), std::uint8_t(i >> 8), 7, 255}};
+            canvas->blit("gradient", pixels.get(), 256, 256, 256, 0, 0, 0,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+            Layer layer0 = canvas->layers()[0];
+            Vec center = layer0.origin() + Vec{1.0, 1.0};
+            
+            CPPUNIT_ASSERT(!tileManager->require(center, Vec{128.0, 128.0}));
+            CPPUNIT_ASSERT_EQUAL(std::size_t(4), tileManager->pendingTileCount());
+            
+            // one tile a frame, starting with the one in the middle
+            std::size_t pending = 4;
+            for (int tries = 0; pending > 0 && tries < 10000; ++tries) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                tileManager->require(center, Vec{128.0, 128.0});
+                std::size_t nowPending = tileManager->pendingTileCount();
+                CPPUNIT_ASSERT(nowPending == pending || nowPending == pending - 1);
+                if (pending == 4 && nowPending == 3) {
+                    CPPUNIT_ASSERT(tileManager->isTileReady(layer0.tile(0, 0)));
+                    CPPUNIT_ASSERT(!tileManager->isTileReady(layer0.tile(-1, -1)));
+                }
+                pending = nowPending;
+            }
+            CPPUNIT_ASSERT_EQUAL(std::size_t(0), pending);
+            CPPUNIT_ASSERT(tileManager->isTileReady(layer0.tile(-1, -1)));
+        }
+        
+        void testCoalescedUploads()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Owner<TileManager> tileManager = TileManager::create(canvas.get());
+            
+            // a 4x2 block of tiles, which lands in the first free slots
+            std::unique_ptr<Canvas::pixel_t[]> pixels(new Canvas::pixel_t[512*256]);
+            for (std::size_t y = 0; y < 256; ++y)
+                for (std::size_t x = 0; x < 512; ++x)
+                    pixels[y*512 + x] = Canvas::pixel_t{{std::uint8_t(x), std::uint8_t(y), std::uint8_t(x >> 8), 255}};
+            canvas->blit("gradient", pixels.get(), 512, 512, 256, 0, 0, 0,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+            Layer layer0 = canvas->layers()[0];
+            tileManager->require(layer0.origin(), Vec{512.0, 256.0});
+            tileManager->finishLoading();
+            
+            std::size_t textureSize = tileManager->textureSize();
+            std::vector<Canvas::pixel_t> texels(textureSize*textureSize);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, tileManager->texture());
+            glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_BGRA, GL_UNSIGNED_BYTE, texels.data());
+            MEGA_CPPUNIT_ASSERT_GL_NO_ERROR;
+            
+            std::size_t tileSize = canvas->tileSize(), textureTiles = textureSize/tileSize;
+            for (std::ptrdiff_t ty = -1; ty < 1; ++ty)
+                for (std::ptrdiff_t tx = -2; tx < 2; ++tx) {
+                    std::size_t slot = tileManager->tileSlot(layer0.tile(tx, ty));
+                    CPPUNIT_ASSERT(slot < 8);
+                    std::size_t sx = (slot % textureTiles)*tileSize;
+                    std::size_t sy = (slot / textureTiles)*tileSize;
+                    for (std::size_t p : {std::size_t(0), std::size_t(37), tileSize - 1}) {
+                        std::size_t cx = (tx + 2)*tileSize + p, cy = (ty + 1)*tileSize + tileSize - 1 - p;
+                        Canvas::pixel_t texel = texels[(sy + tileSize - 1 - p)*textureSize + sx + p];
+                        CPPUNIT_ASSERT(texel == pixels[cy*512 + cx]);
+                    }
+                }
+        }
+        
+        void testTileSlots()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Owner<TileManager> tileManager = TileManager::create(canvas.get());
+            double tileSize = double(canvas->tileSize());
+            
+            // a 4x4 block of tiles, all the same solid tile
+            canvas->fillRect("fill", 0, 0, 0, 4*canvas->tileSize(), 4*canvas->tileSize(),
+                             Canvas::pixel_t{{1,2,3,255}});
+            Layer layer0 = canvas->layers()[0];
+            Layer::tile_t solid = layer0.tile(0, 0);
+            CPPUNIT_ASSERT(solid != 0);
+            
+            tileManager->require(layer0.origin(), Vec{4*tileSize, 4*tileSize});
+            CPPUNIT_ASSERT_EQUAL(std::size_t(-1), tileManager->tileSlot(solid));
+            tileManager->finishLoading();
+            CPPUNIT_ASSERT(tileManager->isTileReady(solid));
+            // every place the tile shows up shares its one slot
+            std::size_t slot = tileManager->tileSlot(solid);
+            CPPUNIT_ASSERT(slot < tileManager->slotCount());
+            for (std::ptrdiff_t y = -2; y < 2; ++y)
+                for (std::ptrdiff_t x = -2; x < 2; ++x)
+                    CPPUNIT_ASSERT_EQUAL(std::size_t(layer0.tile(x, y)), tileManager->mappedTile(0, x, y));
+            
+            // a view a texture's width away shows empty space, but the
+            // tile stays where it was
+            std::size_t textureTiles = tileManager->textureSize()/canvas->tileSize();
+            tileManager->require(layer0.origin() + Vec{textureTiles*tileSize, 0.0},
+                                 Vec{4*tileSize, 4*tileSize});
+            tileManager->finishLoading();
+            CPPUNIT_ASSERT_EQUAL(std::size_t(0), tileManager->mappedTile(0, textureTiles, 0));
+            CPPUNIT_ASSERT(tileManager->isTileReady(solid));
+            CPPUNIT_ASSERT_EQUAL(slot, tileManager->tileSlot(solid));
+        }
+        
+        void testSlotEviction()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            std::size_t tileSize = canvas->tileSize();
+            // sixteen slots
+            Owner<TileManager> tileManager = TileManager::create(canvas.get(), 16*canvas->tileByteSize());
+            CPPUNIT_ASSERT_EQUAL(std::size_t(16), tileManager->slotCount());
+            
+            // a row of 24 different tiles
+            std::size_t width = 24*tileSize;
+            std::unique_ptr<Canvas::pixel_t[]> pixels(new Canvas::pixel_t[width*tileSize]);
+            for (std::size_t i = 0; i < width*tileSize; ++i)
+                pixels[i] = Canvas::pixel_t{{std::uint8_t(i), std::uint8_t(i >> 8), std::uint8_t(i >> 16), 255}};
+            canvas->blit("row", pixels.get(), width, width, tileSize, 0, 0, 0,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+            Layer layer0 = canvas->layers()[0];
+            Vec origin = layer0.origin();
+            std::ptrdiff_t firstTile = std::ptrdiff_t(std::floor(-origin.x/tileSize));
+            
+            // look at tiles 2k and 2k+1 in the layer's tile row 0
+            auto look = [&](std::size_t k) {
+                bool ready = tileManager->require(Vec{(2*k + 1)*double(tileSize), origin.y + 0.5*tileSize},
+                                                  Vec{2.0*tileSize, double(tileSize)});
+                tileManager->finishLoading();
+                return ready;
+            };
+            auto resident = [&](std::ptrdiff_t x) {
+                return tileManager->isTileReady(layer0.tile(firstTile + x, 0));
+            };
+            
+            // panning back and forth over tiles that fit in the texture
+            // uploads them once
+            for (std::size_t k = 0; k < 4; ++k)
+                CPPUNIT_ASSERT(!look(k));
+            CPPUNIT_ASSERT(look(0));
+            CPPUNIT_ASSERT(look(3));
+            CPPUNIT_ASSERT(look(0));
+            
+            // going farther evicts the tiles seen longest ago first: the
+            // eight free slots go, then tiles 2 through 5
+            for (std::size_t k = 4; k < 10; ++k)
+                CPPUNIT_ASSERT(!look(k));
+            for (std::ptrdiff_t x = 2; x < 6; ++x)
+                CPPUNIT_ASSERT(!resident(x));
+            for (std::ptrdiff_t x : {0, 1, 6, 7})
+                CPPUNIT_ASSERT(resident(x));
+            for (std::ptrdiff_t x = 8; x < 20; ++x)
+                CPPUNIT_ASSERT(resident(x));
+            CPPUNIT_ASSERT(look(0));
+            CPPUNIT_ASSERT(!look(1));
+        }
+        
+        void testSharedPool()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            canvas->insertLayer("insert", 1);
+            std::size_t tileSize = canvas->tileSize(), tileByteSize = canvas->tileByteSize();
+            
+            // the pool's size doesn't depend on how many layers there are
+            GLint depth = 0;
+            {
+                Owner<TileManager> tileManager = TileManager::create(canvas.get());
+                CPPUNIT_ASSERT_EQUAL(std::size_t(1), tileManager->poolPages());
+                glBindTexture(GL_TEXTURE_2D_ARRAY, tileManager->texture());
+                glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_DEPTH, &depth);
+                CPPUNIT_ASSERT_EQUAL(GLint(1), depth);
+            }
+            
+            // room for 60 tiles makes three pages of sixteen
+            Owner<TileManager> tileManager = TileManager::create(canvas.get(), 60*tileByteSize);
+            CPPUNIT_ASSERT_EQUAL(4*tileSize, tileManager->textureSize());
+            CPPUNIT_ASSERT_EQUAL(std::size_t(3), tileManager->poolPages());
+            CPPUNIT_ASSERT_EQUAL(std::size_t(48), tileManager->slotCount());
+            glBindTexture(GL_TEXTURE_2D_ARRAY, tileManager->texture());
+            glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_DEPTH, &depth);
+            CPPUNIT_ASSERT_EQUAL(GLint(3), depth);
+            MEGA_CPPUNIT_ASSERT_GL_NO_ERROR;
+            
+            // a solid block in the bottom layer with a gradient over its
+            // left two thirds, and the same solid color over the right third
+            // in the top layer
+            std::size_t size = 4*tileSize;
+            canvas->fillRect("fill", 0, 0, 0, size + size/2, size, Canvas::pixel_t{{1,2,3,255}});
+            canvas->fillRect("fill", 1, size, 0, size/2, size, Canvas::pixel_t{{1,2,3,255}});
+            std::unique_ptr<Canvas::pixel_t[]> pixels(new Canvas::pixel_t[size*size]);
+            for (std::size_t i = 0; i < size*size; ++i)
+                pixels[i] = Canvas::pixel_t{{std::uint8_t(i), std::uint8_t(i >> 8), std::uint8_t(i >> 16), 255}};
+            canvas->blit("gradient", pixels.get(), size, size, size, 0, 0, 0,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+                         
+            Vec center = Vec{0.75*size, 0.5*size}, viewport = Vec{1.5*size, double(size)};
+            tileManager->require(center, viewport);
+            tileManager->finishLoading();
+            CPPUNIT_ASSERT_EQUAL(std::size_t(0), tileManager->pendingTileCount());
+            
+            // every tile in view has a slot to itself, even the ones in
+            // both layers, and the pool holds what the canvas does
+            std::map<std::size_t, std::size_t> slots;
+            std::size_t places = 0;
+            std::unique_ptr<std::uint8_t[]> tile(new std::uint8_t[tileByteSize]);
+            std::vector<std::uint8_t> texels(3*size*size*4);
+            glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_BGRA, GL_UNSIGNED_BYTE, texels.data());
+            MEGA_CPPUNIT_ASSERT_GL_NO_ERROR;
+            for (std::size_t i = 0; i < 2; ++i) {
+                Layer l = canvas->layers()[i];
+                Vec layerCenter = center - l.origin();
+                Rect view{((layerCenter - 0.5*viewport)/tileSize).floor(),
+                          ((layerCenter + 0.5*viewport)/tileSize).ceil()};
+                l.forEachTileInRect(view, [&](std::ptrdiff_t x, std::ptrdiff_t y, Layer::tile_t t) {
+                    ++places;
+                    CPPUNIT_ASSERT_EQUAL(std::size_t(t), tileManager->mappedTile(i, x, y));
+                    std::size_t slot = tileManager->tileSlot(t);
+                    CPPUNIT_ASSERT(slot < tileManager->slotCount());
+                    slots[slot] = t;
+                });
+            }
+            CPPUNIT_ASSERT(slots.size() > 16);
+            CPPUNIT_ASSERT(slots.size() < places);
+            for (auto &slot : slots) {
+                CPPUNIT_ASSERT_EQUAL(slot.first, tileManager->tileSlot(slot.second));
+                CPPUNIT_ASSERT(canvas->loadTileInto(slot.second, {tile.get(), tileByteSize}, &error));
+                std::size_t page = slot.first/16, sx = slot.first%4*tileSize, sy = slot.first%16/4*tileSize;
+                for (std::size_t row = 0; row < tileSize; ++row)
+                    CPPUNIT_ASSERT(std::equal(&tile[row*tileSize*4], &tile[(row + 1)*tileSize*4],
+                                              &texels[((page*size + sy + row)*size + sx)*4]));
+            }
+        }
+        
+        void testLayersChange()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Owner<TileManager> tileManager = TileManager::create(canvas.get());
+            double tileSize = double(canvas->tileSize());
+            
+            std::unique_ptr<Canvas::pixel_t[]> pixels(new Canvas::pixel_t[256*256]);
+            for (std::size_t y = 0; y < 256; ++y)
+                for (std::size_t x = 0; x < 256; ++x)
+                    pixels[y*256 + x] = Canvas::pixel_t{{std::uint8_t(x), std::uint8_t(y), 0, 255}};
+            canvas->blit("gradient", pixels.get(), 256, 256, 256, 0, 0, 0,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+                         
+            Vec center{128.0, 128.0}, viewport{256.0, 256.0};
+            // every tile of layer i in view shows in its page table
+            auto mapped = [&](std::size_t i) {
+                tileManager->require(center, viewport);
+                tileManager->finishLoading();
+                Layer l = canvas->layers()[i];
+                Vec layerCenter = center - l.origin();
+                Rect view{((layerCenter - 0.5*viewport)/tileSize).floor(),
+                          ((layerCenter + 0.5*viewport)/tileSize).ceil()};
+                std::size_t count = 0;
+                l.forEachTileInRect(view, [&](std::ptrdiff_t x, std::ptrdiff_t y, Layer::tile_t t) {
+                    CPPUNIT_ASSERT_EQUAL(std::size_t(t), tileManager->mappedTile(i, x, y));
+                    ++count;
+                });
+                return count;
+            };
+            CPPUNIT_ASSERT(mapped(0) > 0);
+            
+            // a layer inserted underneath moves the gradient up one
+            canvas->insertLayer("insert", 0);
+            CPPUNIT_ASSERT(mapped(1) > 0);
+            
+            // merging the two leaves one
+            canvas->mergeLayers("merge", 0, 2);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(1), canvas->layers().size());
+            CPPUNIT_ASSERT(mapped(0) > 0);
+            
+            canvas->undo();
+            CPPUNIT_ASSERT(mapped(1) > 0);
+            canvas->undo();
+            CPPUNIT_ASSERT(mapped(0) > 0);
+        }
+        
+        void testStats()
+        {
+            std::string error;
+            Owner<Canvas> canvas = Canvas::create(&error);
+            CPPUNIT_ASSERT(canvas);
+            Owner<TileManager> tileManager = TileManager::create(canvas.get());
+            double tileSize = double(canvas->tileSize());
+            std::size_t tileByteSize = canvas->tileByteSize();
+            
+            // a 4x2 block of distinct tiles
+            std::unique_ptr<Canvas::pixel_t[]> pixels(new Canvas::pixel_t[512*256]);
+            for (std::size_t y = 0; y < 256; ++y)
+                for (std::size_t x = 0; x < 512; ++x)
+                    pixels[y*512 + x] = Canvas::pixel_t{{std::uint8_t(x), std::uint8_t(y), std::uint8_t(x >> 8), 255}};
+            canvas->blit("gradient", pixels.get(), 512, 512, 256, 0, 0, 0,
+                         [](Canvas::pixel_t s, Canvas::pixel_t d) { return s; });
+            Layer layer0 = canvas->layers()[0];
+            Vec here = layer0.origin(), viewport{512.0, 256.0};
+            std::size_t textureTiles = tileManager->textureSize()/canvas->tileSize();
+            Vec away = here + Vec{textureTiles*tileSize, 0.0};
+            
+            // tiles read for a view that moved on before they arrived are
+            // skipped
+            tileManager->require(here, viewport);
+            tileManager->require(away, viewport);
+            tileManager->finishLoading();
+            TileManager::Stats const &stats = tileManager->stats();
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(8), stats.tilesRequested);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(8), stats.tilesSkipped);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), stats.tilesUploaded);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(2), stats.mapTime.count);
+            
+            tileManager->resetStats();
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), stats.tilesRequested);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), stats.tilesSkipped);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), stats.mapTime.count);
+            
+            tileManager->require(here, viewport);
+            tileManager->finishLoading();
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(8), stats.tilesRequested);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(8), stats.tilesUploaded);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(8*tileByteSize), stats.bytesUploaded);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), stats.tilesResident);
+            CPPUNIT_ASSERT(stats.uploadCalls >= 1 && stats.uploadCalls <= 8);
+            CPPUNIT_ASSERT_EQUAL(stats.uploadCalls, stats.copyTime.count);
+            CPPUNIT_ASSERT_EQUAL(stats.uploadCalls, stats.uploadTime.count);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(1), stats.mapTime.count);
+            
+            // coming back to tiles still in the pool costs no reads
+            tileManager->resetStats();
+            tileManager->require(away, viewport);
+            CPPUNIT_ASSERT(tileManager->require(here, viewport));
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(8), stats.tilesResident);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), stats.tilesRequested);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), stats.uploadCalls);
+            
+            // tiles in view that don't fit in the pool are counted, not
+            // uploaded
+            Owner<TileManager> small = TileManager::create(canvas.get(), 4*tileByteSize);
+            small->require(here, viewport);
+            small->finishLoading();
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(4), small->stats().tilesUploaded);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(4), small->stats().tilesNoSlot);
+            CPPUNIT_ASSERT_EQUAL(std::uint64_t(0), small->stats().tilesSkipped);
+        }
     };    
     CPPUNIT_TEST_SUITE_REGISTRATION(TileManagerTest);
 }}
\ No newline at end of file
@@ -0,0 +1,302 @@
+//
+//  TileTreeTest.cpp
+//  Megacanvas
+//
+//  Created by Joe Groff on 8/9/12.
+//  Copyright (c) 2012 Durian Software. All rights reserved.
+//
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "Engine/Layer.hpp"
+#include "Engine/TileTree.hpp"
+#include <utility>
+#include <vector>
+
+namespace Mega { namespace test {
+    class TileTreeTest : public CppUnit::TestFixture {
+        CPPUNIT_TEST_SUITE(TileTreeTest);
+        CPPUNIT_TEST(testSetAndGet);
+        CPPUNIT_TEST(testCopiesAreIndependent);
+        CPPUNIT_TEST(testRun);
+        CPPUNIT_TEST(testGrow);
+        CPPUNIT_TEST(testGrowSharesNodes);
+        CPPUNIT_TEST(testEmbedExtract);
+        CPPUNIT_TEST(testForEachDifference);
+        CPPUNIT_TEST(testForEachTileInRect);
+        CPPUNIT_TEST(testSparseLeaves);
+        CPPUNIT_TEST(testCoverage);
+        CPPUNIT_TEST_SUITE_END();
+
+    public:
+        void setUp() override
+        {
+        }
+
+        void tearDown() override
+        {
+        }
+
+        void testSetAndGet()
+        {
+            TileTree tree(6);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(4096), tree.size());
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), tree[1234]);
+            tree.set(1234, 7);
+            tree.set(0, 1);
+            tree.set(4095, 2);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(7), tree[1234]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(1), tree[0]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(2), tree[4095]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), tree[1235]);
+
+            std::vector<std::pair<std::size_t, TileTree::tile_t>> tiles;
+            tree.forEachTile([&](std::size_t i, TileTree::tile_t t) { tiles.emplace_back(i, t); });
+            CPPUNIT_ASSERT_EQUAL(std::size_t(3), tiles.size());
+            CPPUNIT_ASSERT(tiles[0] == std::make_pair(std::size_t(0), TileTree::tile_t(1)));
+            CPPUNIT_ASSERT(tiles[1] == std::make_pair(std::size_t(1234), TileTree::tile_t(7)));
+            CPPUNIT_ASSERT(tiles[2] == std::make_pair(std::size_t(4095), TileTree::tile_t(2)));
+        }
+
+        void testCopiesAreIndependent()
+        {
+            TileTree a(8);
+            a.set(100, 1);
+            TileTree b = a;
+            b.set(100, 2);
+            b.set(60000, 3);
+            a.set(101, 4);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(1), a[100]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(4), a[101]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), a[60000]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(2), b[100]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), b[101]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(3), b[60000]);
+        }
+
+        void testRun()
+        {
+            std::vector<TileTree::tile_t> dense(1 << 12);
+            for (std::size_t i = 0; i < dense.size(); ++i)
+                dense[i] = TileTree::tile_t(i % 5);
+            TileTree tree(6, dense);
+            llvm::ArrayRef<TileTree::tile_t> run = tree.run(256, 64);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(64), run.size());
+            for (std::size_t i = 0; i < 64; ++i)
+                CPPUNIT_ASSERT_EQUAL(dense[256 + i], run[i]);
+
+            // unwritten space reads as zeros
+            TileTree empty(10);
+            run = empty.run(TileTree::LEAF_SIZE*5, TileTree::LEAF_SIZE);
+            CPPUNIT_ASSERT_EQUAL(TileTree::LEAF_SIZE, run.size());
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), run[17]);
+        }
+
+        void testGrow()
+        {
+            TileTree small(1);
+            small.set(3, 9);
+            small.grow(3);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(2), small.depth);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(9), small[15]);
+            small.grow(0);
+            small.grow(0);
+            small.grow(0);
+            small.grow(1);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(6), small.depth);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(9), small[1024 + 15]);
+
+            TileTree big(TileTree::LEAF_LOG_SIZE + 2);
+            big.set(5, 1);
+            TileTree before = big;
+            big.grow(2);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(1), big[2*before.size() + 5]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), big[5]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(1), before[5]);
+        }
+
+        void testGrowSharesNodes()
+        {
+            TileTree tree(TileTree::LEAF_LOG_SIZE + 4);
+            for (std::size_t i = 0; i < tree.size(); i += 7)
+                tree.set(i, TileTree::tile_t(i + 1));
+            std::size_t size = tree.ownedMemorySize();
+
+            // growing wraps the old root rather than copying it, however
+            // big the tree is
+            TileTree grown = tree;
+            std::size_t moved = 7, quadrantSize = tree.size();
+            for (unsigned i = 0; i < 8; ++i) {
+                grown.grow(i % 4);
+                moved += (i % 4)*quadrantSize;
+                quadrantSize <<= 2;
+            }
+            CPPUNIT_ASSERT_EQUAL(std::size_t(0), tree.ownedMemorySize());
+            CPPUNIT_ASSERT(grown.ownedMemorySize() < size/8);
+            tree = TileTree();
+            CPPUNIT_ASSERT(grown.ownedMemorySize() >= size);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(8), grown[moved]);
+        }
+
+        void testEmbedExtract()
+        {
+            TileTree small(2);
+            small.set(5, 1);
+            TileTree tree = small;
+            // x=12, y=4 puts the old tree in quadrant 3 of quadrant 1
+            tree.embed(TileTree::LEAF_LOG_SIZE + 2, 12, 4);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(1), tree[(1 << 6) + (3 << 4) + 5]);
+            tree.extract(2, 12, 4);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(2), tree.depth);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(1), tree[5]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), tree[4]);
+        }
+
+        void testForEachDifference()
+        {
+            TileTree a(10);
+            for (std::size_t i = 0; i < a.size(); i += 97)
+                a.set(i, TileTree::tile_t(i));
+            TileTree b = a;
+            b.set(97, 1);
+            b.set(500000, 2);
+            b.set(970, 0);
+
+            std::vector<std::size_t> differences;
+            a.forEachDifference(b, [&](std::size_t i) { differences.push_back(i); });
+            CPPUNIT_ASSERT_EQUAL(std::size_t(3), differences.size());
+            CPPUNIT_ASSERT_EQUAL(std::size_t(97), differences[0]);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(970), differences[1]);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(500000), differences[2]);
+        }
+
+        void testForEachTileInRect()
+        {
+            // (x, y) is at index swizzle(x, y)
+            TileTree tree(TileTree::LEAF_LOG_SIZE + 3);
+            tree.set(0, 1);                 // 0, 0
+            tree.set(3, 2);                 // 1, 1
+            tree.set(769, 3);               // 17, 16
+            tree.set(tree.size() - 1, 4);   // 127, 127
+
+            std::vector<std::pair<std::size_t, std::size_t>> coords;
+            std::vector<TileTree::tile_t> tiles;
+            auto visit = [&](std::size_t x, std::size_t y, TileTree::tile_t tile) {
+                coords.emplace_back(x, y);
+                tiles.push_back(tile);
+            };
+            tree.forEachTileInRect(1, 1, 18, 17, visit);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(2), tiles.size());
+            CPPUNIT_ASSERT(coords[0] == std::make_pair(std::size_t(1), std::size_t(1)));
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(2), tiles[0]);
+            CPPUNIT_ASSERT(coords[1] == std::make_pair(std::size_t(17), std::size_t(16)));
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(3), tiles[1]);
+
+            coords.clear();
+            tiles.clear();
+            tree.forEachTileInRect(0, 0, 128, 128, visit);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(4), tiles.size());
+            CPPUNIT_ASSERT(coords[3] == std::make_pair(std::size_t(127), std::size_t(127)));
+
+            tiles.clear();
+            tree.forEachTileInRect(2, 2, 16, 16, visit);
+            CPPUNIT_ASSERT(tiles.empty());
+        }
+
+        void testSparseLeaves()
+        {
+            // a leaf with a few tiles costs about what they hold
+            TileTree leaf(TileTree::LEAF_LOG_SIZE);
+            leaf.set(100, 1);
+            leaf.set(200, 2);
+            CPPUNIT_ASSERT(leaf.ownedMemorySize() < TileTree::LEAF_SIZE*sizeof(TileTree::tile_t)/4);
+            
+            TileTree tree(TileTree::LEAF_LOG_SIZE + 10);
+            tree.set(0, 1);
+            tree.set(tree.size()/3, 2);
+            tree.set(tree.size() - 1, 3);
+            std::size_t sparseSize = tree.ownedMemorySize();
+
+            // filling a leaf switches it over to dense storage
+            for (std::size_t i = 0; i < TileTree::LEAF_SIZE; ++i)
+                tree.set(i, TileTree::tile_t(i + 1));
+            for (std::size_t i = 0; i < TileTree::LEAF_SIZE; ++i)
+                CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(i + 1), tree[i]);
+            CPPUNIT_ASSERT(tree.ownedMemorySize() > sparseSize + TileTree::LEAF_SIZE*sizeof(TileTree::tile_t)/2);
+
+            // and emptying it out drops it
+            for (std::size_t i = 0; i < TileTree::LEAF_SIZE; ++i)
+                tree.set(i, 0);
+            CPPUNIT_ASSERT(tree.ownedMemorySize() < sparseSize);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), tree[0]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(2), tree[tree.size()/3]);
+            tree.set(tree.size()/3, 0);
+            tree.set(tree.size() - 1, 0);
+            CPPUNIT_ASSERT_EQUAL(std::size_t(0), tree.ownedMemorySize());
+
+            // runs of sparse leaves read the same as dense ones
+            TileTree sparse(TileTree::LEAF_LOG_SIZE);
+            sparse.set(7, 5);
+            llvm::ArrayRef<TileTree::tile_t> run = sparse.run(0, TileTree::LEAF_SIZE);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(5), run[7]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), run[8]);
+            
+            // a copy that's written to expands its own leaf, leaving the
+            // original's run as it was
+            TileTree copy = sparse;
+            copy.set(8, 6);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), run[8]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(6), copy.run(0, TileTree::LEAF_SIZE)[8]);
+            CPPUNIT_ASSERT_EQUAL(TileTree::tile_t(0), sparse.run(0, TileTree::LEAF_SIZE)[8]);
+            CPPUNIT_ASSERT(sparse.run(0, TileTree::LEAF_SIZE).data() == run.data());
+        }
+
+        void testCoverage()
+        {
+            // an opaque 32x32 square at 32,32, with one clear tile at 40,40
+            // and one translucent tile at 64,64
+            TileTree tree(TileTree::LEAF_LOG_SIZE + 3);
+            for (std::size_t y = 32; y < 64; ++y)
+                for (std::size_t x = 32; x < 64; ++x)
+                    tree.set(swizzle(x, y), 1, true);
+            tree.set(swizzle(40, 40), 0, true);
+            tree.set(swizzle(64, 64), 2);
+            CPPUNIT_ASSERT(!tree.isOpaque(swizzle(40, 40)));
+            CPPUNIT_ASSERT(!tree.isOpaque(swizzle(64, 64)));
+            CPPUNIT_ASSERT(tree.isOpaque(swizzle(41, 40)));
+
+            CPPUNIT_ASSERT(tree.coverage(32, 32, 64, 40) == TileTree::Coverage::Opaque);
+            CPPUNIT_ASSERT(tree.coverage(41, 33, 63, 63) == TileTree::Coverage::Opaque);
+            CPPUNIT_ASSERT(tree.coverage(32, 32, 64, 64) == TileTree::Coverage::Partial);
+            CPPUNIT_ASSERT(tree.coverage(40, 40, 41, 41) == TileTree::Coverage::Empty);
+            CPPUNIT_ASSERT(tree.coverage(0, 0, 32, 128) == TileTree::Coverage::Empty);
+            CPPUNIT_ASSERT(tree.coverage(64, 64, 65, 65) == TileTree::Coverage::Partial);
+            CPPUNIT_ASSERT(tree.coverage(5, 5, 5, 6) == TileTree::Coverage::Empty);
+
+            // the counts follow copies, growth and changes in opacity alone
+            TileTree grown = tree;
+            grown.grow(3);
+            CPPUNIT_ASSERT(grown.coverage(160, 160, 192, 168) == TileTree::Coverage::Opaque);
+            CPPUNIT_ASSERT(tree.coverage(32, 32, 64, 40) == TileTree::Coverage::Opaque);
+            tree.set(swizzle(50, 35), 1, false);
+            CPPUNIT_ASSERT(tree.coverage(32, 32, 64, 40) == TileTree::Coverage::Partial);
+            CPPUNIT_ASSERT(grown.coverage(160, 160, 192, 168) == TileTree::Coverage::Opaque);
+            tree.extract(TileTree::LEAF_LOG_SIZE, 48, 48);
+            CPPUNIT_ASSERT(tree.coverage(0, 0, 16, 16) == TileTree::Coverage::Opaque);
+
+            // small trees count their tiles too
+            TileTree small(1);
+            small.set(0, 1, true);
+            small.set(1, 1, true);
+            small.set(2, 1, true);
+            CPPUNIT_ASSERT(small.coverage(0, 0, 2, 2) == TileTree::Coverage::Partial);
+            small.set(3, 1, true);
+            CPPUNIT_ASSERT(small.coverage(0, 0, 2, 2) == TileTree::Coverage::Opaque);
+            small.grow(2);
+            CPPUNIT_ASSERT(small.coverage(0, 2, 2, 4) == TileTree::Coverage::Opaque);
+            CPPUNIT_ASSERT(small.coverage(0, 0, 2, 4) == TileTree::Coverage::Partial);
+        }
+    };
+    CPPUNIT_TEST_SUITE_REGISTRATION(TileTreeTest);
+}}
@@ -75,8 +75,10 @@ static void MegaCanvasView_resize(MegaCanvasView *self)
 {
     auto context = self.openGLContext;
     [context makeCurrentContext];
-    view->render();
+    bool complete = view->render();
     [context flushBuffer];
+    if (!complete)
+        dispatch_async(dispatch_get_main_queue(), ^{ self.needsDisplay = YES; });
 }
 
 - (void)scrollWheel:(NSEvent *)event